@@ -0,0 +1,149 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorAnalysis.h"
+
+#include "SelectorExpression.h"
+#include "SelectorProgram.h"
+#include "SelectorTerms.h"
+#include "SelectorValue.h"
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+using std::string;
+using std::vector;
+
+namespace {
+
+double number(const Value& v)
+{
+    return v.type==Value::T_EXACT ? double(v.i) : v.x;
+}
+
+// Restrict id to the values of an = or IN term
+void restrict(SelectorAnalysis::Identifier& id, const vector<Value>& values)
+{
+    vector<double> numbers;
+    vector<string> strings;
+    unsigned bools = 0;
+    for (auto& v : values) {
+        switch (v.type) {
+        case Value::T_BOOL: bools |= 1u << v.b; break;
+        case Value::T_STRING: strings.push_back(*v.s); break;
+        case Value::T_EXACT:
+        case Value::T_INEXACT:
+            // NaN is never equal to anything
+            if (!std::isnan(number(v))) numbers.push_back(number(v));
+            break;
+        default: break;
+        }
+    }
+    std::sort(numbers.begin(), numbers.end());
+    numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+    std::sort(strings.begin(), strings.end());
+    strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+
+    if (!id.restricted) {
+        id.restricted = true;
+        id.numbers.swap(numbers);
+        id.strings.swap(strings);
+        id.bools = bools;
+        return;
+    }
+    vector<double> ns;
+    std::set_intersection(id.numbers.begin(), id.numbers.end(), numbers.begin(), numbers.end(), std::back_inserter(ns));
+    id.numbers.swap(ns);
+    vector<string> ss;
+    std::set_intersection(id.strings.begin(), id.strings.end(), strings.begin(), strings.end(), std::back_inserter(ss));
+    id.strings.swap(ss);
+    id.bools &= bools;
+}
+
+}
+
+SelectorAnalysis::Identifier::Identifier(const string& n) :
+    name(n),
+    missing(MISSING_ANY),
+    restricted(false),
+    bools(0),
+    ranged(false),
+    lower(-HUGE_VAL),
+    upper(HUGE_VAL)
+{}
+
+const SelectorAnalysis::Identifier* SelectorAnalysis::find(const string& name) const
+{
+    for (auto& i : identifiers) if (i.name==name) return &i;
+    return nullptr;
+}
+
+SelectorAnalysis analyse(const Expression& e)
+{
+    SelectorAnalysis a;
+    const Program* program = dynamic_cast<const Program*>(&e);
+    if (program) {
+        for (auto& n : program->identifierNames()) a.identifiers.push_back(SelectorAnalysis::Identifier(n));
+        return a;
+    }
+    for (auto& n : static_cast<const Program&>(*compile(e)).identifierNames()) {
+        a.identifiers.push_back(SelectorAnalysis::Identifier(n));
+        a.identifiers.back().missing = selectorMissing(e, n);
+    }
+
+    vector<SelectorTerm> terms;
+    selectorTerms(e, terms);
+    for (auto& t : terms) {
+        if (t.kind==SelectorTerm::OTHER) continue;
+        auto id = std::find_if(a.identifiers.begin(), a.identifiers.end(),
+                               [&](const SelectorAnalysis::Identifier& i) { return i.name==t.identifier; });
+        if (id==a.identifiers.end()) continue;
+        if (t.kind==SelectorTerm::RANGE) {
+            id->ranged = true;
+            id->lower = std::max(id->lower, t.lower);
+            id->upper = std::min(id->upper, t.upper);
+        } else {
+            restrict(*id, t.values);
+        }
+    }
+
+    for (auto& id : a.identifiers) {
+        if (id.ranged) {
+            if (!(id.lower<=id.upper)) a.never = true;
+            // Only numbers can be in a range
+            if (id.restricted) {
+                id.numbers.erase(std::remove_if(id.numbers.begin(), id.numbers.end(),
+                                                [&](double d) { return d<id.lower || d>id.upper; }),
+                                 id.numbers.end());
+                id.strings.clear();
+                id.bools = 0;
+            }
+        }
+        if (id.restricted && id.numbers.empty() && id.strings.empty() && id.bools==0) a.never = true;
+    }
+    return a;
+}
+
+}
@@ -0,0 +1,88 @@
+#ifndef SELECTOR_ANALYSIS_H
+#define SELECTOR_ANALYSIS_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+class Expression;
+
+/**
+ * What a message must be like for a selector to be TRUE, worked out from the
+ * selector alone.
+ *
+ * Everything here is a necessary condition: a message that fails any of them
+ * can't match, so a store with per segment min/max or value indexes can skip
+ * segments where no message meets them. A message that meets them all may
+ * still not match.
+ */
+struct __attribute__((visibility("default")))
+SelectorAnalysis {
+    // The selector's result for a message without the property
+    enum Missing {
+        MISSING_ANY,        // Could be TRUE
+        MISSING_NOT_TRUE,   // FALSE or UNKNOWN
+        MISSING_UNKNOWN     // Always UNKNOWN
+    };
+
+    struct Identifier {
+        std::string name;
+        Missing missing;
+
+        // If restricted, the property must be equal to one of these values
+        bool restricted;
+        std::vector<double> numbers;
+        std::vector<std::string> strings;
+        unsigned bools;     // Bit 0 set for FALSE, bit 1 for TRUE
+
+        // If ranged, the property must be a number in [lower, upper], where
+        // either bound may be infinite
+        bool ranged;
+        double lower;
+        double upper;
+
+        explicit Identifier(const std::string& n);
+    };
+
+    // Every identifier the selector refers to, in the order it reads them
+    std::vector<Identifier> identifiers;
+    // The conditions contradict each other, so the selector is never TRUE
+    bool never;
+
+    SelectorAnalysis() : never(false) {}
+
+    // The entry for name, or null if the selector doesn't refer to it
+    const Identifier* find(const std::string& name) const;
+};
+
+// Selectors from make_selector and make_adaptive_selector are fully analysed.
+// Only the identifiers of compiled selectors are known; they have no
+// conditions.
+__attribute__((visibility("default"))) SelectorAnalysis analyse(const Expression&);
+
+}
+
+#endif
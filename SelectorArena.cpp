@@ -0,0 +1,82 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorArena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+namespace selector {
+
+namespace {
+
+// Block headers are padded so that the space after them is maximally aligned
+const std::size_t HEADER = (sizeof(void*) + sizeof(std::size_t) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+}
+
+Arena::Arena(std::size_t firstBlock) :
+    blocks(nullptr),
+    next(nullptr),
+    end(nullptr),
+    blockSize(std::max(firstBlock, HEADER*2)),
+    used(0)
+{}
+
+Arena::~Arena()
+{
+    while (blocks) {
+        Block* b = blocks;
+        blocks = b->next;
+        ::operator delete(b);
+    }
+}
+
+void* Arena::allocate(std::size_t n, std::size_t align)
+{
+    uintptr_t p = (reinterpret_cast<uintptr_t>(next) + align - 1) & ~uintptr_t(align - 1);
+    if (!next || p + n > reinterpret_cast<uintptr_t>(end)) {
+        // Room for the allocation even if it is bigger than the next block
+        std::size_t size = blockSize;
+        while (size - HEADER < n + align) size *= 2;
+        Block* b = static_cast<Block*>(::operator new(size));
+        b->next = blocks;
+        b->size = size;
+        blocks = b;
+        next = reinterpret_cast<char*>(b) + HEADER;
+        end = reinterpret_cast<char*>(b) + size;
+        blockSize = size*2;
+        p = (reinterpret_cast<uintptr_t>(next) + align - 1) & ~uintptr_t(align - 1);
+    }
+    next = reinterpret_cast<char*>(p + n);
+    used += n;
+    return reinterpret_cast<void*>(p);
+}
+
+std::size_t Arena::reserved() const
+{
+    std::size_t r = 0;
+    for (Block* b = blocks; b; b = b->next) r += b->size;
+    return r;
+}
+
+}
@@ -0,0 +1,68 @@
+#ifndef SELECTOR_ARENA_H
+#define SELECTOR_ARENA_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+
+namespace selector {
+
+/**
+ * Monotonic allocator: memory comes from a few large blocks that are only
+ * freed, all together, when the Arena is destroyed.
+ *
+ * Each block is twice the size of the one before, so an Arena holding n bytes
+ * has made O(log n) calls to the heap allocator.
+ */
+class __attribute__((visibility("default")))
+Arena {
+    struct Block {
+        Block* next;
+        std::size_t size;
+    };
+
+    Block* blocks;
+    char* next;
+    char* end;
+    std::size_t blockSize;
+    std::size_t used;
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+public:
+    explicit Arena(std::size_t firstBlock = 1024);
+    ~Arena();
+
+    // align must be a power of 2
+    void* allocate(std::size_t n, std::size_t align = alignof(std::max_align_t));
+
+    // Bytes handed out by allocate() and bytes held from the heap
+    std::size_t allocated() const {
+        return used;
+    }
+    std::size_t reserved() const;
+};
+
+}
+
+#endif
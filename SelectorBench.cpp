@@ -0,0 +1,307 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+// Throughput of tokenising, parsing and evaluating selectors.
+//
+// With no arguments runs over a built in set of selectors and messages. Given
+//   --selectors=FILE  one selector per line
+//   --messages=FILE   one message per line as NAME=LITERAL pairs separated by
+//                     spaces, eg: A=1 B='x y' C=TRUE D=2.5
+// it runs over those instead. Given
+//   --fail-on-alloc   exit with status 2 if any evaluation allocated
+// Other arguments are passed to Google Benchmark.
+//
+// Each eval benchmark reports the heap allocations per evaluation as allocs.
+
+#include "SelectorEnv.h"
+#include "SelectorExpression.h"
+#include "SelectorJit.h"
+#include "SelectorSymbols.h"
+#include "SelectorToken.h"
+#include "SelectorValue.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace selector;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+// Allocations through the global operator new, and the most made by any
+// evaluation benchmark
+std::size_t allocations = 0;
+std::size_t evalAllocations = 0;
+
+void* allocate(std::size_t n)
+{
+    ++allocations;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+}
+
+void* operator new(std::size_t n) { return allocate(n); }
+void* operator new[](std::size_t n) { return allocate(n); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+struct Case {
+    string name;
+    string text;
+};
+
+// A message's properties by name and by slot
+struct Message : public SlotEnv {
+    std::unordered_map<string, Value> values;
+    vector<Value> slots;
+
+    explicit Message(const SymbolTable& s) : SlotEnv(s) {}
+
+    const Value& value(std::size_t slot) const {
+        static const Value none;
+        return slot<slots.size() ? slots[slot] : none;
+    }
+};
+
+// Storage for the text of string values
+std::deque<string> strings;
+
+Value literal(const string& t)
+{
+    if (t.size()>=2 && t.front()=='\'' && t.back()=='\'') {
+        strings.push_back(t.substr(1, t.size()-2));
+        return hashed(strings.back());
+    }
+    if (t=="TRUE") return true;
+    if (t=="FALSE") return false;
+    if (t.find_first_of(".eE")!=string::npos) return std::strtod(t.c_str(), 0);
+    return int64_t(std::strtoll(t.c_str(), 0, 0));
+}
+
+// NAME=LITERAL pairs; string literals may contain spaces
+std::unordered_map<string, Value> parseMessage(const string& line)
+{
+    std::unordered_map<string, Value> values;
+    std::size_t i = 0;
+    while (i<line.size()) {
+        if (line[i]==' ') { ++i; continue; }
+        const std::size_t eq = line.find('=', i);
+        if (eq==string::npos) throw std::runtime_error("Bad message: " + line);
+        std::size_t end = eq+1;
+        if (end<line.size() && line[end]=='\'') {
+            end = line.find('\'', end+1);
+            if (end==string::npos) throw std::runtime_error("Unterminated string: " + line);
+            ++end;
+        } else {
+            end = line.find(' ', end);
+            if (end==string::npos) end = line.size();
+        }
+        values[line.substr(i, eq-i)] = literal(line.substr(eq+1, end-eq-1));
+        i = end;
+    }
+    return values;
+}
+
+vector<Case> builtinSelectors()
+{
+    string in = "region IN (";
+    for (int i = 0; i<64; ++i) in += (i ? ", 'r" : "'r") + std::to_string(i) + "'";
+    in += ")";
+    string numbers = "id IN (";
+    for (int i = 0; i<64; ++i) numbers += (i ? ", " : "") + std::to_string(i*37);
+    numbers += ")";
+    return {
+        {"equality", "symbol = 'EURUSD'"},
+        {"and_chain", "a = 1 AND b > 2 AND c < 30 AND d <> 4 AND region = 'r5' AND price BETWEEN 1 AND 100 AND qty >= 10 AND symbol IS NOT NULL"},
+        {"or_chain", "a = 9 OR b = 9 OR c = 9 OR d = 9 OR region = 'x' OR symbol = 'y' OR qty = 9 OR price = 9"},
+        {"in_strings", in},
+        {"in_numbers", numbers},
+        {"like_prefix", "symbol LIKE 'EUR%'"},
+        {"like_suffix", "symbol LIKE '%USD'"},
+        {"like_escape", "path LIKE '/orders/!_%/status' ESCAPE '!'"},
+        {"arithmetic", "price * qty > 1000 OR (price - 1.5) / 2 < qty + 3"},
+        {"mixed", "(region = 'r5' OR region = 'r7') AND price * qty BETWEEN 100 AND 5000 AND symbol NOT LIKE '%JPY' AND NOT flagged"}
+    };
+}
+
+vector<string> builtinMessages()
+{
+    return {
+        "a=1 b=3 c=20 d=5 region='r5' price=12.5 qty=40 symbol='EURUSD' id=74 path='/orders/7/status' flagged=FALSE",
+        "a=2 b=1 c=40 d=4 region='r63' price=99.0 qty=2 symbol='USDJPY' id=75 path='/orders/x' flagged=TRUE",
+        "a=1 b=9 region='eu' price=3 qty=3 symbol='GBPUSD' id=2331",
+        "symbol='EURGBP' price=1000.25 qty=1"
+    };
+}
+
+vector<string> readLines(const string& file)
+{
+    std::ifstream in(file);
+    if (!in) throw std::runtime_error("Can't read " + file);
+    vector<string> lines;
+    string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line[0]!='#') lines.push_back(line);
+    }
+    return lines;
+}
+
+void tokeniseBench(benchmark::State& state, const string& text)
+{
+    std::size_t tokens = 0;
+    for (auto _ : state) {
+        Tokeniser t(text.begin(), text.end());
+        while (t.nextToken().type!=T_EOS) ++tokens;
+        benchmark::DoNotOptimize(tokens);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+void parseBench(benchmark::State& state, const string& text)
+{
+    for (auto _ : state) {
+        auto e = make_selector(text);
+        benchmark::DoNotOptimize(e.get());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Evaluates against each message in turn; an item is one evaluation
+void evalBench(benchmark::State& state, const Expression& e, const vector<unique_ptr<Message>>& messages)
+{
+    std::size_t matched = 0;
+    std::size_t allocated = 0;
+    for (auto _ : state) {
+        const std::size_t before = allocations;
+        for (auto& m : messages) matched += eval(e, *m);
+        allocated += allocations - before;
+        benchmark::DoNotOptimize(matched);
+    }
+    state.SetItemsProcessed(state.iterations() * messages.size());
+    state.counters["selectivity"] = double(matched) / (state.iterations() * messages.size());
+    state.counters["allocs"] = double(allocated) / (state.iterations() * messages.size());
+    evalAllocations = std::max(evalAllocations, allocated);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    string selectorFile, messageFile;
+    bool failOnAlloc = false;
+    vector<char*> args;
+    for (int i = 0; i<argc; ++i) {
+        const string a = argv[i];
+        if (a.compare(0, 12, "--selectors=")==0) selectorFile = a.substr(12);
+        else if (a.compare(0, 11, "--messages=")==0) messageFile = a.substr(11);
+        else if (a=="--fail-on-alloc") failOnAlloc = true;
+        else args.push_back(argv[i]);
+    }
+    int n = args.size();
+    benchmark::Initialize(&n, args.data());
+    if (benchmark::ReportUnrecognizedArguments(n, args.data())) return 1;
+
+    vector<Case> cases;
+    vector<string> lines;
+    try {
+        if (selectorFile.empty()) {
+            cases = builtinSelectors();
+        } else {
+            auto texts = readLines(selectorFile);
+            for (std::size_t i = 0; i<texts.size(); ++i) cases.push_back({std::to_string(i), texts[i]});
+        }
+        lines = messageFile.empty() ? builtinMessages() : readLines(messageFile);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    // Everything the benchmarks refer to lasts until they have all run
+    SymbolTable symbols;
+    vector<unique_ptr<Expression>> trees, programs, adaptives, natives;
+    for (auto& c : cases) {
+        try {
+            trees.push_back(make_selector(c.text, symbols));
+        } catch (const std::exception& e) {
+            std::cerr << "Selector " << c.name << ": " << e.what() << "\n";
+            return 1;
+        }
+        programs.push_back(compile(*trees.back()));
+        adaptives.push_back(make_adaptive_selector(c.text, symbols));
+        natives.push_back(make_jit_selector(*trees.back(), 0));
+    }
+    vector<unique_ptr<Message>> messages;
+    for (auto& l : lines) {
+        messages.push_back(unique_ptr<Message>(new Message(symbols)));
+        Message& m = *messages.back();
+        try {
+            m.values = parseMessage(l);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+            return 1;
+        }
+        m.slots.resize(symbols.size());
+        for (auto& v : m.values) {
+            const std::size_t slot = symbols.slot(v.first);
+            if (slot!=SymbolTable::npos) m.slots[slot] = v.second;
+        }
+    }
+
+    for (std::size_t i = 0; i<cases.size(); ++i) {
+        const string& name = cases[i].name;
+        const string& text = cases[i].text;
+        benchmark::RegisterBenchmark(("tokenise/" + name).c_str(), tokeniseBench, text);
+        benchmark::RegisterBenchmark(("make_selector/" + name).c_str(), parseBench, text);
+        benchmark::RegisterBenchmark(("eval/" + name).c_str(), evalBench, std::cref(*trees[i]), std::cref(messages));
+        benchmark::RegisterBenchmark(("eval_compiled/" + name).c_str(), evalBench, std::cref(*programs[i]), std::cref(messages));
+        benchmark::RegisterBenchmark(("eval_adaptive/" + name).c_str(), evalBench, std::cref(*adaptives[i]), std::cref(messages));
+        if (jit_available()) {
+            benchmark::RegisterBenchmark(("eval_jit/" + name).c_str(), evalBench, std::cref(*natives[i]), std::cref(messages));
+        }
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    if (failOnAlloc && evalAllocations) {
+        std::cerr << "Evaluation allocated " << evalAllocations << " times\n";
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorCache.h"
+
+#include "SelectorExpression.h"
+#include "SelectorToken.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace selector {
+
+using std::shared_ptr;
+using std::string;
+
+namespace {
+
+void quote(string& out, const TokenText& s, char q)
+{
+    out += q;
+    for (char c : s) {
+        if (c==q) out += q;
+        out += c;
+    }
+    out += q;
+}
+
+// The tokens of exp separated by single spaces, or exp itself if it can't be
+// tokenised (which make_selector will then reject)
+string normalise(const string& exp)
+{
+    string key;
+    try {
+        Tokeniser tokeniser(exp.begin(), exp.end());
+        for (;;) {
+            const Token& t = tokeniser.nextToken();
+            if (t.type==T_EOS) break;
+            if (!key.empty()) key += ' ';
+            switch (t.type) {
+            case T_NULL: key += "NULL"; break;
+            case T_TRUE: key += "TRUE"; break;
+            case T_FALSE: key += "FALSE"; break;
+            case T_NOT: key += "NOT"; break;
+            case T_AND: key += "AND"; break;
+            case T_OR: key += "OR"; break;
+            case T_IN: key += "IN"; break;
+            case T_IS: key += "IS"; break;
+            case T_BETWEEN: key += "BETWEEN"; break;
+            case T_LIKE: key += "LIKE"; break;
+            case T_ESCAPE: key += "ESCAPE"; break;
+            // Always quoted so that they can't look like reserved words
+            case T_IDENTIFIER: quote(key, t.val, '"'); break;
+            case T_STRING: quote(key, t.val, '\''); break;
+            default: key += t.val; break;
+            }
+        }
+    } catch (const TokenException&) {
+        return exp;
+    }
+    return key;
+}
+
+}
+
+struct SelectorCache::State {
+    typedef std::list<std::pair<string, shared_ptr<const Expression>>> Entries;
+
+    const std::size_t capacity;
+    mutable std::mutex lock;
+    // Most recently used first
+    Entries entries;
+    std::unordered_map<string, Entries::iterator> index;
+    uint64_t hits;
+    uint64_t misses;
+
+    State(std::size_t c) :
+        capacity(c),
+        hits(0),
+        misses(0)
+    {}
+};
+
+SelectorCache::SelectorCache(std::size_t capacity) :
+    state(new State(capacity))
+{}
+
+SelectorCache::~SelectorCache()
+{}
+
+shared_ptr<const Expression> SelectorCache::get(const string& exp)
+{
+    State& st = *state;
+    string key = normalise(exp);
+    {
+        std::lock_guard<std::mutex> l(st.lock);
+        auto i = st.index.find(key);
+        if (i!=st.index.end()) {
+            ++st.hits;
+            st.entries.splice(st.entries.begin(), st.entries, i->second);
+            return i->second->second;
+        }
+        ++st.misses;
+    }
+
+    shared_ptr<const Expression> e(make_selector(exp));
+
+    std::lock_guard<std::mutex> l(st.lock);
+    if (st.capacity==0) return e;
+    auto i = st.index.find(key);
+    // Another thread parsed the same selector meanwhile
+    if (i!=st.index.end()) return i->second->second;
+    st.entries.emplace_front(key, e);
+    st.index.emplace(std::move(key), st.entries.begin());
+    if (st.entries.size() > st.capacity) {
+        st.index.erase(st.entries.back().first);
+        st.entries.pop_back();
+    }
+    return e;
+}
+
+std::size_t SelectorCache::capacity() const
+{
+    return state->capacity;
+}
+
+std::size_t SelectorCache::size() const
+{
+    std::lock_guard<std::mutex> l(state->lock);
+    return state->entries.size();
+}
+
+uint64_t SelectorCache::hits() const
+{
+    std::lock_guard<std::mutex> l(state->lock);
+    return state->hits;
+}
+
+uint64_t SelectorCache::misses() const
+{
+    std::lock_guard<std::mutex> l(state->lock);
+    return state->misses;
+}
+
+void SelectorCache::clear()
+{
+    std::lock_guard<std::mutex> l(state->lock);
+    state->entries.clear();
+    state->index.clear();
+}
+
+}
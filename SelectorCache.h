@@ -0,0 +1,67 @@
+#ifndef SELECTOR_CACHE_H
+#define SELECTOR_CACHE_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace selector {
+
+class Expression;
+
+/**
+ * Bounded cache of parsed selectors.
+ *
+ * Selectors are looked up by their text with whitespace and the case of
+ * reserved words normalised, so "a=1 and b" finds the selector cached for
+ * "a = 1 AND b". When the cache is full the least recently used selector is
+ * dropped from it; anything still holding that selector keeps it alive.
+ *
+ * All the members may be called concurrently. Selectors are parsed without
+ * holding the cache's lock.
+ */
+class __attribute__((visibility("default")))
+SelectorCache {
+    struct State;
+    std::unique_ptr<State> state;
+
+public:
+    explicit SelectorCache(std::size_t capacity);
+    ~SelectorCache();
+
+    // As make_selector(exp), which throws the same exceptions for an invalid
+    // selector; invalid selectors aren't cached
+    std::shared_ptr<const Expression> get(const std::string& exp);
+
+    std::size_t capacity() const;
+    std::size_t size() const;
+    uint64_t hits() const;
+    uint64_t misses() const;
+    void clear();
+};
+
+}
+
+#endif
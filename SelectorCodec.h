@@ -0,0 +1,179 @@
+#ifndef SELECTOR_CODEC_H
+#define SELECTOR_CODEC_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorValue.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+// Binary encoding of compiled selectors: fixed width little endian integers,
+// doubles as their IEEE bits and strings as a 32 bit length then the bytes.
+
+class Encoder {
+    std::string& out;
+
+public:
+    explicit Encoder(std::string& o) :
+        out(o)
+    {}
+
+    void u8(uint8_t v) {
+        out += char(v);
+    }
+
+    void u16(uint16_t v) {
+        for (unsigned i = 0; i<2; ++i) u8(v >> 8*i);
+    }
+
+    void u32(uint32_t v) {
+        for (unsigned i = 0; i<4; ++i) u8(v >> 8*i);
+    }
+
+    void u64(uint64_t v) {
+        for (unsigned i = 0; i<8; ++i) u8(v >> 8*i);
+    }
+
+    void f64(double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        u64(bits);
+    }
+
+    void str(const std::string& s) {
+        u32(s.size());
+        out += s;
+    }
+
+    void value(const Value& v) {
+        u8(v.type);
+        switch (v.type) {
+        case Value::T_BOOL: u8(v.b); break;
+        case Value::T_STRING: str(*v.s); break;
+        case Value::T_EXACT: u64(v.i); break;
+        case Value::T_INEXACT: f64(v.x); break;
+        default: break;
+        }
+    }
+};
+
+// Throws std::range_error on reaching the end of the data or a bad value
+class Decoder {
+    const unsigned char* p;
+    const unsigned char* const end;
+
+    void need(std::size_t n) {
+        if (std::size_t(end-p)<n) fail("truncated");
+    }
+
+public:
+    Decoder(const char* data, std::size_t n) :
+        p(reinterpret_cast<const unsigned char*>(data)),
+        end(p+n)
+    {}
+
+    static void fail(const std::string& why) {
+        throw std::range_error("Invalid compiled selector: " + why);
+    }
+
+    bool done() const {
+        return p==end;
+    }
+
+    uint8_t u8() {
+        need(1);
+        return *p++;
+    }
+
+    uint16_t u16() {
+        need(2);
+        uint16_t v = p[0] | p[1] << 8;
+        p += 2;
+        return v;
+    }
+
+    uint32_t u32() {
+        need(4);
+        uint32_t v = 0;
+        for (unsigned i = 0; i<4; ++i) v |= uint32_t(p[i]) << 8*i;
+        p += 4;
+        return v;
+    }
+
+    uint64_t u64() {
+        need(8);
+        uint64_t v = 0;
+        for (unsigned i = 0; i<8; ++i) v |= uint64_t(p[i]) << 8*i;
+        p += 8;
+        return v;
+    }
+
+    double f64() {
+        const uint64_t bits = u64();
+        double v;
+        std::memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+
+    std::string str() {
+        const uint32_t n = u32();
+        need(n);
+        std::string s(reinterpret_cast<const char*>(p), n);
+        p += n;
+        return s;
+    }
+
+    // A count of items that each take at least size bytes, so that a bad
+    // count fails here rather than reserving a huge amount of memory.
+    uint32_t count(std::size_t size) {
+        const uint32_t n = u32();
+        if (size && std::size_t(end-p)/size<n) fail("truncated");
+        return n;
+    }
+
+    // String values point into strings
+    Value value(std::vector<std::unique_ptr<std::string>>& strings) {
+        switch (u8()) {
+        case Value::T_UNKNOWN: return Value();
+        case Value::T_BOOL: return bool(u8());
+        case Value::T_STRING:
+            strings.push_back(std::unique_ptr<std::string>(new std::string(str())));
+            return hashed(*strings.back());
+        case Value::T_EXACT: return int64_t(u64());
+        case Value::T_INEXACT: return f64();
+        default: fail("bad value type");
+        }
+        return Value();
+    }
+};
+
+}
+
+#endif
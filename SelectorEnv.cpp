@@ -0,0 +1,157 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorEnv.h"
+
+#include "SelectorSymbols.h"
+#include "SelectorValue.h"
+
+#include <functional>
+#include <string>
+
+namespace selector {
+
+namespace {
+const Value EMPTY;
+
+// Arrow bitmaps are least significant bit first
+inline bool bit(const uint8_t* bits, std::size_t i)
+{
+    return (bits[i/8] >> (i%8)) & 1;
+}
+}
+
+const Value& SlotEnv::value(const std::string& identifier) const
+{
+    std::size_t slot = symbols.slot(identifier);
+    return slot!=SymbolTable::npos ? value(slot) : EMPTY;
+}
+
+LazyEnv::LazyEnv(const Fetch& f) :
+    fetch(f),
+    symbols(nullptr),
+    generation(1),
+    fetches_(0)
+{}
+
+LazyEnv::LazyEnv(const Fetch& f, const SymbolTable& s) :
+    fetch(f),
+    symbols(&s),
+    generation(1),
+    fetches_(0)
+{}
+
+const Value& LazyEnv::lookup(Entry& e, const std::string& identifier) const
+{
+    if (e.generation!=generation) {
+        e.text.clear();
+        e.value = fetch(identifier, e.text);
+        e.generation = generation;
+        ++fetches_;
+    }
+    return e.value;
+}
+
+const Value& LazyEnv::value(const std::string& identifier) const
+{
+    return lookup(names[identifier], identifier);
+}
+
+const Value& LazyEnv::value(std::size_t slot, const std::string& identifier) const
+{
+    if (!symbols || slot==SymbolTable::npos) return value(identifier);
+    if (slot>=slots.size()) slots.resize(symbols->size() > slot ? symbols->size() : slot+1);
+    return lookup(slots[slot], identifier);
+}
+
+void LazyEnv::reset()
+{
+    // Entries from before are stale rather than freed so they can be reused
+    ++generation;
+}
+
+ColumnarEnv::ColumnarEnv(std::size_t rows) :
+    rows_(rows),
+    row_(0)
+{}
+
+void ColumnarEnv::add(const std::string& name, const Column& c)
+{
+    columns[name].column = c;
+}
+
+void ColumnarEnv::add_bools(const std::string& name, const uint8_t* bits, const uint8_t* validity, std::size_t offset)
+{
+    add(name, Column{BOOL, bits, nullptr, validity, offset});
+}
+
+void ColumnarEnv::add_int32s(const std::string& name, const int32_t* values, const uint8_t* validity, std::size_t offset)
+{
+    add(name, Column{INT32, values, nullptr, validity, offset});
+}
+
+void ColumnarEnv::add_int64s(const std::string& name, const int64_t* values, const uint8_t* validity, std::size_t offset)
+{
+    add(name, Column{INT64, values, nullptr, validity, offset});
+}
+
+void ColumnarEnv::add_doubles(const std::string& name, const double* values, const uint8_t* validity, std::size_t offset)
+{
+    add(name, Column{DOUBLE, values, nullptr, validity, offset});
+}
+
+void ColumnarEnv::add_strings(const std::string& name, const int32_t* offsets, const char* data, const uint8_t* validity, std::size_t offset)
+{
+    add(name, Column{UTF8, data, offsets, validity, offset});
+}
+
+const ColumnarEnv::Column* ColumnarEnv::column(const std::string& identifier) const
+{
+    auto i = columns.find(identifier);
+    return i!=columns.end() ? &i->second.column : nullptr;
+}
+
+const Value& ColumnarEnv::value(const std::string& identifier) const
+{
+    auto i = columns.find(identifier);
+    if (i==columns.end() || row_>=rows_) return EMPTY;
+    const Entry& e = i->second;
+    e.current = value(e.column, row_, e.text);
+    return e.current;
+}
+
+Value ColumnarEnv::value(const Column& c, std::size_t row, std::string& text)
+{
+    const std::size_t i = c.offset + row;
+    if (c.validity && !bit(c.validity, i)) return Value();
+    switch (c.type) {
+    case BOOL:   return Value(bit(static_cast<const uint8_t*>(c.values), i));
+    case INT32:  return Value(static_cast<const int32_t*>(c.values)[i]);
+    case INT64:  return Value(static_cast<const int64_t*>(c.values)[i]);
+    case DOUBLE: return Value(static_cast<const double*>(c.values)[i]);
+    case UTF8:
+        text.assign(static_cast<const char*>(c.values) + c.offsets[i], c.offsets[i+1] - c.offsets[i]);
+        return Value(text);
+    }
+    return Value();
+}
+
+}
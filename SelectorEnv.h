@@ -22,12 +22,19 @@
  *
  */
 
+#include "SelectorSymbols.h"
+
+#include "SelectorValue.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <string>
+#include <unordered_map>
 
 namespace selector {
 
-class Value;
-
 /**
  * Interface to provide values to a Selector evaluation
  */
@@ -36,9 +43,174 @@ public:
     virtual ~Env() {};
 
     virtual const Value& value(const std::string&) const = 0;
+
+    // Called for identifiers that were bound to a slot in a SymbolTable by
+    // make_selector (slot is SymbolTable::npos if they weren't). Only Envs that
+    // can index values by slot need to override this.
+    virtual const Value& value(std::size_t, const std::string& identifier) const {
+        return value(identifier);
+    }
+};
+
+/**
+ * Env which provides values by slot rather than by name.
+ *
+ * The slots are those assigned by the SymbolTable given to make_selector, so a
+ * message's properties can be held in a vector indexed by slot and looked up
+ * without any string comparisons. Identifiers that weren't bound to a slot are
+ * looked up by name in the SymbolTable.
+ */
+class __attribute__((visibility("default")))
+SlotEnv : public Env {
+    const SymbolTable& symbols;
+
+public:
+    SlotEnv(const SymbolTable& s) :
+        symbols(s)
+    {}
+
+    // Must return an unknown Value for any slot that has no value
+    virtual const Value& value(std::size_t slot) const = 0;
+
+    const Value& value(const std::string& identifier) const;
+
+    const Value& value(std::size_t slot, const std::string& identifier) const {
+        return slot!=SymbolTable::npos ? value(slot) : value(identifier);
+    }
+};
+
+/**
+ * Env which fetches each property only when an evaluation first needs it
+ * and then remembers it until reset().
+ *
+ * For messages whose properties must be decoded to be read: a property that
+ * appears several times in a selector is decoded once, and one that
+ * short-circuiting never reaches isn't decoded at all. Call reset() before
+ * evaluating against the next message. Not safe to use from multiple threads
+ * at once.
+ */
+class __attribute__((visibility("default")))
+LazyEnv : public Env {
+public:
+    // Returns the value of identifier, which may be unknown. The text of a
+    // string value can be put in text, which lasts until the next reset().
+    typedef std::function<Value(const std::string& identifier, std::string& text)> Fetch;
+
+private:
+    struct Entry {
+        uint64_t generation;
+        Value value;
+        std::string text;
+
+        Entry() : generation(0) {}
+    };
+
+    const Fetch fetch;
+    const SymbolTable* const symbols;
+    uint64_t generation;
+    // Entries are never moved once made as values may point to their text
+    mutable std::deque<Entry> slots;
+    mutable std::unordered_map<std::string, Entry> names;
+    mutable std::size_t fetches_;
+
+    const Value& lookup(Entry& e, const std::string& identifier) const;
+
+public:
+    explicit LazyEnv(const Fetch& f);
+    // Remembers the values of identifiers bound to slots in symbols by index
+    // rather than by name
+    LazyEnv(const Fetch& f, const SymbolTable& symbols);
+
+    const Value& value(const std::string& identifier) const;
+    const Value& value(std::size_t slot, const std::string& identifier) const;
+
+    // Forget every value fetched
+    void reset();
+
+    // Number of times a value has been fetched
+    std::size_t fetches() const {
+        return fetches_;
+    }
+};
+
+/**
+ * Env over a batch of messages held column by column, in the layout of
+ * Apache Arrow arrays, so that stored batches can be evaluated without making
+ * an Env for every message.
+ *
+ * Each property is a column of rows() values: a contiguous array of booleans
+ * (bit packed), 32 or 64 bit integers, doubles or UTF-8 strings (rows()+1
+ * int32 offsets into the string data), with an optional validity bitmap in
+ * which a clear bit makes the value unknown. Bits are least significant
+ * first and offset, as for a sliced Arrow array, is added to the row index
+ * for every buffer. Columns only refer to the buffers given, which must
+ * outlive the ColumnarEnv. A property that has no column is unknown.
+ *
+ * As an Env it gives the values of the current row, so it isn't safe to use
+ * as one from multiple threads at once; eval_batch() evaluates every row at
+ * once.
+ */
+class __attribute__((visibility("default")))
+ColumnarEnv : public Env {
+public:
+    enum Type {BOOL, INT32, INT64, DOUBLE, UTF8};
+
+    struct Column {
+        Type type;
+        const void* values;
+        const int32_t* offsets;
+        const uint8_t* validity;
+        std::size_t offset;
+    };
+
+private:
+    // Each column keeps the value of the current row it last gave, so that
+    // the values of different columns can be used together
+    struct Entry {
+        Column column;
+        mutable Value current;
+        mutable std::string text;
+    };
+
+    const std::size_t rows_;
+    std::size_t row_;
+    std::unordered_map<std::string, Entry> columns;
+
+    void add(const std::string& name, const Column&);
+
+public:
+    explicit ColumnarEnv(std::size_t rows);
+
+    // Null validity means every value is known
+    void add_bools(const std::string& name, const uint8_t* bits, const uint8_t* validity = nullptr, std::size_t offset = 0);
+    void add_int32s(const std::string& name, const int32_t* values, const uint8_t* validity = nullptr, std::size_t offset = 0);
+    void add_int64s(const std::string& name, const int64_t* values, const uint8_t* validity = nullptr, std::size_t offset = 0);
+    void add_doubles(const std::string& name, const double* values, const uint8_t* validity = nullptr, std::size_t offset = 0);
+    void add_strings(const std::string& name, const int32_t* offsets, const char* data, const uint8_t* validity = nullptr, std::size_t offset = 0);
+
+    std::size_t rows() const {
+        return rows_;
+    }
+
+    // Make row the one whose values value() gives
+    void row(std::size_t row) {
+        row_ = row;
+    }
+
+    std::size_t row() const {
+        return row_;
+    }
+
+    const Value& value(const std::string& identifier) const;
+
+    // The column of identifier or null if there isn't one
+    const Column* column(const std::string& identifier) const;
+
+    // The value in row of c. The value of a string points to text, which is
+    // overwritten.
+    static Value value(const Column& c, std::size_t row, std::string& text);
 };
 
 }
 
 #endif
-
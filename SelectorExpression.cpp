@@ -21,27 +21,38 @@
 
 #include "SelectorExpression.h"
 
+#include "SelectorArena.h"
 #include "SelectorEnv.h"
+#include "SelectorLike.h"
+#include "SelectorMemory.h"
+#include "SelectorProgram.h"
+#include "SelectorSymbols.h"
+#include "SelectorTerms.h"
 #include "SelectorToken.h"
 #include "SelectorValue.h"
+#include "SelectorValueSet.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
 #include <cstdint>
 #include <cstdlib>
 #include <cerrno> // Need to use errno in checking return from strtoull()/strtod()
+#include <functional>
 #include <memory>
 #include <ostream>
-#include <regex>
 #include <string>
 #include <type_traits>
-#include <sstream>
+#include <unordered_map>
 #include <vector>
 
 using std::enable_if;
 using std::make_unique;
 using std::ostream;
 using std::string;
-using std::ostringstream;
 using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
 
 
@@ -137,17 +148,23 @@ typedef bool CompFn(Value, Value);
 class ComparisonOperator {
     const char* repr_;
     CompFn& fn_;
+    OpCode opcode_;
 
 public:
-    constexpr ComparisonOperator(const char* r, CompFn* fn) :
+    constexpr ComparisonOperator(const char* r, CompFn* fn, OpCode opcode) :
         repr_(r),
-        fn_(*fn)
+        fn_(*fn),
+        opcode_(opcode)
     {}
 
     void repr(ostream& o) const {
         o << repr_;
     }
 
+    OpCode opcode() const {
+        return opcode_;
+    }
+
     BoolOrNone eval(Expression& e1, Expression& e2, const Env& env) const {
         const Value v1(e1.eval(env));
         if (!unknown(v1)) {
@@ -167,17 +184,23 @@ typedef BoolOrNone UBoolFn(const Value&);
 class UnaryBooleanOperator {
     const char* repr_;
     UBoolFn& fn_;
+    OpCode opcode_;
 
 public:
-    constexpr UnaryBooleanOperator(const char* r, UBoolFn* fn) :
+    constexpr UnaryBooleanOperator(const char* r, UBoolFn* fn, OpCode opcode) :
         repr_(r),
-        fn_(*fn)
+        fn_(*fn),
+        opcode_(opcode)
     {}
 
     void repr(ostream& o) const {
         o << repr_;
     }
 
+    OpCode opcode() const {
+        return opcode_;
+    }
+
     BoolOrNone eval(Expression& e, const Env& env) const {
         return fn_(e.eval(env));
     }
@@ -190,17 +213,23 @@ template <> struct has_repr<UnaryBooleanOperator> {static const bool value = tru
 class ArithmeticOperator {
     const char* repr_;
     ArithFn& fn_;
+    OpCode opcode_;
 
 public:
-    constexpr ArithmeticOperator(const char* r, ArithFn* fn) :
+    constexpr ArithmeticOperator(const char* r, ArithFn* fn, OpCode opcode) :
         repr_(r),
-        fn_(*fn)
+        fn_(*fn),
+        opcode_(opcode)
     {}
 
     void repr(ostream& o) const {
         o << repr_;
     }
 
+    OpCode opcode() const {
+        return opcode_;
+    }
+
     Value eval(Expression& e1, Expression& e2, const Env& env) const {
         return fn_(e1.eval(env), e2.eval(env));
     }
@@ -213,17 +242,23 @@ template <> struct has_repr<ArithmeticOperator> {static const bool value = true;
 class UnaryArithmeticOperator {
     const char* repr_;
     UArithFn& fn_;
+    OpCode opcode_;
 
 public:
-    constexpr UnaryArithmeticOperator(const char* r, UArithFn* fn) :
+    constexpr UnaryArithmeticOperator(const char* r, UArithFn* fn, OpCode opcode) :
         repr_(r),
-        fn_(*fn)
+        fn_(*fn),
+        opcode_(opcode)
     {}
 
     void repr(ostream& o) const {
         o << repr_;
     }
 
+    OpCode opcode() const {
+        return opcode_;
+    }
+
     Value eval(Expression& e, const Env& env) const {
         return fn_(e.eval(env));
     }
@@ -235,37 +270,192 @@ template <> struct has_repr<UnaryArithmeticOperator> {static const bool value =
 
 // Some operators...
 
-constexpr auto eqOp   = ComparisonOperator{"==", operator==};
-constexpr auto neqOp  = ComparisonOperator{"!=", operator!=};
-constexpr auto lsOp   = ComparisonOperator{"<",  operator<};
-constexpr auto grOp   = ComparisonOperator{">",  operator>};
-constexpr auto lseqOp = ComparisonOperator{"<=", operator<=};
-constexpr auto greqOp = ComparisonOperator{">=", operator>=};
+constexpr auto eqOp   = ComparisonOperator{"==", operator==, OP_EQ};
+constexpr auto neqOp  = ComparisonOperator{"!=", operator!=, OP_NEQ};
+constexpr auto lsOp   = ComparisonOperator{"<",  operator<,  OP_LESS};
+constexpr auto grOp   = ComparisonOperator{">",  operator>,  OP_GRT};
+constexpr auto lseqOp = ComparisonOperator{"<=", operator<=, OP_LSEQ};
+constexpr auto greqOp = ComparisonOperator{">=", operator>=, OP_GREQ};
 
 // Can't use lambdas as they won't work with constexpr in C++14
 BoolOrNone isNullOpEval(const Value& v){return BoolOrNone(unknown(v));};
 BoolOrNone isNonNullOpEval(const Value& v){return BoolOrNone(!unknown(v));};
 
-constexpr auto isNullOp    = UnaryBooleanOperator{"IsNull", isNullOpEval};
-constexpr auto isNonNullOp = UnaryBooleanOperator{"IsNonNull", isNonNullOpEval};
-constexpr auto notOp       = UnaryBooleanOperator{"NOT", operator!};
+constexpr auto isNullOp    = UnaryBooleanOperator{"IsNull", isNullOpEval, OP_IS_NULL};
+constexpr auto isNonNullOp = UnaryBooleanOperator{"IsNonNull", isNonNullOpEval, OP_IS_NON_NULL};
+constexpr auto notOp       = UnaryBooleanOperator{"NOT", operator!, OP_NOT};
 
-constexpr auto add  = ArithmeticOperator{"+", operator+};
-constexpr auto sub  = ArithmeticOperator{"-", operator-};
-constexpr auto mult = ArithmeticOperator{"*", operator*};
-constexpr auto div  = ArithmeticOperator{"/", operator/};
+constexpr auto add  = ArithmeticOperator{"+", operator+, OP_ADD};
+constexpr auto sub  = ArithmeticOperator{"-", operator-, OP_SUB};
+constexpr auto mult = ArithmeticOperator{"*", operator*, OP_MULT};
+constexpr auto div  = ArithmeticOperator{"/", operator/, OP_DIV};
 
-constexpr auto negate = UnaryArithmeticOperator{"-", operator-};
+constexpr auto negate = UnaryArithmeticOperator{"-", operator-, OP_NEGATE};
 
 ////////////////////////////////////////////////////
 
 // Expressions...
 
+typedef ProgramBuilder::Register Register;
+
+// Static estimates of how expensive an expression is to evaluate and how
+// likely it is to be TRUE, used to order the operands of AND and OR
+struct Estimate {
+    unsigned cost;
+    double truth;
+    bool traps;         // Evaluation may trap (integer division by a variable)
+};
+
+// What an expression evaluates to whenever a given identifier has no value
+typedef SelectorAnalysis::Missing Missing;
+constexpr Missing MISSING_ANY = SelectorAnalysis::MISSING_ANY;
+constexpr Missing MISSING_NOT_TRUE = SelectorAnalysis::MISSING_NOT_TRUE;
+constexpr Missing MISSING_UNKNOWN = SelectorAnalysis::MISSING_UNKNOWN;
+
+inline Missing unknownIf(bool b)
+{
+    return b ? MISSING_UNKNOWN : MISSING_ANY;
+}
+
+class ValueExpression;
+
+// Describes expressions unambiguously so that identical ones can be found:
+// each node is written as a tag for its kind and operator, then any literal
+// or name with its length, then each of its children in brackets. Either the
+// whole description is written to one string, or each distinct
+// subexpression is given a Key and nodes are described by the keys of their
+// children, so that nothing is described more than once.
+class KeyWriter {
+    typedef ProgramBuilder::Key Key;
+    typedef ProgramBuilder::Keys Keys;
+
+    string* const whole;
+    unordered_map<string, Key>* const numbers;
+    Keys* const keys;
+    // The descriptions of the nodes being given keys, innermost last
+    vector<string> open;
+
+    string& out() {
+        return whole ? *whole : open.back();
+    }
+
+public:
+    explicit KeyWriter(string& w) :
+        whole(&w),
+        numbers(nullptr),
+        keys(nullptr)
+    {}
+
+    // Key every subexpression, numbering the distinct descriptions in numbers
+    KeyWriter(unordered_map<string, Key>& n, Keys& k) :
+        whole(nullptr),
+        numbers(&n),
+        keys(&k)
+    {}
+
+    KeyWriter& tag(char c) {
+        out() += c;
+        return *this;
+    }
+
+    KeyWriter& text(const string& t) {
+        string& o = out();
+        o += std::to_string(t.size());
+        o += ':';
+        o += t;
+        return *this;
+    }
+
+    KeyWriter& value(const Value& v) {
+        string& o = out();
+        o += char('0' + v.type);
+        switch (v.type) {
+        case Value::T_BOOL: o += v.b ? '1' : '0'; break;
+        case Value::T_STRING: text(*v.s); break;
+        case Value::T_EXACT: o += std::to_string(v.i) + ';'; break;
+        case Value::T_INEXACT: {
+            // Doubles are told apart exactly
+            uint64_t bits;
+            std::memcpy(&bits, &v.x, sizeof(bits));
+            o += std::to_string(bits) + ';';
+            break;
+        }
+        default: break;
+        }
+        return *this;
+    }
+
+    KeyWriter& child(const ValueExpression& e);
+};
+
 class ValueExpression : public Expression {
 public:
   virtual ~ValueExpression() {}
+
+  // Nodes made while a selector is parsed come from the selector's Arena
+  static void* operator new(std::size_t n);
+  static void operator delete(void* p);
+
   virtual void repr(ostream&) const = 0;
   virtual Value eval(const Env&) const = 0;
+
+  // Emit code leaving the value of this expression in register dst, reusing
+  // the value of an identical expression if one has been computed already
+  void compile(ProgramBuilder& b, Register dst) const {
+    // Constants are as quick to load again as to copy
+    if (constant()) return emit(b, dst);
+    ProgramBuilder::Key k;
+    if (!b.key(this, k)) return emit(b, dst);
+    if (b.reuse(k, dst)) return;
+    emit(b, dst);
+    b.computed(k, dst);
+  }
+
+  // Describe this node and its children, see KeyWriter
+  virtual void key(KeyWriter&) const = 0;
+
+  // Emit the code computing this expression itself
+  virtual void emit(ProgramBuilder&, Register dst) const = 0;
+
+  // True if the value never depends on the Env
+  virtual bool constant() const {
+    return false;
+  }
+
+  // Simplify the children of this expression then return a simpler
+  // equivalent of the whole expression, or null if there isn't one
+  virtual unique_ptr<ValueExpression> simplify() {
+    return nullptr;
+  }
+
+  virtual Estimate estimate() const = 0;
+
+  // Append the terms that must all be TRUE for this expression to be TRUE
+  virtual void terms(vector<SelectorTerm>& ts) const {
+    ts.push_back(SelectorTerm(this));
+  }
+
+  // Set name and slot if this is an identifier
+  virtual bool isIdentifier(string&, std::size_t&) const {
+    return false;
+  }
+
+  // What this evaluates to whenever the identifier has no value
+  virtual Missing missing(const string&) const {
+    return MISSING_ANY;
+  }
+
+  // Heap memory held by this expression and its children other than what
+  // they take from the Arena, see memory_usage()
+  virtual std::size_t memory() const {
+    return 0;
+  }
+
+  // Append this expression's boolean structure to nodes, returning its root
+  virtual std::size_t structure(vector<SelectorNode>& ns) const {
+    ns.push_back(SelectorNode(SelectorNode::LEAF, this));
+    return ns.size()-1;
+  }
   
   virtual BoolOrNone eval_bool(const Env& env) const {
     Value v = eval(env);
@@ -274,6 +464,24 @@ public:
   }
 };
 
+KeyWriter& KeyWriter::child(const ValueExpression& e)
+{
+    if (whole) {
+        *whole += '(';
+        e.key(*this);
+        *whole += ')';
+        return *this;
+    }
+    open.emplace_back();
+    e.key(*this);
+    string d = std::move(open.back());
+    open.pop_back();
+    const Key k = numbers->emplace(std::move(d), numbers->size()).first->second;
+    (*keys)[&e] = k;
+    if (!open.empty()) open.back() += std::to_string(k) + ',';
+    return *this;
+}
+
 class BoolExpression : public ValueExpression {
 public:
   virtual ~BoolExpression() {}
@@ -285,13 +493,91 @@ public:
   }
 };
 
+// Set while a selector is parsed so that its nodes are allocated together
+static thread_local Arena* parsingArena = nullptr;
+
+class ArenaScope {
+    Arena* const previous;
+
+public:
+    ArenaScope(Arena& a) :
+        previous(parsingArena)
+    {
+        parsingArena = &a;
+    }
+
+    ~ArenaScope() {
+        parsingArena = previous;
+    }
+};
+
+// Each node is preceded by the Arena it came from, or null if it is on the heap
+static const std::size_t NODE_HEADER = alignof(std::max_align_t);
+
+void* ValueExpression::operator new(std::size_t n)
+{
+    Arena* a = parsingArena;
+    char* p = static_cast<char*>(a ? a->allocate(n + NODE_HEADER) : ::operator new(n + NODE_HEADER));
+    *reinterpret_cast<Arena**>(p) = a;
+    return p + NODE_HEADER;
+}
+
+void ValueExpression::operator delete(void* p)
+{
+    if (!p) return;
+    char* b = static_cast<char*>(p) - NODE_HEADER;
+    // Nodes in an Arena are only freed with the whole Arena
+    if (!*reinterpret_cast<Arena**>(b)) ::operator delete(b);
+}
+
+// Constant expressions never look at the Env they are evaluated in
+class ConstantEnv : public Env {
+    const Value& value(const string&) const {
+        static const Value none;
+        return none;
+    }
+};
+
+static Value constantValue(const ValueExpression& e)
+{
+    return e.eval(ConstantEnv());
+}
+
+// Replace e by its simplified equivalent
+static void simplify(unique_ptr<ValueExpression>& e)
+{
+    if (auto s = e->simplify()) e = std::move(s);
+}
+
+// A Literal with the value of constant expression e
+static unique_ptr<ValueExpression> fold(const ValueExpression& e);
+
+// True if e is a constant with exactly this boolean value
+static bool isConstant(const ValueExpression& e, bool b)
+{
+    if (!e.constant()) return false;
+    Value v = constantValue(e);
+    return v.type==Value::T_BOOL && v.b==b;
+}
+
+// True if e can only evaluate to TRUE, FALSE or UNKNOWN so it can stand in
+// for a boolean expression wherever it is used
+static bool boolean(const ValueExpression& e)
+{
+    return dynamic_cast<const BoolExpression*>(&e) || isConstant(e, true) || isConstant(e, false);
+}
+
 // Boolean Expression types...
 
 class ComparisonExpression : public BoolExpression {
+protected:
     const ComparisonOperator& op;
     unique_ptr<ValueExpression> e1;
     unique_ptr<ValueExpression> e2;
 
+    // A typed comparison if this compares an identifier with a literal
+    unique_ptr<ValueExpression> typed();
+
 public:
     ComparisonExpression(const ComparisonOperator& o, unique_ptr<ValueExpression> e, unique_ptr<ValueExpression> e_):
         op(o),
@@ -303,57 +589,431 @@ public:
         os << "(" << *e1 << op << *e2 << ")";
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('C').tag(char(op.opcode())).child(*e1).child(*e2);
+    }
+
     BoolOrNone eval_bool(const Env& env) const {
         return op.eval(*e1, *e2, env);
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        e1->compile(b, dst);
+        Register t = b.push();
+        e2->compile(b, t);
+        b.emit(op.opcode(), dst, dst, t);
+        b.pop();
+    }
+
+    bool constant() const {
+        return e1->constant() && e2->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e1);
+        selector::simplify(e2);
+        return constant() ? fold(*this) : typed();
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(e1->missing(id)==MISSING_UNKNOWN || e2->missing(id)==MISSING_UNKNOWN);
+    }
+
+    Estimate estimate() const {
+        Estimate x1 = e1->estimate();
+        Estimate x2 = e2->estimate();
+        double truth = &op==&eqOp ? 0.1 : &op==&neqOp ? 0.9 : 0.33;
+        return Estimate{1 + x1.cost + x2.cost, truth, x1.traps || x2.traps};
+    }
+
+    void terms(vector<SelectorTerm>& ts) const {
+        SelectorTerm t(this);
+        // Either way round: identifier op constant or constant op identifier
+        bool flipped = !e1->isIdentifier(t.identifier, t.slot);
+        const ValueExpression& c = flipped ? *e1 : *e2;
+        if (flipped && !e2->isIdentifier(t.identifier, t.slot)) {
+            ts.push_back(SelectorTerm(this));
+            return;
+        }
+        if (!c.constant()) {
+            ts.push_back(SelectorTerm(this));
+            return;
+        }
+        Value v = constantValue(c);
+        if (&op==&eqOp && !unknown(v)) {
+            t.kind = SelectorTerm::EQUAL;
+            t.values.push_back(v);
+        } else if (numeric(v) && &op!=&eqOp && &op!=&neqOp) {
+            // identifier > c or c < identifier gives a lower bound
+            const bool lower = (&op==&grOp || &op==&greqOp)!=flipped;
+            const double d = v.type==Value::T_EXACT ? double(v.i) : v.x;
+            t.kind = SelectorTerm::RANGE;
+            t.lower = lower ? d : -HUGE_VAL;
+            t.upper = lower ? HUGE_VAL : d;
+        }
+        ts.push_back(t);
+    }
+
+    std::size_t memory() const {
+        return e1->memory() + e2->memory();
+    }
 };
 
-class OrExpression : public BoolExpression {
-    unique_ptr<ValueExpression> e1;
-    unique_ptr<ValueExpression> e2;
+// Adaptive ordering of the operands of an AND or OR.
+//
+// Counts how often each operand decides the result by itself when it is
+// evaluated and periodically sorts the operands so that those that decide it
+// most cheaply come first. The counts and the order are relaxed atomics: the
+// counts are only statistics, so concurrent updates may interleave and
+// readers may see them or the order slightly stale, which changes only how
+// quickly a result is found, never what it is. The order is packed into a
+// single word so readers always see one complete permutation.
+//
+// So that threads sharing a selector don't contend for the counts, only a
+// random sample of evaluations on each thread is counted, and the counts are
+// kept apart from the order that every evaluation reads.
+class OperandOrder {
+    // Count one evaluation in this many
+    static const uint32_t SAMPLE = 16;
+    // Reconsider the order after this many counted evaluations
+    static const uint32_t PERIOD = 16;
+    // Halve the counts when they get this big so the order can still change
+    static const uint32_t DECAY = 1u << 16;
+    static const unsigned BITS = 4;
+    // Padding either side of the counts so no other data shares their cache lines
+    static const std::size_t PAD = 64 / sizeof(std::atomic<uint32_t>);
+
+    const vector<unsigned> cost;
+    // The evaluations, then evaluated and decided counts for each operand
+    unique_ptr<std::atomic<uint32_t>[]> counts;
+    std::atomic<uint32_t>* const evaluations;
+    std::atomic<uint32_t>* const evaluated;
+    std::atomic<uint32_t>* const decided;
+    mutable std::atomic<uint64_t> order;
+
+    static uint32_t load(const std::atomic<uint32_t>& a) {
+        return a.load(std::memory_order_relaxed);
+    }
+
+    static void increment(std::atomic<uint32_t>& a) {
+        a.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Doesn't allocate as it runs in the middle of an evaluation
+    void reorder() const {
+        const std::size_t n = cost.size();
+        double rank[MAX_OPERANDS];
+        unsigned positions[MAX_OPERANDS];
+        for (std::size_t i = 0; i<n; ++i) {
+            rank[i] = (cost[i]+1) * (load(evaluated[i])+1.0) / (load(decided[i])+1.0);
+            if (load(evaluated[i])>DECAY) {
+                evaluated[i].store(load(evaluated[i])/2, std::memory_order_relaxed);
+                decided[i].store(load(decided[i])/2, std::memory_order_relaxed);
+            }
+        }
+        // Stable insertion sort by rank
+        for (std::size_t i = 0; i<n; ++i) {
+            std::size_t k = i;
+            for (; k>0 && rank[i]<rank[positions[k-1]]; --k) positions[k] = positions[k-1];
+            positions[k] = i;
+        }
+        order.store(pack(positions, n), std::memory_order_relaxed);
+    }
+
+    static uint64_t pack(const unsigned* positions, std::size_t n) {
+        uint64_t p = 0;
+        for (std::size_t k = 0; k<n; ++k) p |= uint64_t(positions[k]) << (BITS*k);
+        return p;
+    }
 
 public:
-    OrExpression(unique_ptr<ValueExpression> e, unique_ptr<ValueExpression> e_):
-        e1(std::move(e)),
-        e2(std::move(e_))
-    {}
+    // The most operands that can be reordered
+    static const std::size_t MAX_OPERANDS = 64 / BITS;
+
+    explicit OperandOrder(const vector<unsigned>& c) :
+        cost(c),
+        counts(new std::atomic<uint32_t>[PAD + 1 + 2*c.size() + PAD]()),
+        evaluations(&counts[PAD]),
+        evaluated(evaluations + 1),
+        decided(evaluated + c.size()),
+        order(0)
+    {
+        unsigned positions[MAX_OPERANDS];
+        for (std::size_t i = 0; i<c.size(); ++i) positions[i] = i;
+        order.store(pack(positions, c.size()), std::memory_order_relaxed);
+    }
+
+    // The current order: the operand to evaluate k'th is operand(order, k)
+    uint64_t current() const {
+        return order.load(std::memory_order_relaxed);
+    }
+
+    static unsigned operand(uint64_t order, unsigned k) {
+        return (order >> (BITS*k)) & ((1u << BITS) - 1);
+    }
 
+    // Should this evaluation be counted
+    static bool sample() {
+        // xorshift, so that the sample doesn't depend on the pattern of evaluations
+        static thread_local uint32_t state = 2463534242u;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % SAMPLE == 0;
+    }
+
+    // Operand i was evaluated and did or didn't decide the result in a
+    // counted evaluation
+    void record(unsigned i, bool decides) const {
+        increment(evaluated[i]);
+        if (decides) increment(decided[i]);
+    }
+
+    // Called at the start of a counted evaluation
+    void evaluation() const {
+        if (evaluations->fetch_add(1, std::memory_order_relaxed) % PERIOD == PERIOD-1) reorder();
+    }
+
+    std::size_t memory() const {
+        return sizeof(*this) + heapMemory(cost) + (PAD + 1 + 2*cost.size() + PAD)*sizeof(std::atomic<uint32_t>);
+    }
+};
+
+// Shared by AND and OR which only differ in the operand value (FALSE for AND,
+// TRUE for OR) that decides the result by itself. The operands of a whole
+// chain of ANDs or ORs are held together and evaluated in a single loop.
+class JunctionExpression : public BoolExpression {
+protected:
+    typedef vector<unique_ptr<ValueExpression>> Operands;
+
+    const bool decider;
+    const bool adaptive;
+    Operands operands;
+    unique_ptr<OperandOrder> order;
+
+    JunctionExpression(bool d, bool a, Operands&& o) :
+        decider(d),
+        adaptive(a)
+    {
+        operands.swap(o);
+        if (!adaptive || operands.size()>OperandOrder::MAX_OPERANDS) return;
+        // Only operands that can't trap can be evaluated in any order
+        vector<unsigned> costs;
+        for (auto& e : operands) {
+            Estimate x = e->estimate();
+            if (x.traps) return;
+            costs.push_back(x.cost);
+        }
+        order = make_unique<OperandOrder>(costs);
+    }
+
+    virtual unique_ptr<ValueExpression> make(Operands&&) const = 0;
+
+private:
+    // Is e a junction of the same kind so part of the same chain of operands
+    bool chained(const ValueExpression& e) const {
+        auto j = dynamic_cast<const JunctionExpression*>(&e);
+        return j && j->decider==decider;
+    }
+
+    void flatten(unique_ptr<ValueExpression> e, Operands& terms) const {
+        if (chained(*e)) {
+            for (auto& o : static_cast<JunctionExpression&>(*e).operands) flatten(std::move(o), terms);
+        } else {
+            terms.push_back(std::move(e));
+        }
+    }
+
+    // Expected cost of finding the result with this operand, lower goes first
+    double rank(const Estimate& x) const {
+        const double p = decider ? x.truth : 1-x.truth;
+        return x.cost / std::max(p, 0.01);
+    }
+
+    BoolOrNone result(bool unknowns) const {
+        return unknowns ? BN_UNKNOWN : BoolOrNone(!decider);
+    }
+
+public:
     void repr(ostream& os) const {
-        os << "(" << *e1 << " OR " << *e2 << ")";
+        const uint64_t current = order ? order->current() : 0;
+        os << "(";
+        for (std::size_t k = 0; k<operands.size(); ++k) {
+            const std::size_t i = order ? OperandOrder::operand(current, k) : k;
+            os << (k ? (decider ? " OR " : " AND ") : "") << *operands[i];
+        }
+        os << ")";
+    }
+
+    void key(KeyWriter& w) const {
+        // In the order written, however they are evaluated
+        w.tag(decider ? '|' : '&');
+        for (auto& o : operands) w.child(*o);
     }
 
     BoolOrNone eval_bool(const Env& env) const {
-        BoolOrNone bn1(e1->eval_bool(env));
-        if (bn1==BN_TRUE) return BN_TRUE;
-        BoolOrNone bn2(e2->eval_bool(env));
-        if (bn2==BN_TRUE) return BN_TRUE;
-        if (bn1==BN_FALSE && bn2==BN_FALSE) return BN_FALSE;
-        else return BN_UNKNOWN;
+        const BoolOrNone d = BoolOrNone(decider);
+        bool unknowns = false;
+        if (!order) {
+            for (auto& e : operands) {
+                BoolOrNone bn(e->eval_bool(env));
+                if (bn==d) return d;
+                unknowns = unknowns || bn==BN_UNKNOWN;
+            }
+            return result(unknowns);
+        }
+
+        const uint64_t current = order->current();
+        const bool counted = OperandOrder::sample();
+        if (counted) order->evaluation();
+        for (std::size_t k = 0; k<operands.size(); ++k) {
+            const unsigned i = OperandOrder::operand(current, k);
+            BoolOrNone bn(operands[i]->eval_bool(env));
+            if (counted) order->record(i, bn==d);
+            if (bn==d) return d;
+            unknowns = unknowns || bn==BN_UNKNOWN;
+        }
+        return result(unknowns);
+    }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        operands[0]->compile(b, dst);
+        vector<std::size_t> exits;
+        Register t = b.push();
+        // Each operand is run only if the ones before it are
+        b.conditional();
+        for (std::size_t i = 1; i<operands.size(); ++i) {
+            exits.push_back(b.emit(decider ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE, dst));
+            operands[i]->compile(b, t);
+            b.emit(decider ? OP_OR : OP_AND, dst, dst, t);
+        }
+        b.unconditional();
+        b.pop();
+        for (auto j : exits) b.patch(j);
+    }
+
+    bool constant() const {
+        for (auto& e : operands) {
+            if (!e->constant()) return false;
+        }
+        return true;
+    }
+
+    // Simplifies the whole chain of operands joined by the same junction,
+    // dropping operands that can't affect the result and putting the cheapest
+    // and most likely to decide the result first
+    unique_ptr<ValueExpression> simplify() {
+        Operands terms;
+        for (auto& o : operands) {
+            selector::simplify(o);
+            flatten(std::move(o), terms);
+        }
+
+        // x AND FALSE is FALSE and x OR TRUE is TRUE whatever x is
+        for (auto& t : terms) {
+            if (isConstant(*t, decider)) return std::move(t);
+        }
+        // x AND TRUE is x and x OR FALSE is x, if x is boolean
+        unique_ptr<ValueExpression> identity;
+        auto end = std::remove_if(terms.begin(), terms.end(), [&](unique_ptr<ValueExpression>& t) {
+            if (!isConstant(*t, !decider)) return false;
+            identity = std::move(t);
+            return true;
+        });
+        terms.erase(end, terms.end());
+        if (terms.empty()) return identity;
+        if (terms.size()==1) {
+            if (boolean(*terms[0])) return std::move(terms[0]);
+            terms.push_back(std::move(identity));
+        }
+
+        // Operands that might trap must stay after those that may guard them
+        // and before those they may guard
+        vector<Estimate> estimates;
+        for (auto& t : terms) estimates.push_back(t->estimate());
+        vector<std::size_t> positions(terms.size());
+        for (std::size_t i = 0; i<positions.size(); ++i) positions[i] = i;
+        for (auto i = positions.begin(); i!=positions.end();) {
+            auto j = std::find_if(i, positions.end(), [&](std::size_t k) { return estimates[k].traps; });
+            std::stable_sort(i, j, [&](std::size_t k1, std::size_t k2) {
+                return rank(estimates[k1]) < rank(estimates[k2]);
+            });
+            i = j==positions.end() ? j : j+1;
+        }
+
+        Operands sorted;
+        for (auto i : positions) sorted.push_back(std::move(terms[i]));
+        auto r = make(std::move(sorted));
+        if (r->constant()) return fold(*r);
+        return r;
+    }
+
+    void terms(vector<SelectorTerm>& ts) const {
+        // Operands that can trap must only be evaluated after those before them
+        if (decider || estimate().traps) {
+            ts.push_back(SelectorTerm(this));
+            return;
+        }
+        for (auto& e : operands) e->terms(ts);
+    }
+
+    std::size_t structure(vector<SelectorNode>& ns) const {
+        SelectorNode n(decider ? SelectorNode::OR : SelectorNode::AND, this);
+        for (auto& e : operands) n.operands.push_back(e->structure(ns));
+        ns.push_back(std::move(n));
+        return ns.size()-1;
+    }
+
+    Missing missing(const string& id) const {
+        // AND is not TRUE if any operand isn't, OR only if none are
+        bool unknowns = true, notTrues = decider;
+        for (auto& e : operands) {
+            const Missing m = e->missing(id);
+            unknowns = unknowns && m==MISSING_UNKNOWN;
+            if (decider) notTrues = notTrues && m!=MISSING_ANY;
+            else notTrues = notTrues || m!=MISSING_ANY;
+        }
+        return unknowns ? MISSING_UNKNOWN : notTrues ? MISSING_NOT_TRUE : MISSING_ANY;
+    }
+
+    Estimate estimate() const {
+        Estimate x{0, decider ? 0.0 : 1.0, false};
+        for (auto& e : operands) {
+            Estimate xe = e->estimate();
+            x.cost += xe.cost;
+            x.truth = decider ? 1 - (1-x.truth)*(1-xe.truth) : x.truth*xe.truth;
+            x.traps = x.traps || xe.traps;
+        }
+        return x;
+    }
+
+    std::size_t memory() const {
+        std::size_t n = heapMemory(operands) + (order ? order->memory() : 0);
+        for (auto& o : operands) n += o->memory();
+        return n;
     }
 };
 
-class AndExpression : public BoolExpression {
-    unique_ptr<ValueExpression> e1;
-    unique_ptr<ValueExpression> e2;
+class OrExpression : public JunctionExpression {
+    unique_ptr<ValueExpression> make(Operands&& o) const {
+        return make_unique<OrExpression>(std::move(o), adaptive);
+    }
 
 public:
-    AndExpression(unique_ptr<ValueExpression> e, unique_ptr<ValueExpression> e_):
-        e1(std::move(e)),
-        e2(std::move(e_))
+    OrExpression(Operands&& o, bool adaptive = false) :
+        JunctionExpression(true, adaptive, std::move(o))
     {}
+};
 
-    void repr(ostream& os) const {
-        os << "(" << *e1 << " AND " << *e2 << ")";
+class AndExpression : public JunctionExpression {
+    unique_ptr<ValueExpression> make(Operands&& o) const {
+        return make_unique<AndExpression>(std::move(o), adaptive);
     }
 
-    BoolOrNone eval_bool(const Env& env) const {
-        BoolOrNone bn1(e1->eval_bool(env));
-        if (bn1==BN_FALSE) return BN_FALSE;
-        BoolOrNone bn2(e2->eval_bool(env));
-        if (bn2==BN_FALSE) return BN_FALSE;
-        if (bn1==BN_TRUE && bn2==BN_TRUE) return BN_TRUE;
-        else return BN_UNKNOWN;
-    }
+public:
+    AndExpression(Operands&& o, bool adaptive = false) :
+        JunctionExpression(false, adaptive, std::move(o))
+    {}
 };
 
 class UnaryBooleanExpression : public BoolExpression {
@@ -370,93 +1030,110 @@ public:
         os << op << "(" << *e1 << ")";
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('U').tag(char(op.opcode())).child(*e1);
+    }
+
     BoolOrNone eval_bool(const Env& env) const {
         return op.eval(*e1, env);
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        e1->compile(b, dst);
+        b.emit(op.opcode(), dst, dst);
+    }
+
+    bool constant() const {
+        return e1->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e1);
+        if (constant()) return fold(*this);
+        // NOT NOT x is x if x is boolean
+        auto n = dynamic_cast<UnaryBooleanExpression*>(e1.get());
+        if (&op==&notOp && n && &n->op==&notOp && boolean(*n->e1)) return std::move(n->e1);
+        return nullptr;
+    }
+
+    std::size_t structure(vector<SelectorNode>& ns) const {
+        if (&op!=&notOp) return BoolExpression::structure(ns);
+        SelectorNode n(SelectorNode::NOT, this);
+        n.operands.push_back(e1->structure(ns));
+        ns.push_back(std::move(n));
+        return ns.size()-1;
+    }
+
+    Missing missing(const string& id) const {
+        const Missing m = e1->missing(id);
+        if (m!=MISSING_UNKNOWN) return MISSING_ANY;
+        // IS NULL is TRUE and IS NOT NULL FALSE
+        if (&op==&notOp) return MISSING_UNKNOWN;
+        return &op==&isNullOp ? MISSING_ANY : MISSING_NOT_TRUE;
+    }
+
+    Estimate estimate() const {
+        Estimate x = e1->estimate();
+        // Testing for unknown is cheaper than any comparison
+        if (&op!=&notOp) return Estimate{x.cost, &op==&isNullOp ? 0.1 : 0.9, x.traps};
+        return Estimate{x.cost + 1, 1-x.truth, x.traps};
+    }
+
+    std::size_t memory() const {
+        return e1->memory();
+    }
 };
 
 class LikeExpression : public BoolExpression {
     unique_ptr<ValueExpression> e;
-    string reString;
-    std::regex regexBuffer;
-
-    static string toRegex(const string& s, const string& escape) {
-        string regex("^");
-        if (escape.size()>1) throw std::logic_error("Internal error");
-        char e = 0;
-        if (escape.size()==1) {
-            e = escape[0];
-        }
-        // Translate % -> .*, _ -> ., . ->\. *->\*
-        bool doEscape = false;
-        for (auto& i : s) {
-            if ( e!=0 && i==e ) {
-                doEscape = true;
-                continue;
-            }
-            switch(i) {
-                case '%':
-                    if (doEscape) regex += i;
-                    else regex += ".*";
-                    break;
-                case '_':
-                    if (doEscape) regex += i;
-                    else regex += ".";
-                    break;
-                case ']':
-                case '{':
-                case '}':
-                case '(':
-                case ')':
-                case '-':
-                case '+':
-                case '?':
-                case '|':
-                    regex += '[';
-                    regex += i;
-                    regex += ']';
-                    break;
-                // Don't add any more cases here: these are sufficient,
-                // adding more might turn on inadvertent matching
-                case '\\':
-                case '^':
-                case '$':
-                case '.':
-                case '*':
-                case '[':
-                    regex += "\\";
-                    // Fallthrough
-                default:
-                    regex += i;
-                    break;
-            }
-            doEscape = false;
-        }
-        regex += "$";
-        return regex;
-    }
+    LikeMatcher matcher;
 
 public:
-    LikeExpression(unique_ptr<ValueExpression> e_, const string& like, const string& escape="")
-    try :
+    LikeExpression(unique_ptr<ValueExpression> e_, const string& like, const string& escape="") :
         e(std::move(e_)),
-        reString(toRegex(like, escape)),
-        regexBuffer(reString, std::regex::basic)
+        matcher(like, escape)
     {}
-    catch (std::regex_error& e) {
-        ostringstream o("Regex Internal error: code=");
-        o << e.code() << std::ends;
-        throw std::logic_error(o.str());
-    }
 
     void repr(ostream& os) const {
-        os << *e << " REGEX_MATCH '" << reString << "'";
+        os << *e << " LIKE ";
+        matcher.repr(os);
+    }
+
+    void key(KeyWriter& w) const {
+        w.tag('L').text(matcher.pattern()).text(string(1, matcher.escapeChar())).child(*e);
     }
 
     BoolOrNone eval_bool(const Env& env) const {
         Value v(e->eval(env));
         if ( v.type!=Value::T_STRING ) return BN_UNKNOWN;
-        return BoolOrNone(std::regex_match(*v.s, regexBuffer));
+        return BoolOrNone(matcher.match(*v.s));
+    }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        e->compile(b, dst);
+        b.emit(OP_LIKE, dst, dst, 0, b.like(matcher));
+    }
+
+    bool constant() const {
+        return e->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e);
+        return constant() ? fold(*this) : nullptr;
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(e->missing(id)==MISSING_UNKNOWN);
+    }
+
+    Estimate estimate() const {
+        Estimate x = e->estimate();
+        return Estimate{x.cost + matcher.cost(), 0.25, x.traps};
+    }
+
+    std::size_t memory() const {
+        return e->memory() + matcher.memory();
     }
 };
 
@@ -476,24 +1153,137 @@ public:
         os << *e << " BETWEEN " << *l << " AND " << *u;
     }
 
-    BoolOrNone eval_bool(const Env& env) const {
-        Value ve(e->eval(env));
-        Value vl(l->eval(env));
-        Value vu(u->eval(env));
-        if (unknown(ve) || unknown(vl) || unknown(vu)) return BN_UNKNOWN;
-        return BoolOrNone(ve>=vl && ve<=vu);
+    void key(KeyWriter& w) const {
+        w.tag('B').child(*e).child(*l).child(*u);
+    }
+
+    BoolOrNone eval_bool(const Env& env) const {
+        Value ve(e->eval(env));
+        Value vl(l->eval(env));
+        Value vu(u->eval(env));
+        if (unknown(ve) || unknown(vl) || unknown(vu)) return BN_UNKNOWN;
+        return BoolOrNone(ve>=vl && ve<=vu);
+    }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        e->compile(b, dst);
+        Register tl = b.push();
+        l->compile(b, tl);
+        Register tu = b.push();
+        u->compile(b, tu);
+        b.emit(OP_BETWEEN, dst, dst, tl, tu);
+        b.pop(2);
+    }
+
+    bool constant() const {
+        return e->constant() && l->constant() && u->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e);
+        selector::simplify(l);
+        selector::simplify(u);
+        if (constant()) return fold(*this);
+        // Only numeric values can be between anything so x BETWEEN n AND n is x = n
+        if (l->constant() && u->constant()) {
+            Value vl = constantValue(*l);
+            Value vu = constantValue(*u);
+            if (numeric(vl) && numeric(vu) && vl==vu) {
+                unique_ptr<ValueExpression> c = make_unique<ComparisonExpression>(eqOp, std::move(e), std::move(l));
+                selector::simplify(c);
+                return c;
+            }
+        }
+        return nullptr;
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(e->missing(id)==MISSING_UNKNOWN || l->missing(id)==MISSING_UNKNOWN || u->missing(id)==MISSING_UNKNOWN);
+    }
+
+    Estimate estimate() const {
+        Estimate xe = e->estimate();
+        Estimate xl = l->estimate();
+        Estimate xu = u->estimate();
+        return Estimate{2 + xe.cost + xl.cost + xu.cost, 0.25, xe.traps || xl.traps || xu.traps};
+    }
+
+    void terms(vector<SelectorTerm>& ts) const {
+        SelectorTerm t(this);
+        if (e->isIdentifier(t.identifier, t.slot) && l->constant() && u->constant()) {
+            Value vl = constantValue(*l);
+            Value vu = constantValue(*u);
+            if (numeric(vl) && numeric(vu)) {
+                t.kind = SelectorTerm::RANGE;
+                t.lower = vl.type==Value::T_EXACT ? double(vl.i) : vl.x;
+                t.upper = vu.type==Value::T_EXACT ? double(vu.i) : vu.x;
+            }
+        }
+        ts.push_back(t);
+    }
+
+    std::size_t memory() const {
+        return e->memory() + l->memory() + u->memory();
+    }
+};
+
+// If every element of an IN list is constant return their values prebuilt into a set
+static unique_ptr<ValueSet> constantSet(const vector<unique_ptr<ValueExpression>>& l)
+{
+    for (auto& le : l) {
+        if (!le->constant()) return nullptr;
+    }
+    vector<Value> values;
+    for (auto& le : l) values.push_back(constantValue(*le));
+    return make_unique<ValueSet>(values);
+}
+
+// Shared by IN and NOT IN: the start instruction skips the list if the value
+// is unknown then each element in turn is folded into the result
+static void compileList(ProgramBuilder& b, Register dst, const ValueExpression& e,
+                        const vector<unique_ptr<ValueExpression>>& l, OpCode start, OpCode element)
+{
+    Register tv = b.push();
+    e.compile(b, tv);
+    vector<std::size_t> exits;
+    exits.push_back(b.emit(start, dst, tv));
+    Register tl = b.push();
+    b.conditional();
+    for (auto& le : l) {
+        le->compile(b, tl);
+        exits.push_back(b.emit(element, dst, tv, tl));
+    }
+    b.unconditional();
+    b.pop(2);
+    for (auto j : exits) b.patch(j);
+}
+
+// Estimate for value e being IN list l
+static Estimate estimateIn(const ValueExpression& e, const vector<unique_ptr<ValueExpression>>& l, bool set)
+{
+    Estimate x = e.estimate();
+    // Lookup in a set is about as quick as a couple of comparisons
+    x.cost += set ? 3 : 0;
+    for (auto& le : l) {
+        Estimate xl = le->estimate();
+        if (!set) x.cost += 1 + xl.cost;
+        x.traps = x.traps || xl.traps;
     }
-};
+    x.truth = std::min(0.05 + 0.02*l.size(), 0.5);
+    return x;
+}
 
 class InExpression : public BoolExpression {
     unique_ptr<ValueExpression> e;
     vector<unique_ptr<ValueExpression>> l;
+    unique_ptr<ValueSet> set;
 
 public:
     InExpression(unique_ptr<ValueExpression> e_, vector<unique_ptr<ValueExpression>>&& l_) :
         e(std::move(e_))
     {
         l.swap(l_);
+        set = constantSet(l);
     }
 
     void repr(ostream& os) const {
@@ -503,8 +1293,14 @@ public:
         }
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('I').child(*e);
+        for (auto& le : l) w.child(*le);
+    }
+
     BoolOrNone eval_bool(const Env& env) const {
         Value ve(e->eval(env));
+        if (set) return set->in(ve);
         if (unknown(ve)) return BN_UNKNOWN;
         BoolOrNone r = BN_FALSE;
         for (auto& le : l){
@@ -517,17 +1313,64 @@ public:
         }
         return r;
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        if (set) {
+            e->compile(b, dst);
+            b.emit(OP_IN_SET, dst, dst, 0, b.set(*set));
+            return;
+        }
+        compileList(b, dst, *e, l, OP_IN_START, OP_IN_ELEMENT);
+    }
+
+    bool constant() const {
+        return set && e->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e);
+        for (auto& le : l) selector::simplify(le);
+        return constant() ? fold(*this) : nullptr;
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(e->missing(id)==MISSING_UNKNOWN);
+    }
+
+    Estimate estimate() const {
+        return estimateIn(*e, l, bool(set));
+    }
+
+    void terms(vector<SelectorTerm>& ts) const {
+        SelectorTerm t(this);
+        if (set && e->isIdentifier(t.identifier, t.slot)) {
+            t.kind = SelectorTerm::IN;
+            for (auto& le : l) {
+                Value v = constantValue(*le);
+                if (!unknown(v)) t.values.push_back(v);
+            }
+        }
+        ts.push_back(t);
+    }
+
+    std::size_t memory() const {
+        std::size_t n = e->memory() + heapMemory(l) + (set ? sizeof(ValueSet) + set->memory() : 0);
+        for (auto& i : l) n += i->memory();
+        return n;
+    }
 };
 
 class NotInExpression : public BoolExpression {
     unique_ptr<ValueExpression> e;
     vector<unique_ptr<ValueExpression>> l;
+    unique_ptr<ValueSet> set;
 
 public:
     NotInExpression(unique_ptr<ValueExpression> e_, vector<unique_ptr<ValueExpression>>&& l_) :
         e(std::move(e_))
     {
         l.swap(l_);
+        set = constantSet(l);
     }
 
     void repr(ostream& os) const {
@@ -537,8 +1380,14 @@ public:
         }
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('N').child(*e);
+        for (auto& le : l) w.child(*le);
+    }
+
     BoolOrNone eval_bool(const Env& env) const {
         Value ve(e->eval(env));
+        if (set) return set->notIn(ve);
         if (unknown(ve)) return BN_UNKNOWN;
         BoolOrNone r = BN_TRUE;
         for (auto& le : l){
@@ -560,6 +1409,41 @@ public:
         }
         return r;
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        if (set) {
+            e->compile(b, dst);
+            b.emit(OP_NOT_IN_SET, dst, dst, 0, b.set(*set));
+            return;
+        }
+        compileList(b, dst, *e, l, OP_NOT_IN_START, OP_NOT_IN_ELEMENT);
+    }
+
+    bool constant() const {
+        return set && e->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e);
+        for (auto& le : l) selector::simplify(le);
+        return constant() ? fold(*this) : nullptr;
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(e->missing(id)==MISSING_UNKNOWN);
+    }
+
+    Estimate estimate() const {
+        Estimate x = estimateIn(*e, l, bool(set));
+        x.truth = 1-x.truth;
+        return x;
+    }
+
+    std::size_t memory() const {
+        std::size_t n = e->memory() + heapMemory(l) + (set ? sizeof(ValueSet) + set->memory() : 0);
+        for (auto& i : l) n += i->memory();
+        return n;
+    }
 };
 
 // Arithmetic Expression types
@@ -580,9 +1464,57 @@ public:
         os << "(" << *e1 << op << *e2 << ")";
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('A').tag(char(op.opcode())).child(*e1).child(*e2);
+    }
+
     Value eval(const Env& env) const {
         return op.eval(*e1, *e2, env);
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        e1->compile(b, dst);
+        Register t = b.push();
+        e2->compile(b, t);
+        b.emit(op.opcode(), dst, dst, t);
+        b.pop();
+    }
+
+    bool constant() const {
+        if (!e1->constant() || !e2->constant()) return false;
+        if (&op!=&div) return true;
+        // Leave integer division that would trap to happen (or not) when evaluated
+        Value v1 = constantValue(*e1);
+        Value v2 = constantValue(*e2);
+        return !(v1.type==Value::T_EXACT && v2.type==Value::T_EXACT &&
+                 (v2.i==0 || (v2.i==-1 && v1.i==INT64_MIN)));
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e1);
+        selector::simplify(e2);
+        return constant() ? fold(*this) : nullptr;
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(e1->missing(id)==MISSING_UNKNOWN || e2->missing(id)==MISSING_UNKNOWN);
+    }
+
+    Estimate estimate() const {
+        Estimate x1 = e1->estimate();
+        Estimate x2 = e2->estimate();
+        bool traps = x1.traps || x2.traps;
+        if (&op==&div && !constant()) {
+            // Only a constant divisor other than 0 and -1 is safe
+            Value v2 = e2->constant() ? constantValue(*e2) : Value();
+            traps = traps || unknown(v2) || (v2.type==Value::T_EXACT && (v2.i==0 || v2.i==-1));
+        }
+        return Estimate{1 + x1.cost + x2.cost, 0.5, traps};
+    }
+
+    std::size_t memory() const {
+        return e1->memory() + e2->memory();
+    }
 };
 
 class UnaryArithExpression : public ValueExpression {
@@ -599,9 +1531,40 @@ public:
         os << op << "(" << *e1 << ")";
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('U').tag(char(op.opcode())).child(*e1);
+    }
+
     Value eval(const Env& env) const {
         return op.eval(*e1, env);
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        e1->compile(b, dst);
+        b.emit(op.opcode(), dst, dst);
+    }
+
+    bool constant() const {
+        return e1->constant();
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        selector::simplify(e1);
+        return constant() ? fold(*this) : nullptr;
+    }
+
+    Missing missing(const string& id) const {
+        return e1->missing(id);
+    }
+
+    Estimate estimate() const {
+        Estimate x = e1->estimate();
+        return Estimate{x.cost + 1, 0.5, x.traps};
+    }
+
+    std::size_t memory() const {
+        return e1->memory();
+    }
 };
 
 // Expression types...
@@ -619,48 +1582,269 @@ public:
         os << value;
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('V').value(value);
+    }
+
     Value eval(const Env&) const {
         return value;
     }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        // Most integers in selectors are small enough to go in the instruction
+        if (value.type==Value::T_EXACT && value.i==int32_t(value.i)) b.emit(OP_INT, dst, 0, 0, uint32_t(int32_t(value.i)));
+        else b.emit(OP_CONST, dst, 0, 0, b.constant(value));
+    }
+
+    bool constant() const {
+        return true;
+    }
+
+    Estimate estimate() const {
+        return Estimate{0, value.type==Value::T_BOOL && value.b ? 1.0 : 0.0, false};
+    }
 };
 
 class StringLiteral : public ValueExpression {
-    const string value;
+    // Empty if the text is interned in a SymbolTable
+    const string own;
+    const string& value;
+    // Hashed as it is likely to be compared with many strings
+    const Value v;
 
 public:
-    StringLiteral(const string& v) :
-        value(v)
+    StringLiteral(const string& s, SymbolTable* symbols) :
+        own(symbols ? string() : s),
+        value(symbols ? symbols->intern(s) : own),
+        v(hashed(value))
     {}
 
     void repr(ostream& os) const {
         os << "'" << value << "'";
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('V').value(v);
+    }
+
     Value eval(const Env&) const {
-        return value;
+        return v;
+    }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        b.emit(OP_CONST, dst, 0, 0, b.constant(v, &value!=&own));
+    }
+
+    std::size_t memory() const {
+        return heapMemory(own);
+    }
+
+    bool constant() const {
+        return true;
+    }
+
+    Estimate estimate() const {
+        return Estimate{0, 0.0, false};
     }
 };
 
+static unique_ptr<ValueExpression> fold(const ValueExpression& e)
+{
+    // Only a StringLiteral has a string value and that is never folded
+    return make_unique<Literal>(constantValue(e));
+}
+
 class Identifier : public ValueExpression {
-    string identifier;
+    const std::size_t slot;
+    // Empty if the name is bound in a SymbolTable
+    const string own;
+    const string& identifier;
 
 public:
-    Identifier(const string& i) :
-        identifier(i)
+    Identifier(const string& i, SymbolTable* symbols) :
+        slot(symbols ? symbols->bind(i) : SymbolTable::npos),
+        own(symbols ? string() : i),
+        identifier(symbols ? symbols->name(slot) : own)
     {}
 
     void repr(ostream& os) const {
         os << "I:" << identifier;
     }
 
+    void key(KeyWriter& w) const {
+        w.tag('X').text(identifier);
+    }
+
     Value eval(const Env& env) const {
-        return env.value(identifier);
+        return env.value(slot, identifier);
+    }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        b.emit(OP_IDENTIFIER, dst, 0, 0, b.identifier(identifier, slot));
+    }
+
+    Missing missing(const string& id) const {
+        return unknownIf(id==identifier);
+    }
+
+    Estimate estimate() const {
+        return Estimate{1, 0.5, false};
+    }
+
+    bool isIdentifier(string& name, std::size_t& s) const {
+        name = identifier;
+        s = slot;
+        return true;
+    }
+
+    const Value& value(const Env& env) const {
+        return env.value(slot, identifier);
+    }
+
+    std::size_t memory() const {
+        return heapMemory(own);
+    }
+};
+
+// Comparisons of an identifier with a literal of a type known when the
+// selector is parsed. The literal is converted in advance for comparison with
+// either kind of number, so evaluating only checks the identifier's type then
+// compares natively. They give the same results as ComparisonExpression, whose
+// representation, compiled form and terms they keep.
+
+// identifier Compare EXACT
+template <class Compare>
+class IdentifierCompareExact : public ComparisonExpression {
+    const Identifier& identifier;
+    const int64_t i;
+    const double x;
+
+public:
+    IdentifierCompareExact(ComparisonExpression&& e, const Identifier& id, const Value& c) :
+        ComparisonExpression(std::move(e)),
+        identifier(id),
+        i(c.i),
+        x(double(c.i))
+    {}
+
+    BoolOrNone eval_bool(const Env& env) const {
+        const Value& v = identifier.value(env);
+        switch (v.type) {
+        case Value::T_EXACT:   return BoolOrNone(Compare()(v.i, i));
+        case Value::T_INEXACT: return BoolOrNone(Compare()(v.x, x));
+        case Value::T_UNKNOWN: return BN_UNKNOWN;
+        default:               return BN_FALSE;
+        }
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        return nullptr;
+    }
+};
+
+// identifier Compare INEXACT
+template <class Compare>
+class IdentifierCompareInexact : public ComparisonExpression {
+    const Identifier& identifier;
+    const double x;
+
+public:
+    IdentifierCompareInexact(ComparisonExpression&& e, const Identifier& id, const Value& c) :
+        ComparisonExpression(std::move(e)),
+        identifier(id),
+        x(c.x)
+    {}
+
+    BoolOrNone eval_bool(const Env& env) const {
+        const Value& v = identifier.value(env);
+        switch (v.type) {
+        case Value::T_EXACT:   return BoolOrNone(Compare()(double(v.i), x));
+        case Value::T_INEXACT: return BoolOrNone(Compare()(v.x, x));
+        case Value::T_UNKNOWN: return BN_UNKNOWN;
+        default:               return BN_FALSE;
+        }
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        return nullptr;
+    }
+};
+
+// identifier = STRING or, if not Equal, identifier <> STRING
+template <bool Equal>
+class IdentifierEqualsString : public ComparisonExpression {
+    const Identifier& identifier;
+    const Value c;
+
+public:
+    IdentifierEqualsString(ComparisonExpression&& e, const Identifier& id, const Value& c0) :
+        ComparisonExpression(std::move(e)),
+        identifier(id),
+        c(c0)
+    {}
+
+    BoolOrNone eval_bool(const Env& env) const {
+        const Value& v = identifier.value(env);
+        switch (v.type) {
+        case Value::T_STRING:  return BoolOrNone((v.s==c.s || (maybeEqual(v, c) && *v.s==*c.s))==Equal);
+        case Value::T_UNKNOWN: return BN_UNKNOWN;
+        default:               return BN_FALSE;
+        }
+    }
+
+    unique_ptr<ValueExpression> simplify() {
+        return nullptr;
     }
 };
 
+template <template <class> class Node>
+static unique_ptr<ValueExpression> typedComparison(const ComparisonOperator& op, bool flipped,
+                                                   ComparisonExpression&& e, const Identifier& id, const Value& c)
+{
+    // With the literal first the order comparisons are mirrored
+    if (&op==&eqOp) return make_unique<Node<std::equal_to<>>>(std::move(e), id, c);
+    if (&op==&neqOp) return make_unique<Node<std::not_equal_to<>>>(std::move(e), id, c);
+    if (&op==(flipped ? &grOp : &lsOp)) return make_unique<Node<std::less<>>>(std::move(e), id, c);
+    if (&op==(flipped ? &lsOp : &grOp)) return make_unique<Node<std::greater<>>>(std::move(e), id, c);
+    if (&op==(flipped ? &greqOp : &lseqOp)) return make_unique<Node<std::less_equal<>>>(std::move(e), id, c);
+    return make_unique<Node<std::greater_equal<>>>(std::move(e), id, c);
+}
+
+unique_ptr<ValueExpression> ComparisonExpression::typed()
+{
+    const bool flipped = !dynamic_cast<const Identifier*>(e1.get());
+    const Identifier* id = dynamic_cast<const Identifier*>((flipped ? e2 : e1).get());
+    const ValueExpression& literal = flipped ? *e1 : *e2;
+    if (!id || !literal.constant()) return nullptr;
+
+    const Value c = constantValue(literal);
+    switch (c.type) {
+    case Value::T_EXACT:
+        return typedComparison<IdentifierCompareExact>(op, flipped, std::move(*this), *id, c);
+    case Value::T_INEXACT:
+        return typedComparison<IdentifierCompareInexact>(op, flipped, std::move(*this), *id, c);
+    case Value::T_STRING:
+        if (&op==&eqOp) return make_unique<IdentifierEqualsString<true>>(std::move(*this), *id, c);
+        if (&op==&neqOp) return make_unique<IdentifierEqualsString<false>>(std::move(*this), *id, c);
+        return nullptr;
+    default:
+        return nullptr;
+    }
+}
+
 ////////////////////////////////////////////////////
 
-struct Parse {
+class Parse {
+    Tokeniser& tokeniser;
+    SymbolTable* symbols;
+    bool adaptive;
+
+public:
+Parse(Tokeniser& t, SymbolTable* s, bool a = false) :
+    tokeniser(t),
+    symbols(s),
+    adaptive(a)
+{}
 
 [[noreturn]]
 static inline void throwParseError(const Token& token, const string& msg) {
@@ -677,37 +1861,41 @@ static inline void throwParseError(Tokeniser& tokeniser, const string& msg) {
     throwParseError(tokeniser.nextToken(), msg);
 }
 
-static unique_ptr<ValueExpression> selectorExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> selectorExpression()
 {
     if ( tokeniser.nextToken().type==T_EOS ) {
         return make_unique<Literal>(true);
     }
     tokeniser.returnTokens();
-    auto e = orExpression(tokeniser);
+    auto e = orExpression();
     if (tokeniser.nextToken().type != T_EOS) {
       throwParseError(tokeniser, "extra input");
     }
     return e;
 }
 
-static unique_ptr<ValueExpression> orExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> orExpression()
 {
-    auto e = andExpression(tokeniser);
+    vector<unique_ptr<ValueExpression>> operands;
+    operands.push_back(andExpression());
     while ( tokeniser.nextToken().type==T_OR ) {
-        e = make_unique<OrExpression>(std::move(e), andExpression(tokeniser));
+        operands.push_back(andExpression());
     }
     tokeniser.returnTokens();
-    return e;
+    if (operands.size()==1) return std::move(operands[0]);
+    return make_unique<OrExpression>(std::move(operands), adaptive);
 }
 
-static unique_ptr<ValueExpression> andExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> andExpression()
 {
-    auto e = comparisonExpression(tokeniser);
+    vector<unique_ptr<ValueExpression>> operands;
+    operands.push_back(comparisonExpression());
     while ( tokeniser.nextToken().type==T_AND ) {
-        e = make_unique<AndExpression>(std::move(e), comparisonExpression(tokeniser));
+        operands.push_back(comparisonExpression());
     }
     tokeniser.returnTokens();
-    return e;
+    if (operands.size()==1) return std::move(operands[0]);
+    return make_unique<AndExpression>(std::move(operands), adaptive);
 }
 
 static unique_ptr<BoolExpression> conditionalNegate(bool negated, unique_ptr<BoolExpression> e)
@@ -715,7 +1903,7 @@ static unique_ptr<BoolExpression> conditionalNegate(bool negated, unique_ptr<Boo
     return negated ? make_unique<UnaryBooleanExpression>(notOp, std::move(e)) : std::move(e);
 }
 
-static unique_ptr<BoolExpression> specialComparisons(Tokeniser& tokeniser, unique_ptr<ValueExpression> e1, bool negated = false) {
+unique_ptr<BoolExpression> specialComparisons(unique_ptr<ValueExpression> e1, bool negated = false) {
     switch (tokeniser.nextToken().type) {
     case T_LIKE: {
         auto t = tokeniser.nextToken();
@@ -741,11 +1929,11 @@ static unique_ptr<BoolExpression> specialComparisons(Tokeniser& tokeniser, uniqu
         }
     }
     case T_BETWEEN: {
-        auto lower = addExpression(tokeniser);
+        auto lower = addExpression();
         if ( tokeniser.nextToken().type!=T_AND ) {
             throwParseError(tokeniser, "expected AND after BETWEEN");
         }
-        return conditionalNegate(negated, make_unique<BetweenExpression>(std::move(e1), std::move(lower), addExpression(tokeniser)));
+        return conditionalNegate(negated, make_unique<BetweenExpression>(std::move(e1), std::move(lower), addExpression()));
     }
     case T_IN: {
         if ( tokeniser.nextToken().type!=T_LPAREN ) {
@@ -753,7 +1941,7 @@ static unique_ptr<BoolExpression> specialComparisons(Tokeniser& tokeniser, uniqu
         }
         vector<unique_ptr<ValueExpression>> list;
         do {
-            list.push_back(addExpression(tokeniser));
+            list.push_back(addExpression());
         } while (tokeniser.nextToken().type==T_COMMA);
         tokeniser.returnTokens();
         if ( tokeniser.nextToken().type!=T_RPAREN ) {
@@ -767,14 +1955,14 @@ static unique_ptr<BoolExpression> specialComparisons(Tokeniser& tokeniser, uniqu
     }
 }
 
-static unique_ptr<ValueExpression> comparisonExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> comparisonExpression()
 {
     if ( tokeniser.nextToken().type==T_NOT ) {
-        return make_unique<UnaryBooleanExpression>(notOp, comparisonExpression(tokeniser));
+        return make_unique<UnaryBooleanExpression>(notOp, comparisonExpression());
     }
 
     tokeniser.returnTokens();
-    auto e1 = addExpression(tokeniser);
+    auto e1 = addExpression();
 
     const ComparisonOperator* op;
     switch (tokeniser.nextToken().type) {
@@ -791,12 +1979,12 @@ static unique_ptr<ValueExpression> comparisonExpression(Tokeniser& tokeniser)
             throwParseError(tokeniser, "expected NULL or NOT NULL after IS");
         }
     case T_NOT:
-        return specialComparisons(tokeniser, std::move(e1), true);
+        return specialComparisons(std::move(e1), true);
     case T_BETWEEN:
     case T_LIKE:
     case T_IN:
         tokeniser.returnTokens();
-        return specialComparisons(tokeniser, std::move(e1));
+        return specialComparisons(std::move(e1));
     case T_EQUAL: op = &eqOp; break;
     case T_NEQ:   op = &neqOp; break;
     case T_LESS:  op = &lsOp; break;
@@ -807,17 +1995,17 @@ static unique_ptr<ValueExpression> comparisonExpression(Tokeniser& tokeniser)
         tokeniser.returnTokens();
         return e1;
     }
-    return make_unique<ComparisonExpression>(*op, std::move(e1), addExpression(tokeniser));
+    return make_unique<ComparisonExpression>(*op, std::move(e1), addExpression());
 }
 
-static unique_ptr<ValueExpression> addExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> addExpression()
 {
-    auto e = multiplyExpression(tokeniser);
+    auto e = multiplyExpression();
 
     auto t = tokeniser.nextToken();
     while (t.type==T_PLUS || t.type==T_MINUS ) {
         const ArithmeticOperator& op = t.type==T_PLUS ? add : sub;
-        e = make_unique<ArithmeticExpression>(op, std::move(e), multiplyExpression(tokeniser));
+        e = make_unique<ArithmeticExpression>(op, std::move(e), multiplyExpression());
         t = tokeniser.nextToken();
     }
 
@@ -825,14 +2013,14 @@ static unique_ptr<ValueExpression> addExpression(Tokeniser& tokeniser)
     return e;
 }
 
-static unique_ptr<ValueExpression> multiplyExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> multiplyExpression()
 {
-    auto e = unaryArithExpression(tokeniser);
+    auto e = unaryArithExpression();
 
     auto t = tokeniser.nextToken();
     while (t.type==T_MULT || t.type==T_DIV ) {
         const ArithmeticOperator& op = t.type==T_MULT ? mult : div;
-        e = make_unique<ArithmeticExpression>(op, std::move(e), unaryArithExpression(tokeniser));
+        e = make_unique<ArithmeticExpression>(op, std::move(e), unaryArithExpression());
         t = tokeniser.nextToken();
     }
 
@@ -840,22 +2028,45 @@ static unique_ptr<ValueExpression> multiplyExpression(Tokeniser& tokeniser)
     return e;
 }
 
+// Copy the text of a numeric literal without its underscores to a null
+// terminated buffer, which is usually on the stack
+class NumericText {
+    char small[64];
+    string large;
+    const char* text;
+
+public:
+    NumericText(const TokenText& t) {
+        char* out = small;
+        if (t.size() >= sizeof(small)) {
+            large.assign(t.size()+1, 0);
+            out = &large[0];
+        }
+        text = out;
+        *std::remove_copy(t.begin(), t.end(), out, '_') = 0;
+    }
+
+    const char* c_str() const {
+        return text;
+    }
+};
+
 static unique_ptr<ValueExpression> exactNumeric(const Token& token, bool negate)
 {
     int base = 0;
-    string s;
-    std::remove_copy(token.val.begin(), token.val.end(), std::back_inserter(s), '_');
-    if (s[1]=='b' || s[1]=='B') {
+    NumericText text(token.val);
+    const char* s = text.c_str();
+    if (s[0] && (s[1]=='b' || s[1]=='B')) {
         base = 2;
-        s = s.substr(2);
-    } else if (s[1]=='x' || s[1]=='X') {
+        s += 2;
+    } else if (s[0] && (s[1]=='x' || s[1]=='X')) {
         base = 16;
-        s = s.substr(2);
+        s += 2;
     } if (s[0]=='0') {
         base = 8;
     }
     errno = 0;
-    uint64_t value = strtoull(s.c_str(), 0, base);
+    uint64_t value = strtoull(s, 0, base);
     if (!errno && (base || value<=INT64_MAX)) {
         int64_t r = value;
         return make_unique<Literal>((negate ? -r : r));
@@ -867,18 +2078,17 @@ static unique_ptr<ValueExpression> exactNumeric(const Token& token, bool negate)
 static unique_ptr<ValueExpression> approxNumeric(const Token& token)
 {
     errno = 0;
-    string s;
-    std::remove_copy(token.val.begin(), token.val.end(), std::back_inserter(s), '_');
-    double value = std::strtod(s.c_str(), 0);
+    NumericText text(token.val);
+    double value = std::strtod(text.c_str(), 0);
     if (!errno) return make_unique<Literal>(value);
     throwParseError(token, "floating literal overflow/underflow");
 }
 
-static unique_ptr<ValueExpression> unaryArithExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> unaryArithExpression()
 {
     switch (tokeniser.nextToken().type) {
     case T_LPAREN: {
-        auto e = orExpression(tokeniser);
+        auto e = orExpression();
         if ( tokeniser.nextToken().type!=T_RPAREN ) {
             throwParseError(tokeniser, "missing ')' after '('");
         }
@@ -893,7 +2103,7 @@ static unique_ptr<ValueExpression> unaryArithExpression(Tokeniser& tokeniser)
             return exactNumeric(t, true);
         } else {
             tokeniser.returnTokens();
-            return make_unique<UnaryArithExpression>(negate, unaryArithExpression(tokeniser));
+            return make_unique<UnaryArithExpression>(negate, unaryArithExpression());
         }
     }
     default:
@@ -901,17 +2111,17 @@ static unique_ptr<ValueExpression> unaryArithExpression(Tokeniser& tokeniser)
         break;
     }
 
-    return primaryExpression(tokeniser);
+    return primaryExpression();
 }
 
-static unique_ptr<ValueExpression> primaryExpression(Tokeniser& tokeniser)
+unique_ptr<ValueExpression> primaryExpression()
 {
     auto t = tokeniser.nextToken();
     switch (t.type) {
         case T_IDENTIFIER:
-            return make_unique<Identifier>(t.val);
+            return make_unique<Identifier>(t.val, symbols);
         case T_STRING:
-            return make_unique<StringLiteral>(t.val);
+            return make_unique<StringLiteral>(t.val, symbols);
         case T_FALSE:
             return make_unique<Literal>(false);
         case T_TRUE:
@@ -930,12 +2140,189 @@ static unique_ptr<ValueExpression> primaryExpression(Tokeniser& tokeniser)
 ///////////////////////////////////////////////////////////
 
 // Top level parser
+// The root of a selector's tree, owning the Arena its nodes are in
+class ArenaSelector : public ValueExpression {
+    // Declared first so that it is destroyed after the nodes in it
+    unique_ptr<Arena> arena;
+    unique_ptr<ValueExpression> root;
+
+public:
+    ArenaSelector(unique_ptr<Arena> a, unique_ptr<ValueExpression> r) :
+        arena(std::move(a)),
+        root(std::move(r))
+    {}
+
+    void repr(ostream& os) const {
+        root->repr(os);
+    }
+
+    void key(KeyWriter& w) const {
+        w.tag('S').child(*root);
+    }
+
+    Value eval(const Env& env) const {
+        return root->eval(env);
+    }
+
+    BoolOrNone eval_bool(const Env& env) const {
+        return root->eval_bool(env);
+    }
+
+    void emit(ProgramBuilder& b, Register dst) const {
+        root->compile(b, dst);
+    }
+
+    bool constant() const {
+        return root->constant();
+    }
+
+    Missing missing(const string& id) const {
+        return root->missing(id);
+    }
+
+    std::size_t structure(vector<SelectorNode>& ns) const {
+        return root->structure(ns);
+    }
+
+    Estimate estimate() const {
+        return root->estimate();
+    }
+
+    void terms(vector<SelectorTerm>& ts) const {
+        root->terms(ts);
+    }
+
+    bool isIdentifier(string& name, std::size_t& slot) const {
+        return root->isIdentifier(name, slot);
+    }
+
+    std::size_t memory() const {
+        return sizeof(*this) + sizeof(Arena) + arena->reserved() + root->memory();
+    }
+};
+
+static unique_ptr<Expression> parseSelector(const string& exp, SymbolTable* symbols, bool adaptive)
+{
+    // Roughly enough for the nodes of a typical selector of this length
+    unique_ptr<Arena> arena(new Arena(256 + 16*exp.size()));
+    unique_ptr<ValueExpression> r;
+    {
+        ArenaScope scope(*arena);
+        auto s = exp.cbegin();
+        auto e = exp.cend();
+        auto tokeniser = Tokeniser{s,e};
+        r = Parse{tokeniser, symbols, adaptive}.selectorExpression();
+        simplify(r);
+    }
+    return make_unique<ArenaSelector>(std::move(arena), std::move(r));
+}
+
 unique_ptr<Expression> make_selector(const string& exp)
 {
-    auto s = exp.cbegin();
-    auto e = exp.cend();
-    auto tokeniser = Tokeniser{s,e};
-    return Parse::selectorExpression(tokeniser);
+    return parseSelector(exp, nullptr, false);
+}
+
+unique_ptr<Expression> make_selector(const string& exp, SymbolTable& symbols)
+{
+    return parseSelector(exp, &symbols, false);
+}
+
+unique_ptr<Expression> make_adaptive_selector(const string& exp)
+{
+    return parseSelector(exp, nullptr, true);
+}
+
+unique_ptr<Expression> make_adaptive_selector(const string& exp, SymbolTable& symbols)
+{
+    return parseSelector(exp, &symbols, true);
+}
+
+unique_ptr<Expression> make_compact_selector(const string& exp, SymbolTable& symbols)
+{
+    return compile(*make_selector(exp, symbols));
+}
+
+unique_ptr<Expression> compile(const Expression& exp)
+{
+    if (auto p = dynamic_cast<const Program*>(&exp)) return make_unique<Program>(*p);
+
+    const ValueExpression& e = dynamic_cast<const ValueExpression&>(exp);
+    unordered_map<string, ProgramBuilder::Key> numbers;
+    ProgramBuilder::Keys keys;
+    KeyWriter(numbers, keys).child(e);
+
+    ProgramBuilder finder;
+    finder.identify(keys);
+    finder.findShared();
+    Register r = finder.push();
+    e.compile(finder, r);
+    finder.pop();
+
+    ProgramBuilder b;
+    b.identify(keys);
+    b.share(finder);
+    r = b.push();
+    e.compile(b, r);
+    b.pop();
+    return b.finish();
+}
+
+void save_selector(const Expression& exp, string& out)
+{
+    if (auto p = dynamic_cast<const Program*>(&exp)) {
+        p->save(out);
+    } else {
+        static_cast<const Program&>(*compile(exp)).save(out);
+    }
+}
+
+unique_ptr<Expression> load_selector(const char* data, std::size_t n)
+{
+    return Program::load(data, n, nullptr);
+}
+
+unique_ptr<Expression> load_selector(const char* data, std::size_t n, SymbolTable& symbols)
+{
+    return Program::load(data, n, &symbols);
+}
+
+std::size_t memory_usage(const Expression& exp)
+{
+    if (auto p = dynamic_cast<const Program*>(&exp)) return p->memory();
+    return dynamic_cast<const ValueExpression&>(exp).memory();
+}
+
+string selectorKey(const Expression& exp)
+{
+    string k;
+    if (auto e = dynamic_cast<const ValueExpression*>(&exp)) {
+        KeyWriter(k).child(*e);
+    } else {
+        // Compiled selectors are told apart by their saved form, which can't
+        // begin with the bracket that every tree's description does
+        k += 'P';
+        static_cast<const Program&>(exp).save(k);
+    }
+    return k;
+}
+
+void selectorTerms(const Expression& exp, vector<SelectorTerm>& terms)
+{
+    if (auto e = dynamic_cast<const ValueExpression*>(&exp)) e->terms(terms);
+    else terms.push_back(SelectorTerm(&exp));
+}
+
+std::size_t selectorNodes(const Expression& exp, vector<SelectorNode>& nodes)
+{
+    if (auto e = dynamic_cast<const ValueExpression*>(&exp)) return e->structure(nodes);
+    nodes.push_back(SelectorNode(SelectorNode::LEAF, &exp));
+    return nodes.size()-1;
+}
+
+SelectorAnalysis::Missing selectorMissing(const Expression& exp, const string& identifier)
+{
+    auto e = dynamic_cast<const ValueExpression*>(&exp);
+    return e ? e->missing(identifier) : MISSING_ANY;
 }
 
 bool eval(const Expression& exp, const Env& env)
@@ -943,6 +2330,37 @@ bool eval(const Expression& exp, const Env& env)
     return exp.eval_bool(env)==BN_TRUE;
 }
 
+namespace {
+template <typename Batch>
+void eval_batch(const Expression& exp, const Batch& batch, std::size_t n, uint8_t* results)
+{
+    if (auto p = dynamic_cast<const Program*>(&exp)) {
+        p->eval_batch(batch, n, results);
+    } else {
+        static_cast<const Program&>(*compile(exp)).eval_batch(batch, n, results);
+    }
+}
+}
+
+void eval_batch(const Expression& exp, const Env* const* envs, std::size_t n, uint8_t* results)
+{
+    eval_batch<const Env* const*>(exp, envs, n, results);
+}
+
+void eval_batch(const Expression& exp, const Value* const* columns, std::size_t n, uint8_t* results)
+{
+    eval_batch<const Value* const*>(exp, columns, n, results);
+}
+
+void eval_batch(const Expression& exp, const ColumnarEnv& env, uint8_t* results)
+{
+    if (auto p = dynamic_cast<const Program*>(&exp)) {
+        p->eval_batch(env, results);
+    } else {
+        static_cast<const Program&>(*compile(exp)).eval_batch(env, results);
+    }
+}
+
 std::ostream& operator<<(std::ostream& o, const Expression& e)
 {
     e.repr(o);
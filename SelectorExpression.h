@@ -24,14 +24,35 @@
 
 #include "SelectorValue.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
 #include <string>
 
 namespace selector {
 
+class ColumnarEnv;
 class Env;
+class SymbolTable;
 
+/**
+ * A parsed or compiled selector.
+ *
+ * Expressions are immutable once made: eval(), eval_bool(), eval_batch() and
+ * compile() may be called on one Expression from any number of threads at
+ * once, given Envs that are themselves safe to use that way. The only state an
+ * evaluation changes is the operand statistics of selectors from
+ * make_adaptive_selector, which are sampled relaxed atomics that never affect
+ * results. Destroying an Expression must not race with using it.
+ *
+ * eval() and eval_bool() don't allocate memory when value() of the Env
+ * doesn't, apart from once on each thread to hold the registers of the
+ * largest compiled selector it has run, and when a selector from
+ * make_jit_selector() is compiled to native code. eval_batch() of a compiled
+ * selector against Envs or columns likewise only allocates when a thread
+ * evaluates a batch with more registers than any before it.
+ */
 class Expression {
 public:
     virtual ~Expression() {};
@@ -41,7 +62,48 @@ public:
 };
 
 __attribute__((visibility("default"))) std::unique_ptr<Expression> make_selector(const std::string& exp);
+// Also binds every identifier in exp to a slot in symbols (see SlotEnv)
+__attribute__((visibility("default"))) std::unique_ptr<Expression> make_selector(const std::string& exp, SymbolTable& symbols);
+// As make_selector but the operands of each AND and OR are also reordered as the
+// selector is evaluated, so that the one that more often decides the result by
+// itself (for its cost) is evaluated first. Only affects evaluation of the
+// Expression tree, not of what it compiles to.
+__attribute__((visibility("default"))) std::unique_ptr<Expression> make_adaptive_selector(const std::string& exp);
+__attribute__((visibility("default"))) std::unique_ptr<Expression> make_adaptive_selector(const std::string& exp, SymbolTable& symbols);
+// Compile to a flat instruction array run by a register machine: gives the same
+// results as the Expression it was compiled from but doesn't depend on it
+__attribute__((visibility("default"))) std::unique_ptr<Expression> compile(const Expression&);
 __attribute__((visibility("default"))) bool eval(const Expression&, const Env&);
+
+// The smallest form of a selector, for applications holding very many: the
+// same as compile(*make_selector(exp, symbols)) without keeping the tree.
+// Identifier names and string literals are only held by symbols, which
+// interns them for every selector bound to it.
+__attribute__((visibility("default"))) std::unique_ptr<Expression> make_compact_selector(const std::string& exp, SymbolTable& symbols);
+// Bytes of memory held by a selector, including what it has allocated from
+// the heap but not the strings it shares through a SymbolTable
+__attribute__((visibility("default"))) std::size_t memory_usage(const Expression&);
+
+// Append the compiled form of an Expression to out as a versioned byte string
+// that load_selector() can turn back into a compiled selector without parsing,
+// whatever process or machine it was saved on.
+__attribute__((visibility("default"))) void save_selector(const Expression&, std::string& out);
+// Identifiers are looked up by name, or bound to slots in symbols. Throws
+// std::range_error unless data is exactly one saved selector of a format
+// version this library reads.
+__attribute__((visibility("default"))) std::unique_ptr<Expression> load_selector(const char* data, std::size_t n);
+__attribute__((visibility("default"))) std::unique_ptr<Expression> load_selector(const char* data, std::size_t n, SymbolTable& symbols);
+
+// Evaluate against n messages at once, setting results[i] to the BoolOrNone
+// result for envs[i]. Expressions that didn't come from compile() are compiled
+// on each call, so compile once if evaluating many batches.
+__attribute__((visibility("default"))) void eval_batch(const Expression&, const Env* const* envs, std::size_t n, uint8_t* results);
+// Columnar form: columns[s][i] is the value of the identifier bound to slot s
+// for message i, a null column meaning that no message has that property.
+// Every identifier in the expression must have been bound to a slot.
+__attribute__((visibility("default"))) void eval_batch(const Expression&, const Value* const* columns, std::size_t n, uint8_t* results);
+// Evaluate against every row of env, setting results[i] for row i
+__attribute__((visibility("default"))) void eval_batch(const Expression&, const ColumnarEnv& env, uint8_t* results);
 __attribute__((visibility("default"))) std::ostream& operator<<(std::ostream&, const Expression&);
 }
 
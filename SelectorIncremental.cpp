@@ -0,0 +1,121 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorIncremental.h"
+
+#include "SelectorExpression.h"
+#include "SelectorProgram.h"
+#include "SelectorTerms.h"
+
+#include <limits>
+#include <memory>
+
+namespace selector {
+
+using std::size_t;
+
+namespace {
+
+const size_t NONE = std::numeric_limits<size_t>::max();
+
+}
+
+IncrementalEval::IncrementalEval(const Expression& selector) :
+    leafEvaluations(0)
+{
+    std::vector<SelectorNode> structure;
+    root = selectorNodes(selector, structure);
+    nodes.resize(structure.size());
+    for (size_t i = 0; i<structure.size(); ++i) {
+        const SelectorNode& s = structure[i];
+        Node& n = nodes[i];
+        n.kind = s.kind==SelectorNode::AND ? Node::AND :
+                 s.kind==SelectorNode::OR ? Node::OR :
+                 s.kind==SelectorNode::NOT ? Node::NOT : Node::LEAF;
+        n.leaf = s.kind==SelectorNode::LEAF ? s.expression : nullptr;
+        n.operands = s.operands;
+        n.parent = NONE;
+        n.result = BN_UNKNOWN;
+        n.known = false;
+        for (size_t o : n.operands) nodes[o].parent = i;
+        if (n.leaf) {
+            const std::unique_ptr<Expression> p = compile(*n.leaf);
+            for (auto& name : static_cast<const Program&>(*p).identifierNames()) readers[name].push_back(i);
+        }
+    }
+}
+
+BoolOrNone IncrementalEval::eval(size_t i, const Env& env)
+{
+    Node& n = nodes[i];
+    if (n.known) return n.result;
+    BoolOrNone r;
+    switch (n.kind) {
+    case Node::LEAF:
+        ++leafEvaluations;
+        r = n.leaf->eval_bool(env);
+        break;
+    case Node::NOT: {
+        const BoolOrNone o = eval(n.operands[0], env);
+        r = o==BN_UNKNOWN ? BN_UNKNOWN : BoolOrNone(o==BN_FALSE);
+        break;
+    }
+    default: {
+        // The value that decides the result by itself
+        const BoolOrNone decider = n.kind==Node::OR ? BN_TRUE : BN_FALSE;
+        r = n.kind==Node::OR ? BN_FALSE : BN_TRUE;
+        for (size_t o : n.operands) {
+            const BoolOrNone ro = eval(o, env);
+            if (ro==decider) {
+                r = decider;
+                break;
+            }
+            if (ro==BN_UNKNOWN) r = BN_UNKNOWN;
+        }
+        break;
+    }
+    }
+    n.result = r;
+    n.known = true;
+    return r;
+}
+
+BoolOrNone IncrementalEval::eval_bool(const Env& env)
+{
+    return eval(root, env);
+}
+
+void IncrementalEval::changed(const std::string& identifier)
+{
+    auto i = readers.find(identifier);
+    if (i==readers.end()) return;
+    for (size_t leaf : i->second) {
+        // A node that isn't known has no known ancestor that depends on it
+        for (size_t n = leaf; n!=NONE && nodes[n].known; n = nodes[n].parent) nodes[n].known = false;
+    }
+}
+
+void IncrementalEval::reset()
+{
+    for (auto& n : nodes) n.known = false;
+}
+
+}
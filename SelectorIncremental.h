@@ -0,0 +1,90 @@
+#ifndef SELECTOR_INCREMENTAL_H
+#define SELECTOR_INCREMENTAL_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorValue.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace selector {
+
+class Env;
+class Expression;
+
+/**
+ * Evaluates one selector against one message again and again as the
+ * message's properties change, only re-evaluating the parts of the selector
+ * that read a changed property.
+ *
+ * The selector is split into its AND, OR and NOT nodes over leaf predicates
+ * (comparisons, LIKE, IN and so on). The result of every node is remembered
+ * until changed() is told about a property the node reads. Nodes are only
+ * evaluated when the result needs them, in the selector's own order, so a
+ * re-evaluation never does more work than a full one.
+ *
+ * The selector must outlive the IncrementalEval. Not safe to use from multiple
+ * threads at once.
+ */
+class __attribute__((visibility("default")))
+IncrementalEval {
+    struct Node {
+        enum {LEAF, AND, OR, NOT} kind;
+        const Expression* leaf;
+        std::vector<std::size_t> operands;
+        std::size_t parent;
+        BoolOrNone result;
+        bool known;
+    };
+
+    std::vector<Node> nodes;
+    std::size_t root;
+    // The leaves that read each identifier
+    std::unordered_map<std::string, std::vector<std::size_t>> readers;
+    uint64_t leafEvaluations;
+
+    BoolOrNone eval(std::size_t n, const Env&);
+
+public:
+    explicit IncrementalEval(const Expression& selector);
+
+    // The selector's result for env, using what is remembered of it
+    BoolOrNone eval_bool(const Env& env);
+
+    // The value of identifier may have changed since the last evaluation
+    void changed(const std::string& identifier);
+    // Forget everything, as for a different message
+    void reset();
+
+    // Number of leaf predicates evaluated so far
+    uint64_t leaf_evaluations() const {
+        return leafEvaluations;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorJit.h"
+
+#include "SelectorProgram.h"
+#include "SelectorValue.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef SELECTOR_JIT
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/TargetSelect.h>
+#endif
+
+namespace selector {
+
+using std::size_t;
+using std::unique_ptr;
+
+namespace {
+
+// Native code for a program: evaluates it against env leaving the result in result
+typedef void (*NativeFunction)(const Program* program, const Env* env, Value* result);
+
+// Evaluations are counted exactly up to this many, then only one in this
+// many is counted (as this many) so that threads evaluating a hot selector
+// rarely touch its shared counter
+const size_t SAMPLE = 64;
+
+// A cheap per-thread random number for sampling evaluations
+uint32_t sample()
+{
+    thread_local uint32_t state = 2463534242u;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+#ifdef SELECTOR_JIT
+
+// The native code reads and writes Values directly
+const unsigned VALUE_SIZE = 16;
+const unsigned TYPE_OFFSET = 8;
+const unsigned HASH_OFFSET = 12;
+// The native code keeps its registers on the stack, so programs needing
+// more than this many stay interpreted
+const unsigned MAX_REGISTERS = 256;
+static_assert(sizeof(Value)==VALUE_SIZE, "Value layout");
+static_assert(sizeof(Value::type)==4, "Value layout");
+static_assert(std::is_standard_layout<Value>::value, "Value layout");
+
+// One JIT shared by every selector, never destroyed so that selectors
+// destroyed at exit can still remove their code
+llvm::orc::LLJIT* engine()
+{
+    static llvm::orc::LLJIT* jit = [] () -> llvm::orc::LLJIT* {
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        auto j = llvm::orc::LLJITBuilder().create();
+        if (!j) {
+            llvm::consumeError(j.takeError());
+            return nullptr;
+        }
+        // Clearing a large register file calls memset
+        auto process = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess((*j)->getDataLayout().getGlobalPrefix());
+        if (!process) {
+            llvm::consumeError(process.takeError());
+            return nullptr;
+        }
+        (*j)->getMainJITDylib().addGenerator(std::move(*process));
+        return j->release();
+    }();
+    return jit;
+}
+
+#endif
+
+}
+
+/**
+ * A Program that replaces its interpreter with native code after enough
+ * evaluations.
+ *
+ * The native code has a basic block per instruction so jumps become branches.
+ * Constants and conditional jumps are generated inline, and comparisons have
+ * an inline path for two exact or two inexact operands. Every other
+ * instruction, and comparisons of other types, call back into the
+ * interpreter for that one instruction, so the results are always the same.
+ */
+class JitSelector : public Program {
+    const size_t threshold;
+    mutable std::atomic<size_t> evaluations;
+    mutable std::atomic<NativeFunction> native;
+    mutable std::mutex compiling;
+    mutable std::atomic<bool> tried;
+#ifdef SELECTOR_JIT
+    mutable llvm::orc::ResourceTrackerSP tracker;
+#endif
+
+    static size_t step(const Program* p, const Env* env, Value* regs, size_t pc) {
+        return p->step(*env, regs, pc);
+    }
+
+    // Counts an evaluation: true for just the one that reaches the threshold
+    bool counted() const {
+        size_t n = 1;
+        if (evaluations.load(std::memory_order_relaxed)>=SAMPLE) {
+            if (sample() % SAMPLE) return false;
+            n = SAMPLE;
+        }
+        const size_t before = evaluations.fetch_add(n, std::memory_order_relaxed);
+        return before<threshold && before+n>=threshold;
+    }
+
+    NativeFunction promote() const;
+#ifdef SELECTOR_JIT
+    std::unique_ptr<llvm::Module> generate(llvm::LLVMContext&, const std::string& name) const;
+#endif
+
+public:
+    JitSelector(const Program& p, size_t t) :
+        Program(p),
+        threshold(t),
+        evaluations(0),
+        native(nullptr),
+        tried(false)
+    {
+        if (threshold==0) promote();
+    }
+
+    ~JitSelector() {
+#ifdef SELECTOR_JIT
+        if (tracker) llvm::consumeError(tracker->remove());
+#endif
+    }
+
+    bool compiled() const {
+        return native.load(std::memory_order_acquire);
+    }
+
+    // Not counting the native code, which belongs to the JIT
+    size_t memory() const {
+        return Program::memory() + sizeof(*this) - sizeof(Program);
+    }
+
+    Value eval(const Env& env) const {
+        NativeFunction f = native.load(std::memory_order_acquire);
+        if (!f && !tried.load(std::memory_order_relaxed) && counted()) f = promote();
+        if (!f) return Program::eval(env);
+        Value v;
+        f(this, &env, &v);
+        return v;
+    }
+
+    BoolOrNone eval_bool(const Env& env) const {
+        const Value v = eval(env);
+        return v.type==Value::T_BOOL ? BoolOrNone(v.b) : BN_UNKNOWN;
+    }
+};
+
+#ifdef SELECTOR_JIT
+
+std::unique_ptr<llvm::Module> JitSelector::generate(llvm::LLVMContext& context, const std::string& name) const
+{
+    using namespace llvm;
+    if (registers>MAX_REGISTERS) return nullptr;
+    auto module = std::make_unique<Module>(name, context);
+
+    Type* i8 = Type::getInt8Ty(context);
+    Type* i32 = Type::getInt32Ty(context);
+    Type* i64 = Type::getInt64Ty(context);
+    Type* f64 = Type::getDoubleTy(context);
+    Type* bytes = i8->getPointerTo();
+    Type* sizeType = Type::getIntNTy(context, 8*sizeof(size_t));
+
+    FunctionType* type = FunctionType::get(Type::getVoidTy(context), {bytes, bytes, bytes}, false);
+    Function* f = Function::Create(type, Function::ExternalLinkage, name, module.get());
+    llvm::Value* const program = f->getArg(0);
+    llvm::Value* const env = f->getArg(1);
+    llvm::Value* const result = f->getArg(2);
+
+    FunctionType* stepType = FunctionType::get(sizeType, {bytes, bytes, bytes, sizeType}, false);
+    Constant* const stepFunction = ConstantExpr::getIntToPtr(
+        ConstantInt::get(i64, reinterpret_cast<uint64_t>(&JitSelector::step)), stepType->getPointerTo());
+
+    BasicBlock* entry = BasicBlock::Create(context, "entry", f);
+    std::vector<BasicBlock*> blocks;
+    for (size_t pc = 0; pc<=code().size(); ++pc) blocks.push_back(BasicBlock::Create(context, "", f));
+
+    IRBuilder<> b(entry);
+    // Registers start out unknown, as in the interpreter
+    llvm::Value* const regs = b.CreateAlloca(ArrayType::get(i8, VALUE_SIZE*registers));
+    cast<AllocaInst>(regs)->setAlignment(Align(alignof(selector::Value)));
+    llvm::Value* const base = b.CreateBitCast(regs, bytes);
+    b.CreateMemSet(base, ConstantInt::get(i8, 0), VALUE_SIZE*registers, MaybeAlign(alignof(selector::Value)));
+    b.CreateBr(blocks[0]);
+
+    auto field = [&](unsigned r, unsigned offset, Type* t) {
+        return b.CreateBitCast(b.CreateConstInBoundsGEP1_64(i8, base, VALUE_SIZE*r + offset), t->getPointerTo());
+    };
+    auto typeOf = [&](unsigned r) { return b.CreateLoad(i32, field(r, TYPE_OFFSET, i32)); };
+    auto callStep = [&](size_t pc) {
+        return b.CreateCall(stepType, stepFunction, {program, env, base, ConstantInt::get(sizeType, pc)});
+    };
+    auto storeBool = [&](unsigned r, llvm::Value* v) {
+        b.CreateStore(b.CreateZExt(v, i8), field(r, 0, i8));
+        b.CreateStore(ConstantInt::get(i32, selector::Value::T_BOOL), field(r, TYPE_OFFSET, i32));
+        b.CreateStore(ConstantInt::get(i32, 0), field(r, HASH_OFFSET, i32));
+    };
+
+    for (size_t pc = 0; pc<code().size(); ++pc) {
+        const Instruction& i = code()[pc];
+        BasicBlock* const next = blocks[pc+1];
+        b.SetInsertPoint(blocks[pc]);
+        switch (i.op) {
+        case OP_CONST: {
+            const selector::Value& c = constants()[i.x];
+            uint64_t payload = 0;
+            std::memcpy(&payload, &c, sizeof(payload));
+            b.CreateStore(ConstantInt::get(i64, payload), field(i.dst, 0, i64));
+            b.CreateStore(ConstantInt::get(i32, c.type), field(i.dst, TYPE_OFFSET, i32));
+            b.CreateStore(ConstantInt::get(i32, c.hash), field(i.dst, HASH_OFFSET, i32));
+            b.CreateBr(next);
+            break;
+        }
+        case OP_INT:
+            b.CreateStore(ConstantInt::get(i64, int64_t(int32_t(i.x))), field(i.dst, 0, i64));
+            b.CreateStore(ConstantInt::get(i32, selector::Value::T_EXACT), field(i.dst, TYPE_OFFSET, i32));
+            b.CreateStore(ConstantInt::get(i32, 0), field(i.dst, HASH_OFFSET, i32));
+            b.CreateBr(next);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE: {
+            llvm::Value* isBool = b.CreateICmpEQ(typeOf(i.dst), ConstantInt::get(i32, selector::Value::T_BOOL));
+            llvm::Value* truth = b.CreateICmpNE(b.CreateLoad(i8, field(i.dst, 0, i8)), ConstantInt::get(i8, 0));
+            if (i.op==OP_JUMP_IF_FALSE) truth = b.CreateNot(truth);
+            b.CreateCondBr(b.CreateAnd(isBool, truth), blocks[i.x], next);
+            break;
+        }
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_LESS:
+        case OP_GRT:
+        case OP_LSEQ:
+        case OP_GREQ: {
+            static const CmpInst::Predicate exact[] = {
+                CmpInst::ICMP_EQ, CmpInst::ICMP_NE, CmpInst::ICMP_SLT,
+                CmpInst::ICMP_SGT, CmpInst::ICMP_SLE, CmpInst::ICMP_SGE
+            };
+            static const CmpInst::Predicate inexact[] = {
+                CmpInst::FCMP_OEQ, CmpInst::FCMP_UNE, CmpInst::FCMP_OLT,
+                CmpInst::FCMP_OGT, CmpInst::FCMP_OLE, CmpInst::FCMP_OGE
+            };
+            const unsigned k = i.op - OP_EQ;
+            BasicBlock* const exactBlock = BasicBlock::Create(context, "", f);
+            BasicBlock* const notExact = BasicBlock::Create(context, "", f);
+            BasicBlock* const inexactBlock = BasicBlock::Create(context, "", f);
+            BasicBlock* const other = BasicBlock::Create(context, "", f);
+            llvm::Value* const ta = typeOf(i.a);
+            llvm::Value* const tb = typeOf(i.b);
+            llvm::Value* const same = b.CreateICmpEQ(ta, tb);
+            b.CreateCondBr(b.CreateAnd(same, b.CreateICmpEQ(ta, ConstantInt::get(i32, selector::Value::T_EXACT))), exactBlock, notExact);
+
+            b.SetInsertPoint(exactBlock);
+            storeBool(i.dst, b.CreateICmp(exact[k], b.CreateLoad(i64, field(i.a, 0, i64)), b.CreateLoad(i64, field(i.b, 0, i64))));
+            b.CreateBr(next);
+
+            b.SetInsertPoint(notExact);
+            b.CreateCondBr(b.CreateAnd(same, b.CreateICmpEQ(ta, ConstantInt::get(i32, selector::Value::T_INEXACT))), inexactBlock, other);
+
+            b.SetInsertPoint(inexactBlock);
+            storeBool(i.dst, b.CreateFCmp(inexact[k], b.CreateLoad(f64, field(i.a, 0, f64)), b.CreateLoad(f64, field(i.b, 0, f64))));
+            b.CreateBr(next);
+
+            b.SetInsertPoint(other);
+            callStep(pc);
+            b.CreateBr(next);
+            break;
+        }
+        case OP_IN_START:
+        case OP_IN_ELEMENT:
+        case OP_NOT_IN_START:
+        case OP_NOT_IN_ELEMENT: {
+            llvm::Value* const to = callStep(pc);
+            b.CreateCondBr(b.CreateICmpEQ(to, ConstantInt::get(sizeType, i.x)), blocks[i.x], next);
+            break;
+        }
+        default:
+            callStep(pc);
+            b.CreateBr(next);
+            break;
+        }
+    }
+
+    b.SetInsertPoint(blocks.back());
+    b.CreateMemCpy(result, MaybeAlign(alignof(selector::Value)), base, MaybeAlign(alignof(selector::Value)), VALUE_SIZE);
+    b.CreateRetVoid();
+
+    if (verifyFunction(*f)) return nullptr;
+    return module;
+}
+
+NativeFunction JitSelector::promote() const
+{
+    std::lock_guard<std::mutex> l(compiling);
+    if (tried.load(std::memory_order_relaxed)) return native.load(std::memory_order_relaxed);
+    tried.store(true, std::memory_order_relaxed);
+
+    llvm::orc::LLJIT* jit = engine();
+    if (!jit) return nullptr;
+
+    static std::atomic<unsigned> serial(0);
+    const std::string name = "selector" + std::to_string(serial++);
+    auto context = std::make_unique<llvm::LLVMContext>();
+    auto module = generate(*context, name);
+    if (!module) return nullptr;
+    module->setDataLayout(jit->getDataLayout());
+
+    llvm::orc::JITDylib& library = jit->getMainJITDylib();
+    tracker = library.createResourceTracker();
+    if (auto e = jit->addIRModule(tracker, llvm::orc::ThreadSafeModule(std::move(module), std::move(context)))) {
+        llvm::consumeError(std::move(e));
+        return nullptr;
+    }
+    auto symbol = jit->lookup(library, name);
+    if (!symbol) {
+        llvm::consumeError(symbol.takeError());
+        return nullptr;
+    }
+    NativeFunction f = reinterpret_cast<NativeFunction>(symbol->getAddress());
+    native.store(f, std::memory_order_release);
+    return f;
+}
+
+bool jit_available()
+{
+    return engine();
+}
+
+#else
+
+NativeFunction JitSelector::promote() const
+{
+    tried.store(true, std::memory_order_relaxed);
+    return nullptr;
+}
+
+bool jit_available()
+{
+    return false;
+}
+
+#endif
+
+unique_ptr<Expression> make_jit_selector(const Expression& e, size_t threshold)
+{
+    unique_ptr<Expression> p = compile(e);
+    return unique_ptr<Expression>(new JitSelector(static_cast<const Program&>(*p), threshold));
+}
+
+bool jit_compiled(const Expression& e)
+{
+    auto j = dynamic_cast<const JitSelector*>(&e);
+    return j && j->compiled();
+}
+
+}
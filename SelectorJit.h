@@ -0,0 +1,48 @@
+#ifndef SELECTOR_JIT_H
+#define SELECTOR_JIT_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <memory>
+
+namespace selector {
+
+class Expression;
+
+// Whether this build of the library can compile selectors to native code
+__attribute__((visibility("default"))) bool jit_available();
+
+// A compiled selector (as from compile()) that, once it has been evaluated
+// threshold times, compiles itself to native code and evaluates that from then
+// on, with the same results. Worth it only for the few selectors that are
+// evaluated far more than others: compiling takes around a millisecond and
+// some memory for the code. Without jit_available(), or for a selector too
+// big to compile, it stays a compiled selector.
+__attribute__((visibility("default"))) std::unique_ptr<Expression> make_jit_selector(const Expression&, std::size_t threshold = 10000);
+
+// Whether e came from make_jit_selector and now runs native code
+__attribute__((visibility("default"))) bool jit_compiled(const Expression& e);
+
+}
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorKernels.h"
+
+#include "SelectorValue.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SELECTOR_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SELECTOR_NEON 1
+#endif
+
+namespace selector {
+namespace kernels {
+
+namespace {
+
+const uint8_t EXACT = Value::T_EXACT;
+const uint8_t INEXACT = Value::T_INEXACT;
+
+// Each instruction set provides:
+//   typeMask(t, type):  bit j set if t[j]==type for 64 lanes
+//   ints<OP>(a, b):     bit j set if a[j].i OP b[j].i for 64 lanes
+//   doubles<OP>(a, b):  bit j set if a[j].x OP b[j].x for 64 lanes
+// Bits for lanes that aren't of the right type are meaningless and masked by the caller.
+
+template <OpCode OP, typename T>
+inline bool scalarCompare(T a, T b)
+{
+    switch (OP) {
+    case OP_EQ:   return a == b;
+    case OP_NEQ:  return a != b;
+    case OP_LESS: return a <  b;
+    case OP_GRT:  return a >  b;
+    case OP_LSEQ: return a <= b;
+    case OP_GREQ: return a >= b;
+    default:      return false;
+    }
+}
+
+struct Scalar {
+    static const char* name() { return "scalar"; }
+
+    static uint64_t typeMask(const uint8_t* t, uint8_t type) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; ++j) m |= uint64_t(t[j]==type) << j;
+        return m;
+    }
+
+    template <OpCode OP>
+    static uint64_t ints(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; ++j) m |= uint64_t(scalarCompare<OP>(a[j].i, b[j].i)) << j;
+        return m;
+    }
+
+    template <OpCode OP>
+    static uint64_t doubles(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; ++j) m |= uint64_t(scalarCompare<OP>(a[j].x, b[j].x)) << j;
+        return m;
+    }
+};
+
+#if SELECTOR_X86
+
+#define SELECTOR_TARGET(isa) __attribute__((target(isa)))
+
+struct Sse42 {
+    static const char* name() { return "sse4.2"; }
+
+    SELECTOR_TARGET("sse4.2")
+    static uint64_t typeMask(const uint8_t* t, uint8_t type) {
+        const __m128i v = _mm_set1_epi8(type);
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 16) {
+            __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(t+j)), v);
+            m |= uint64_t(uint16_t(_mm_movemask_epi8(c))) << j;
+        }
+        return m;
+    }
+
+    // Compare two lanes returning the result in the low 2 bits
+    template <OpCode OP>
+    SELECTOR_TARGET("sse4.2")
+    static unsigned ints2(__m128i a, __m128i b) {
+        switch (OP) {
+        case OP_EQ:   return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(a, b)));
+        case OP_NEQ:  return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(a, b))) ^ 0x3;
+        case OP_LESS: return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(b, a)));
+        case OP_GRT:  return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(a, b)));
+        case OP_LSEQ: return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(a, b))) ^ 0x3;
+        case OP_GREQ: return _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(b, a))) ^ 0x3;
+        default:      return 0;
+        }
+    }
+
+    template <OpCode OP>
+    SELECTOR_TARGET("sse4.2")
+    static unsigned doubles2(__m128d a, __m128d b) {
+        switch (OP) {
+        case OP_EQ:   return _mm_movemask_pd(_mm_cmpeq_pd(a, b));
+        case OP_NEQ:  return _mm_movemask_pd(_mm_cmpneq_pd(a, b));
+        case OP_LESS: return _mm_movemask_pd(_mm_cmplt_pd(a, b));
+        case OP_GRT:  return _mm_movemask_pd(_mm_cmpgt_pd(a, b));
+        case OP_LSEQ: return _mm_movemask_pd(_mm_cmple_pd(a, b));
+        case OP_GREQ: return _mm_movemask_pd(_mm_cmpge_pd(a, b));
+        default:      return 0;
+        }
+    }
+
+    template <OpCode OP>
+    SELECTOR_TARGET("sse4.2")
+    static uint64_t ints(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 2) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a+j));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b+j));
+            m |= uint64_t(ints2<OP>(va, vb)) << j;
+        }
+        return m;
+    }
+
+    template <OpCode OP>
+    SELECTOR_TARGET("sse4.2")
+    static uint64_t doubles(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 2) {
+            __m128d va = _mm_loadu_pd(reinterpret_cast<const double*>(a+j));
+            __m128d vb = _mm_loadu_pd(reinterpret_cast<const double*>(b+j));
+            m |= uint64_t(doubles2<OP>(va, vb)) << j;
+        }
+        return m;
+    }
+};
+
+struct Avx2 {
+    static const char* name() { return "avx2"; }
+
+    SELECTOR_TARGET("avx2")
+    static uint64_t typeMask(const uint8_t* t, uint8_t type) {
+        const __m256i v = _mm256_set1_epi8(type);
+        __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(t)), v);
+        __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(t+32)), v);
+        return uint64_t(uint32_t(_mm256_movemask_epi8(lo))) | uint64_t(uint32_t(_mm256_movemask_epi8(hi))) << 32;
+    }
+
+    // Compare four lanes returning the result in the low 4 bits
+    template <OpCode OP>
+    SELECTOR_TARGET("avx2")
+    static unsigned ints4(__m256i a, __m256i b) {
+        switch (OP) {
+        case OP_EQ:   return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, b)));
+        case OP_NEQ:  return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, b))) ^ 0xf;
+        case OP_LESS: return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(b, a)));
+        case OP_GRT:  return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(a, b)));
+        case OP_LSEQ: return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(a, b))) ^ 0xf;
+        case OP_GREQ: return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(b, a))) ^ 0xf;
+        default:      return 0;
+        }
+    }
+
+    template <OpCode OP>
+    SELECTOR_TARGET("avx2")
+    static unsigned doubles4(__m256d a, __m256d b) {
+        switch (OP) {
+        case OP_EQ:   return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ));
+        case OP_NEQ:  return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_NEQ_UQ));
+        case OP_LESS: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ));
+        case OP_GRT:  return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GT_OQ));
+        case OP_LSEQ: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LE_OQ));
+        case OP_GREQ: return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_GE_OQ));
+        default:      return 0;
+        }
+    }
+
+    template <OpCode OP>
+    SELECTOR_TARGET("avx2")
+    static uint64_t ints(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 4) {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a+j));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b+j));
+            m |= uint64_t(ints4<OP>(va, vb)) << j;
+        }
+        return m;
+    }
+
+    template <OpCode OP>
+    SELECTOR_TARGET("avx2")
+    static uint64_t doubles(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 4) {
+            __m256d va = _mm256_loadu_pd(reinterpret_cast<const double*>(a+j));
+            __m256d vb = _mm256_loadu_pd(reinterpret_cast<const double*>(b+j));
+            m |= uint64_t(doubles4<OP>(va, vb)) << j;
+        }
+        return m;
+    }
+};
+
+#undef SELECTOR_TARGET
+
+#elif SELECTOR_NEON
+
+struct Neon {
+    static const char* name() { return "neon"; }
+
+    static uint64_t typeMask(const uint8_t* t, uint8_t type) {
+        return Scalar::typeMask(t, type);
+    }
+
+    static unsigned bits2(uint64x2_t m) {
+        return (vgetq_lane_u64(m, 0) & 1) | (vgetq_lane_u64(m, 1) & 1) << 1;
+    }
+
+    template <OpCode OP>
+    static unsigned ints2(int64x2_t a, int64x2_t b) {
+        switch (OP) {
+        case OP_EQ:   return bits2(vceqq_s64(a, b));
+        case OP_NEQ:  return bits2(vceqq_s64(a, b)) ^ 0x3;
+        case OP_LESS: return bits2(vcltq_s64(a, b));
+        case OP_GRT:  return bits2(vcgtq_s64(a, b));
+        case OP_LSEQ: return bits2(vcleq_s64(a, b));
+        case OP_GREQ: return bits2(vcgeq_s64(a, b));
+        default:      return 0;
+        }
+    }
+
+    template <OpCode OP>
+    static unsigned doubles2(float64x2_t a, float64x2_t b) {
+        switch (OP) {
+        case OP_EQ:   return bits2(vceqq_f64(a, b));
+        case OP_NEQ:  return bits2(vceqq_f64(a, b)) ^ 0x3;
+        case OP_LESS: return bits2(vcltq_f64(a, b));
+        case OP_GRT:  return bits2(vcgtq_f64(a, b));
+        case OP_LSEQ: return bits2(vcleq_f64(a, b));
+        case OP_GREQ: return bits2(vcgeq_f64(a, b));
+        default:      return 0;
+        }
+    }
+
+    template <OpCode OP>
+    static uint64_t ints(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 2) {
+            int64x2_t va = vld1q_s64(reinterpret_cast<const int64_t*>(a+j));
+            int64x2_t vb = vld1q_s64(reinterpret_cast<const int64_t*>(b+j));
+            m |= uint64_t(ints2<OP>(va, vb)) << j;
+        }
+        return m;
+    }
+
+    template <OpCode OP>
+    static uint64_t doubles(const Payload* a, const Payload* b) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j<64; j += 2) {
+            float64x2_t va = vld1q_f64(reinterpret_cast<const double*>(a+j));
+            float64x2_t vb = vld1q_f64(reinterpret_cast<const double*>(b+j));
+            m |= uint64_t(doubles2<OP>(va, vb)) << j;
+        }
+        return m;
+    }
+};
+
+#endif
+
+template <class ISA, OpCode OP>
+void compareLanes(const Column& a, const Column& b, unsigned n, uint64_t* numeric, uint64_t* result)
+{
+    for (unsigned w = 0; w<n/64; ++w) {
+        const unsigned base = w*64;
+        const uint64_t exact = ISA::typeMask(a.types+base, EXACT) & ISA::typeMask(b.types+base, EXACT);
+        const uint64_t inexact = ISA::typeMask(a.types+base, INEXACT) & ISA::typeMask(b.types+base, INEXACT);
+        uint64_t r = 0;
+        if (exact) r |= ISA::template ints<OP>(a.data+base, b.data+base) & exact;
+        if (inexact) r |= ISA::template doubles<OP>(a.data+base, b.data+base) & inexact;
+        numeric[w] = exact | inexact;
+        result[w] = r;
+    }
+}
+
+template <class ISA>
+void compareWith(OpCode op, const Column& a, const Column& b, unsigned n, uint64_t* numeric, uint64_t* result)
+{
+    switch (op) {
+    case OP_EQ:   compareLanes<ISA, OP_EQ>(a, b, n, numeric, result); break;
+    case OP_NEQ:  compareLanes<ISA, OP_NEQ>(a, b, n, numeric, result); break;
+    case OP_LESS: compareLanes<ISA, OP_LESS>(a, b, n, numeric, result); break;
+    case OP_GRT:  compareLanes<ISA, OP_GRT>(a, b, n, numeric, result); break;
+    case OP_LSEQ: compareLanes<ISA, OP_LSEQ>(a, b, n, numeric, result); break;
+    case OP_GREQ: compareLanes<ISA, OP_GREQ>(a, b, n, numeric, result); break;
+    default:
+        // Nothing handled here
+        for (unsigned w = 0; w<n/64; ++w) numeric[w] = 0;
+        break;
+    }
+}
+
+template <class ISA>
+void betweenWith(const Column& e, const Column& l, const Column& u, unsigned n, uint64_t* numeric, uint64_t* result)
+{
+    for (unsigned w = 0; w<n/64; ++w) {
+        const unsigned base = w*64;
+        const uint64_t exact = ISA::typeMask(e.types+base, EXACT) &
+                               ISA::typeMask(l.types+base, EXACT) &
+                               ISA::typeMask(u.types+base, EXACT);
+        const uint64_t inexact = ISA::typeMask(e.types+base, INEXACT) &
+                                 ISA::typeMask(l.types+base, INEXACT) &
+                                 ISA::typeMask(u.types+base, INEXACT);
+        uint64_t r = 0;
+        if (exact) {
+            r |= ISA::template ints<OP_GREQ>(e.data+base, l.data+base) &
+                 ISA::template ints<OP_LSEQ>(e.data+base, u.data+base) & exact;
+        }
+        if (inexact) {
+            r |= ISA::template doubles<OP_GREQ>(e.data+base, l.data+base) &
+                 ISA::template doubles<OP_LSEQ>(e.data+base, u.data+base) & inexact;
+        }
+        numeric[w] = exact | inexact;
+        result[w] = r;
+    }
+}
+
+typedef void CompareFn(OpCode, const Column&, const Column&, unsigned, uint64_t*, uint64_t*);
+typedef void BetweenFn(const Column&, const Column&, const Column&, unsigned, uint64_t*, uint64_t*);
+
+struct Implementation {
+    const char* name;
+    CompareFn* compare;
+    BetweenFn* between;
+};
+
+template <class ISA>
+Implementation implementation()
+{
+    return Implementation{ISA::name(), &compareWith<ISA>, &betweenWith<ISA>};
+}
+
+bool requested(const char* isa)
+{
+    const char* r = std::getenv("SELECTOR_SIMD");
+    return !r || !*r || std::strcmp(r, isa)==0;
+}
+
+Implementation choose()
+{
+#if SELECTOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && requested(Avx2::name())) return implementation<Avx2>();
+    if (__builtin_cpu_supports("sse4.2") && requested(Sse42::name())) return implementation<Sse42>();
+#elif SELECTOR_NEON
+    if (requested(Neon::name())) return implementation<Neon>();
+#endif
+    return implementation<Scalar>();
+}
+
+const Implementation& chosen()
+{
+    static const Implementation i = choose();
+    return i;
+}
+
+}
+
+void compare(OpCode op, const Column& a, const Column& b, unsigned n, uint64_t* numeric, uint64_t* result)
+{
+    chosen().compare(op, a, b, n, numeric, result);
+}
+
+void between(const Column& e, const Column& l, const Column& u, unsigned n, uint64_t* numeric, uint64_t* result)
+{
+    chosen().between(e, l, u, n, numeric, result);
+}
+
+const char* isa()
+{
+    return chosen().name;
+}
+
+}}
@@ -0,0 +1,67 @@
+#ifndef SELECTOR_KERNELS_H
+#define SELECTOR_KERNELS_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorProgram.h"
+
+#include <cstdint>
+#include <string>
+
+namespace selector {
+
+// Value payload as stored in the columns of a batch register
+union Payload {
+    bool               b;
+    int64_t            i;
+    double             x;
+    const std::string* s;
+};
+
+namespace kernels {
+
+struct Column {
+    const uint8_t* types;
+    const Payload* data;
+};
+
+// The kernels work on n lanes where n is a multiple of 64, producing one bit
+// per lane in each word of the output bitmasks.
+//
+// For every lane where the operands are all EXACT or all INEXACT the lane's bit
+// is set in numeric and the result of the comparison is in result. Other lanes
+// (unknown, mixed or non numeric types) are left to the caller to evaluate.
+
+// op is one of OP_EQ, OP_NEQ, OP_LESS, OP_GRT, OP_LSEQ, OP_GREQ
+void compare(OpCode op, const Column& a, const Column& b, unsigned n, uint64_t* numeric, uint64_t* result);
+
+// e BETWEEN l AND u
+void between(const Column& e, const Column& l, const Column& u, unsigned n, uint64_t* numeric, uint64_t* result);
+
+// The instruction set the kernels use. This is the best supported by the CPU
+// unless restricted by setting SELECTOR_SIMD to one of "avx2", "sse4.2",
+// "neon" or "scalar" in the environment.
+const char* isa();
+
+}}
+
+#endif
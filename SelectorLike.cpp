@@ -0,0 +1,219 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorLike.h"
+
+#include "SelectorCodec.h"
+#include "SelectorMemory.h"
+
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+LikeMatcher::Segment::Segment() :
+    first(std::string::npos)
+{}
+
+void LikeMatcher::Segment::add(char c, bool w)
+{
+    if (!w && first==std::string::npos) first = text.size();
+    text += c;
+    wild += char(w);
+}
+
+bool LikeMatcher::Segment::matchAt(const char* s) const
+{
+    for (std::size_t i = 0; i<text.size(); ++i) {
+        if (!wild[i] && s[i]!=text[i]) return false;
+    }
+    return true;
+}
+
+const char* LikeMatcher::Segment::find(const char* s, const char* end) const
+{
+    const std::size_t n = text.size();
+    if (std::size_t(end-s)<n) return 0;
+    // Only wildcards so it matches anywhere there's room
+    if (first==std::string::npos) return s;
+
+    // Look for the first literal character then try the rest of the segment
+    const char* last = end - n;
+    const char c = text[first];
+    for (const char* p = s; p<=last; ++p) {
+        p = static_cast<const char*>(std::memchr(p+first, c, last-p+1));
+        if (!p) return 0;
+        p -= first;
+        if (matchAt(p)) return p;
+    }
+    return 0;
+}
+
+LikeMatcher::LikeMatcher(const std::string& pattern, const std::string& escape_) :
+    escape(escape_.empty() ? 0 : escape_[0]),
+    kind(GLOB),
+    segments(1),
+    percent(false),
+    minLength(0)
+{
+    if (escape_.size()>1) throw std::logic_error("Internal error");
+
+    bool doEscape = false;
+    for (auto& c : pattern) {
+        if ( escape!=0 && c==escape ) {
+            doEscape = true;
+            continue;
+        }
+        if (!doEscape && c=='%') {
+            percent = true;
+            // Consecutive '%' are the same as one
+            if (segments.size()==1 || !segments.back().text.empty()) segments.push_back(Segment());
+        } else {
+            segments.back().add(c, !doEscape && c=='_');
+        }
+        doEscape = false;
+    }
+    for (auto& s : segments) minLength += s.text.size();
+
+    auto literal = [](const Segment& s) { return s.first==0 && s.wild.find(char(1))==std::string::npos; };
+    const Segment& front = segments.front();
+    const Segment& back = segments.back();
+    if (!percent) {
+        if (literal(front) || front.text.empty()) kind = EXACT;
+    } else if (segments.size()==2) {
+        if (front.text.empty() && back.text.empty()) kind = ANY;
+        else if (back.text.empty() && literal(front)) kind = PREFIX;
+        else if (front.text.empty() && literal(back)) kind = SUFFIX;
+    } else if (segments.size()==3 && front.text.empty() && back.text.empty() && literal(segments[1])) {
+        kind = CONTAINS;
+    }
+    for (auto& s : segments) {
+        s.text.shrink_to_fit();
+        s.wild.shrink_to_fit();
+    }
+    segments.shrink_to_fit();
+}
+
+bool LikeMatcher::match(const std::string& s) const
+{
+    if (s.size()<minLength) return false;
+    const char* const start = s.data();
+    const char* const end = start + s.size();
+
+    switch (kind) {
+    case ANY:
+        return true;
+    case EXACT:
+        return s==segments.front().text;
+    case PREFIX: {
+        const std::string& t = segments.front().text;
+        return std::memcmp(start, t.data(), t.size())==0;
+    }
+    case SUFFIX: {
+        const std::string& t = segments.back().text;
+        return std::memcmp(end-t.size(), t.data(), t.size())==0;
+    }
+    case CONTAINS:
+        return segments[1].find(start, end)!=0;
+    case GLOB:
+        break;
+    }
+
+    const Segment& front = segments.front();
+    if (!percent) return s.size()==front.text.size() && front.matchAt(start);
+
+    const Segment& back = segments.back();
+    if (!front.matchAt(start) || !back.matchAt(end-back.text.size())) return false;
+
+    // Taking the leftmost match of each middle segment leaves the most room
+    // for the rest, so there's never any need to backtrack
+    const char* p = start + front.text.size();
+    const char* const limit = end - back.text.size();
+    for (std::size_t i = 1; i<segments.size()-1; ++i) {
+        p = segments[i].find(p, limit);
+        if (!p) return false;
+        p += segments[i].text.size();
+    }
+    return true;
+}
+
+unsigned LikeMatcher::cost() const
+{
+    switch (kind) {
+    case ANY:      return 1;
+    case EXACT:
+    case PREFIX:
+    case SUFFIX:   return 2;
+    case CONTAINS: return 6;
+    default:       return 8 + 2*segments.size();
+    }
+}
+
+std::string LikeMatcher::pattern() const
+{
+    std::string p;
+    for (std::size_t i = 0; i<segments.size(); ++i) {
+        if (i) p += '%';
+        const Segment& s = segments[i];
+        for (std::size_t j = 0; j<s.text.size(); ++j) {
+            const char c = s.text[j];
+            if (s.wild[j]) {
+                p += '_';
+                continue;
+            }
+            if (escape && (c=='%' || c=='_' || c==escape)) p += escape;
+            p += c;
+        }
+    }
+    return p;
+}
+
+void LikeMatcher::repr(std::ostream& os) const
+{
+    os << "'" << pattern() << "'";
+    if (escape) os << " ESCAPE '" << escape << "'";
+}
+
+std::size_t LikeMatcher::memory() const
+{
+    std::size_t n = heapMemory(segments);
+    for (auto& s : segments) n += heapMemory(s.text) + heapMemory(s.wild);
+    return n;
+}
+
+void LikeMatcher::save(Encoder& e) const
+{
+    e.str(pattern());
+    e.str(escape ? std::string(1, escape) : std::string());
+}
+
+LikeMatcher LikeMatcher::load(Decoder& d)
+{
+    const std::string p = d.str();
+    const std::string e = d.str();
+    if (e.size()>1) Decoder::fail("bad LIKE escape");
+    return LikeMatcher(p, e);
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef SELECTOR_LIKE_H
+#define SELECTOR_LIKE_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+class Decoder;
+class Encoder;
+
+/**
+ * Matches strings against a LIKE pattern: '%' matches any sequence of
+ * characters, '_' matches any single character and the escape character (if
+ * any) makes the following character match only itself.
+ *
+ * Exact, prefix, suffix and contains patterns are recognised and matched
+ * directly; any other pattern is matched a segment at a time without
+ * backtracking.
+ */
+class LikeMatcher {
+    enum Kind {
+        ANY,        // '%'
+        EXACT,      // 'abc'
+        PREFIX,     // 'abc%'
+        SUFFIX,     // '%abc'
+        CONTAINS,   // '%abc%'
+        GLOB        // Anything else
+    };
+
+    // A run of the pattern between '%'s
+    struct Segment {
+        std::string text;
+        std::string wild;       // Non zero where text matches any character
+        std::size_t first;      // Index of the first literal character or npos
+
+        Segment();
+        void add(char c, bool w);
+        bool matchAt(const char* s) const;
+        // Leftmost position in [s, end) where the segment matches or 0 if none
+        const char* find(const char* s, const char* end) const;
+    };
+
+    // The pattern is kept only as its segments and the escape character
+    char escape;        // 0 if none
+    Kind kind;
+    // The first segment must match at the start, the last at the end and the
+    // others anywhere in between in order. Without a '%' there is only one
+    // segment which must match the whole string.
+    std::vector<Segment> segments;
+    bool percent;
+    std::size_t minLength;
+
+public:
+    LikeMatcher(const std::string& pattern, const std::string& escape);
+
+    bool match(const std::string&) const;
+
+    // Rough cost of a match relative to comparing two values
+    unsigned cost() const;
+
+    // The pattern, rebuilt from the segments, and escape character. Runs of
+    // '%' are written as one and characters that needn't be escaped aren't.
+    std::string pattern() const;
+    // 0 if there is none
+    char escapeChar() const {
+        return escape;
+    }
+    void repr(std::ostream&) const;
+
+    // Heap memory held, see memory_usage()
+    std::size_t memory() const;
+
+    // For a saved Program
+    void save(Encoder&) const;
+    static LikeMatcher load(Decoder&);
+};
+
+}
+
+#endif
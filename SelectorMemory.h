@@ -0,0 +1,52 @@
+#ifndef SELECTOR_MEMORY_H
+#define SELECTOR_MEMORY_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+// The heap memory owned by standard containers, for memory_usage(). Only
+// what the container itself holds outside its object is counted, not what its
+// elements own.
+
+inline std::size_t heapMemory(const std::string& s)
+{
+    // Short strings are held inside the object itself
+    const uintptr_t p = reinterpret_cast<uintptr_t>(s.data());
+    const uintptr_t o = reinterpret_cast<uintptr_t>(&s);
+    return p>=o && p<o+sizeof(s) ? 0 : s.capacity()+1;
+}
+
+template <class T>
+inline std::size_t heapMemory(const std::vector<T>& v)
+{
+    return v.capacity()*sizeof(T);
+}
+
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+
+#include "SelectorPipeline.h"
+
+#include "SelectorExpression.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+namespace selector {
+
+namespace {
+
+// Waiting for a ring: spin briefly, then yield, then sleep so that an idle
+// stage doesn't hold on to cores
+class Backoff {
+    unsigned tries;
+
+public:
+    Backoff() : tries(0) {}
+
+    void wait() {
+        ++tries;
+        if (tries>64) {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        } else if (tries>16) {
+            std::this_thread::yield();
+        }
+    }
+
+    void reset() {
+        tries = 0;
+    }
+};
+
+}
+
+SelectorPipeline::SelectorPipeline(const std::vector<const Expression*>& ss, unsigned n,
+                                   std::size_t capacity, std::size_t b) :
+    batch(std::max<std::size_t>(1, b)),
+    input(capacity),
+    output(capacity),
+    closed(false),
+    pushing(0),
+    stopping(false),
+    running(std::max(1u, n))
+{
+    for (auto s : ss) selectors.push_back(compile(*s));
+    for (unsigned i = 0; i<std::max(1u, n); ++i) workers.emplace_back(&SelectorPipeline::work, this);
+}
+
+SelectorPipeline::~SelectorPipeline()
+{
+    stopping.store(true, std::memory_order_relaxed);
+    close();
+    for (auto& w : workers) w.join();
+}
+
+void SelectorPipeline::work()
+{
+    std::vector<const Env*> envs;
+    std::vector<uint64_t> tags;
+    std::vector<uint8_t> results;
+    Result r;
+    Message m;
+    Backoff backoff;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        envs.clear();
+        tags.clear();
+        while (envs.size()<batch && input.try_pop(m)) {
+            envs.push_back(m.env);
+            tags.push_back(m.tag);
+        }
+        if (envs.empty()) {
+            if (!closed.load(std::memory_order_seq_cst)) {
+                backoff.wait();
+                continue;
+            }
+            // A push that missed close() may still be landing, and messages
+            // pushed just before it may not have been seen
+            if (pushing.load(std::memory_order_seq_cst)) {
+                backoff.wait();
+                continue;
+            }
+            if (!input.try_pop(m)) break;
+            envs.push_back(m.env);
+            tags.push_back(m.tag);
+        }
+        backoff.reset();
+
+        const std::size_t k = envs.size();
+        results.resize(selectors.size()*k);
+        for (std::size_t s = 0; s<selectors.size(); ++s) {
+            eval_batch(*selectors[s], envs.data(), k, &results[s*k]);
+        }
+        for (std::size_t i = 0; i<k; ++i) {
+            r.env = envs[i];
+            r.tag = tags[i];
+            r.matches.clear();
+            for (std::size_t s = 0; s<selectors.size(); ++s) {
+                if (results[s*k+i]==BN_TRUE) r.matches.push_back(s);
+            }
+            while (!output.try_push(r)) {
+                if (stopping.load(std::memory_order_relaxed)) {
+                    running.fetch_sub(1, std::memory_order_release);
+                    return;
+                }
+                backoff.wait();
+            }
+            backoff.reset();
+        }
+    }
+    running.fetch_sub(1, std::memory_order_release);
+}
+
+bool SelectorPipeline::try_push(const Env& env, uint64_t tag)
+{
+    // Announced before checking closed, so that a worker that has seen
+    // closed also sees this push, or else this push sees closed
+    pushing.fetch_add(1, std::memory_order_seq_cst);
+    if (closed.load(std::memory_order_seq_cst)) {
+        pushing.fetch_sub(1, std::memory_order_relaxed);
+        throw std::logic_error("Push to closed selector pipeline");
+    }
+    Message m{&env, tag};
+    const bool pushed = input.try_push(m);
+    pushing.fetch_sub(1, std::memory_order_release);
+    return pushed;
+}
+
+void SelectorPipeline::push(const Env& env, uint64_t tag)
+{
+    Backoff backoff;
+    while (!try_push(env, tag)) backoff.wait();
+}
+
+void SelectorPipeline::close()
+{
+    closed.store(true, std::memory_order_seq_cst);
+}
+
+bool SelectorPipeline::try_pop(Result& r)
+{
+    return output.try_pop(r);
+}
+
+bool SelectorPipeline::pop(Result& r)
+{
+    Backoff backoff;
+    for (;;) {
+        if (output.try_pop(r)) return true;
+        // Every worker has pushed its last result
+        if (running.load(std::memory_order_acquire)==0) return output.try_pop(r);
+        backoff.wait();
+    }
+}
+
+}
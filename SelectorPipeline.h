@@ -0,0 +1,120 @@
+#ifndef SELECTOR_PIPELINE_H
+#define SELECTOR_PIPELINE_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorRingBuffer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace selector {
+
+class Env;
+class Expression;
+
+/**
+ * Stage of a message pipeline that evaluates every message against a list of
+ * selectors on its own worker threads.
+ *
+ * Producers push messages into a bounded input ring and consumers pop a
+ * Result for each message from a bounded output ring. Each worker takes up to
+ * a batch of messages at a time and evaluates them with eval_batch(). When
+ * the output ring is full workers wait for consumers, and so the input ring
+ * fills and push() waits too: a slow consumer holds back its producers rather
+ * than letting messages pile up. Nothing is locked or allocated per message
+ * once the rings have gone round once and each worker has evaluated a batch.
+ *
+ * Results of one batch are in the order the messages were pushed, but batches
+ * taken by different workers can overtake each other: use the tag to restore
+ * the order if needed. Any number of threads may push and pop at once. Every
+ * Env must stay valid until its Result has been popped.
+ */
+class __attribute__((visibility("default")))
+SelectorPipeline {
+public:
+    struct Result {
+        const Env* env;
+        uint64_t tag;
+        // Index in the selector list of each selector TRUE for env, in order
+        std::vector<uint32_t> matches;
+
+        Result() : env(nullptr), tag(0) {}
+    };
+
+private:
+    struct Message {
+        const Env* env;
+        uint64_t tag;
+    };
+
+    std::vector<std::unique_ptr<Expression>> selectors;
+    const std::size_t batch;
+    RingBuffer<Message> input;
+    RingBuffer<Result> output;
+    std::atomic<bool> closed;
+    // Pushes that have got past the check for closed and not yet finished
+    std::atomic<unsigned> pushing;
+    // Set on destruction so workers give up waiting for consumers
+    std::atomic<bool> stopping;
+    std::atomic<unsigned> running;
+    std::vector<std::thread> workers;
+
+    void work();
+
+    SelectorPipeline(const SelectorPipeline&) = delete;
+    SelectorPipeline& operator=(const SelectorPipeline&) = delete;
+
+public:
+    // The selectors are compiled so needn't outlive the pipeline. capacity is
+    // the size of each ring and batch the most messages a worker evaluates at
+    // once.
+    SelectorPipeline(const std::vector<const Expression*>& selectors, unsigned workers = 1,
+                     std::size_t capacity = 1024, std::size_t batch = 64);
+    // Closes the pipeline and waits for the workers, dropping any results
+    // that haven't been popped
+    ~SelectorPipeline();
+
+    // Returns false if the input ring is full. Throws std::logic_error after
+    // close(). A push racing close() either throws or has its message
+    // evaluated.
+    bool try_push(const Env& env, uint64_t tag);
+    // Waits while the input ring is full. Throws std::logic_error after close().
+    void push(const Env& env, uint64_t tag);
+    // No more messages will be pushed
+    void close();
+
+    // Returns false if there is no result yet. The vector in r is swapped
+    // into the pipeline to be reused.
+    bool try_pop(Result& r);
+    // Waits for a result, returning false once the pipeline is closed and
+    // every result has been popped
+    bool pop(Result& r);
+};
+
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorProfile.h"
+
+#include "SelectorProgram.h"
+
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+namespace selector {
+
+Profile::Profile(const Expression& e) :
+    program(static_cast<Program*>(compile(e).release())),
+    nodes(program->code().size(), Node()),
+    evaluations_(0)
+{}
+
+Profile::~Profile()
+{}
+
+BoolOrNone Profile::eval_bool(const Env& env)
+{
+    ++evaluations_;
+    const Value v = program->profile(env, nodes.data());
+    return v.type==Value::T_BOOL ? BoolOrNone(v.b) : BN_UNKNOWN;
+}
+
+void Profile::reset()
+{
+    nodes.assign(nodes.size(), Node());
+    evaluations_ = 0;
+}
+
+void Profile::repr(std::ostream& os) const
+{
+    os << "PROFILE evaluations=" << evaluations_ << "\n";
+    for (std::size_t pc = 0; pc<nodes.size(); ++pc) {
+        const Node& n = nodes[pc];
+        program->repr(os, pc);
+        os << "  calls=" << n.calls
+           << " T=" << n.trues << " F=" << n.falses << " U=" << n.unknowns
+           << " jumps=" << n.jumps << " ticks=" << n.ticks << "\n";
+    }
+}
+
+uint64_t Profile::ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+}
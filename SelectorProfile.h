@@ -0,0 +1,95 @@
+#ifndef SELECTOR_PROFILE_H
+#define SELECTOR_PROFILE_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorValue.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+namespace selector {
+
+class Env;
+class Expression;
+class Program;
+
+/**
+ * Evaluates a selector compiled for profiling, counting what each instruction
+ * of the compiled program does.
+ *
+ * This is a separate evaluation path: the Expressions from make_selector and
+ * compile() aren't instrumented and pay nothing for it. For finding out which
+ * part of a slow selector costs most, and how often each comparison decides
+ * the result. A Profile isn't safe to use from more than one thread at once.
+ */
+class __attribute__((visibility("default")))
+Profile {
+public:
+    // Counts for one instruction
+    struct Node {
+        uint64_t calls;
+        // Results left in the instruction's destination register; numbers
+        // and strings count in none of them
+        uint64_t trues;
+        uint64_t falses;
+        uint64_t unknowns;
+        // Times the instruction skipped ahead: short circuits of AND and OR,
+        // and IN lists left early
+        uint64_t jumps;
+        // Total ticks spent in the instruction, see ticks()
+        uint64_t ticks;
+    };
+
+private:
+    std::unique_ptr<const Program> program;
+    std::vector<Node> nodes;
+    uint64_t evaluations_;
+
+public:
+    explicit Profile(const Expression&);
+    ~Profile();
+
+    BoolOrNone eval_bool(const Env&);
+
+    uint64_t evaluations() const {
+        return evaluations_;
+    }
+    // One per instruction of the program, in order
+    const std::vector<Node>& counts() const {
+        return nodes;
+    }
+    void reset();
+
+    // The program one instruction per line, each with its counts
+    void repr(std::ostream&) const;
+
+    // CPU timestamp counter on x86, otherwise nanoseconds of a steady clock
+    static uint64_t ticks();
+};
+
+}
+
+#endif
@@ -0,0 +1,1101 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorProgram.h"
+
+#include "SelectorCodec.h"
+#include "SelectorEnv.h"
+#include "SelectorKernels.h"
+#include "SelectorMemory.h"
+#include "SelectorSymbols.h"
+#include "SelectorValue.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::make_unique;
+using std::ostream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace selector {
+
+namespace {
+
+// Programs needing no more registers than this run with them on the stack
+const unsigned LOCAL_REGISTERS = 16;
+
+// Registers for larger Programs, kept for each thread so that only the first
+// evaluation of the largest Program a thread runs allocates them. An
+// evaluation started from inside another (by an Env) has its own.
+class SpareRegisters {
+    static thread_local unique_ptr<Value[]> spare;
+    static thread_local unsigned size;
+    static thread_local bool busy;
+
+    unique_ptr<Value[]> own;
+    Value* regs;
+    bool borrowed;
+
+public:
+    explicit SpareRegisters(unsigned n) :
+        borrowed(!busy)
+    {
+        if (borrowed) {
+            if (size<n) {
+                spare.reset(new Value[n]);
+                size = n;
+            }
+            busy = true;
+            regs = spare.get();
+        } else {
+            own.reset(new Value[n]);
+            regs = own.get();
+        }
+        std::fill(regs, regs+n, Value());
+    }
+
+    ~SpareRegisters() {
+        if (borrowed) busy = false;
+    }
+
+    Value* get() const {
+        return regs;
+    }
+};
+
+thread_local unique_ptr<Value[]> SpareRegisters::spare;
+thread_local unsigned SpareRegisters::size = 0;
+thread_local bool SpareRegisters::busy = false;
+
+const char* const opNames[] = {
+    "CONST",
+    "IDENTIFIER",
+    "ADD",
+    "SUB",
+    "MULT",
+    "DIV",
+    "NEGATE",
+    "EQ",
+    "NEQ",
+    "LESS",
+    "GRT",
+    "LSEQ",
+    "GREQ",
+    "IS_NULL",
+    "IS_NON_NULL",
+    "NOT",
+    "AND",
+    "OR",
+    "JUMP_IF_FALSE",
+    "JUMP_IF_TRUE",
+    "LIKE",
+    "BETWEEN",
+    "IN_START",
+    "IN_ELEMENT",
+    "NOT_IN_START",
+    "NOT_IN_ELEMENT",
+    "IN_SET",
+    "NOT_IN_SET",
+    "COPY",
+    "INT"
+};
+
+static_assert(sizeof(opNames)/sizeof(opNames[0])==OP_LAST+1, "opNames must list every OpCode");
+
+inline BoolOrNone truth(const Value& v)
+{
+    return v.type==Value::T_BOOL ? BoolOrNone(v.b) : BN_UNKNOWN;
+}
+
+inline Value compare(bool r, const Value& v1, const Value& v2)
+{
+    return (unknown(v1) || unknown(v2)) ? Value() : Value(r);
+}
+
+// Probes given to Program::run. Each instruction is bracketed by start() and
+// finish(pc, dst, jumped, started), where dst is the instruction's destination
+// register after it has run and jumped says whether it branched.
+
+// Does nothing, so costs nothing
+struct NoProbe {
+    uint64_t start() const { return 0; }
+    void finish(std::size_t, const Value&, bool, uint64_t) const {}
+};
+
+// Counts into a Profile's nodes
+struct NodeProbe {
+    Profile::Node* nodes;
+
+    uint64_t start() const { return Profile::ticks(); }
+    void finish(std::size_t pc, const Value& v, bool jumped, uint64_t started) const {
+        const uint64_t t = Profile::ticks();
+        Profile::Node& n = nodes[pc];
+        ++n.calls;
+        switch (v.type) {
+        case Value::T_BOOL: ++(v.b ? n.trues : n.falses); break;
+        case Value::T_UNKNOWN: ++n.unknowns; break;
+        default: break;
+        }
+        n.jumps += jumped;
+        n.ticks += t - started;
+    }
+};
+
+}
+
+Program::Program() :
+    constantCount(0),
+    identifierCount(0),
+    codeSize(0),
+    registers(0)
+{}
+
+Program::Program(const Program& p) :
+    registers(p.registers)
+{
+    vector<Value> cs(p.constants().begin(), p.constants().end());
+    vector<Operand> is(p.identifiers().begin(), p.identifiers().end());
+    if (p.tables) {
+        tables = make_unique<Tables>();
+        tables->likes = p.tables->likes;
+        tables->sets = p.tables->sets;
+        // Strings that aren't interned must point to our own copies
+        std::unordered_map<const string*, const string*> copies;
+        for (auto& t : p.tables->strings) copies[t.get()] = &own(*t);
+        for (auto& c : cs) {
+            if (c.type!=Value::T_STRING) continue;
+            auto k = copies.find(c.s);
+            if (k!=copies.end()) c = Value(*k->second, c.hash);
+        }
+        for (auto& o : is) {
+            auto k = copies.find(o.name);
+            if (k!=copies.end()) o.name = k->second;
+        }
+    }
+    pack(cs, is, vector<Instruction>(p.code().begin(), p.code().end()));
+}
+
+Program::Tables& Program::ownTables()
+{
+    if (!tables) tables = make_unique<Tables>();
+    return *tables;
+}
+
+const string& Program::own(const string& s)
+{
+    auto& strings = ownTables().strings;
+    strings.push_back(make_unique<string>(s));
+    return *strings.back();
+}
+
+void Program::pack(const vector<Value>& cs, const vector<Operand>& is, const vector<Instruction>& is_)
+{
+    static_assert(sizeof(Value)%sizeof(uint64_t)==0 && alignof(Value)<=alignof(uint64_t), "Value can't be packed");
+    static_assert(sizeof(Operand)%sizeof(uint64_t)==0 && alignof(Operand)<=alignof(uint64_t), "Operand can't be packed");
+
+    constantCount = cs.size();
+    identifierCount = is.size();
+    codeSize = is_.size();
+    const std::size_t bytes = cs.size()*sizeof(Value) + is.size()*sizeof(Operand) + is_.size()*sizeof(Instruction);
+    storage.reset(new uint64_t[(bytes+sizeof(uint64_t)-1)/sizeof(uint64_t)]);
+    char* p = reinterpret_cast<char*>(storage.get());
+    for (auto& c : cs) p = reinterpret_cast<char*>(new (p) Value(c) + 1);
+    for (auto& o : is) p = reinterpret_cast<char*>(new (p) Operand(o) + 1);
+    for (auto& i : is_) p = reinterpret_cast<char*>(new (p) Instruction(i) + 1);
+
+    if (tables) {
+        if (tables->likes.empty() && tables->sets.empty() && tables->strings.empty()) {
+            tables.reset();
+        } else {
+            tables->likes.shrink_to_fit();
+            tables->sets.shrink_to_fit();
+            tables->strings.shrink_to_fit();
+        }
+    }
+}
+
+std::size_t Program::memory() const
+{
+    std::size_t n = sizeof(Program) +
+        constantCount*sizeof(Value) + identifierCount*sizeof(Operand) + codeSize*sizeof(Instruction);
+    if (tables) {
+        n += sizeof(Tables) + heapMemory(tables->likes) + heapMemory(tables->sets) + heapMemory(tables->strings);
+        for (auto& l : tables->likes) n += l.memory();
+        for (auto& v : tables->sets) n += v.memory();
+        for (auto& t : tables->strings) n += sizeof(string) + heapMemory(*t);
+    }
+    return n;
+}
+
+void Program::repr(ostream& os) const
+{
+    os << "PROGRAM[";
+    for (std::size_t pc = 0; pc<code().size(); ++pc) {
+        if (pc) os << "; ";
+        repr(os, pc);
+    }
+    os << "]";
+}
+
+void Program::repr(ostream& os, std::size_t pc) const
+{
+    const Instruction& i = code()[pc];
+    os << pc << ":" << opNames[i.op] << " r" << i.dst;
+    switch (i.op) {
+    case OP_CONST:
+        os << " " << constants()[i.x];
+        break;
+    case OP_INT:
+        os << " " << Value(int32_t(i.x));
+        break;
+    case OP_IDENTIFIER:
+        os << " I:" << *identifiers()[i.x].name;
+        break;
+    case OP_NEGATE:
+    case OP_IS_NULL:
+    case OP_IS_NON_NULL:
+    case OP_NOT:
+    case OP_COPY:
+        os << " r" << i.a;
+        break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+        os << " ->" << i.x;
+        break;
+    case OP_LIKE:
+        os << " r" << i.a << " ";
+        likes()[i.x].repr(os);
+        break;
+    case OP_BETWEEN:
+        os << " r" << i.a << " r" << i.b << " r" << i.x;
+        break;
+    case OP_IN_START:
+    case OP_NOT_IN_START:
+        os << " r" << i.a << " ->" << i.x;
+        break;
+    case OP_IN_ELEMENT:
+    case OP_NOT_IN_ELEMENT:
+        os << " r" << i.a << " r" << i.b << " ->" << i.x;
+        break;
+    case OP_IN_SET:
+    case OP_NOT_IN_SET:
+        os << " r" << i.a << " {" << sets()[i.x].size() << "}";
+        break;
+    default:
+        os << " r" << i.a << " r" << i.b;
+        break;
+    }
+}
+
+// Run the instruction at i, returning the next one to run
+inline const Instruction* Program::execute(const Instruction* i, const Env& env, Value* r) const
+{
+    const Instruction* const start = code().data();
+    switch (i->op) {
+    case OP_CONST:
+        r[i->dst] = constants()[i->x];
+        break;
+    case OP_IDENTIFIER: {
+        const Operand& o = identifiers()[i->x];
+        r[i->dst] = env.value(o.slot, *o.name);
+        break;
+    }
+    case OP_ADD:    r[i->dst] = r[i->a] + r[i->b]; break;
+    case OP_SUB:    r[i->dst] = r[i->a] - r[i->b]; break;
+    case OP_MULT:   r[i->dst] = r[i->a] * r[i->b]; break;
+    case OP_DIV:    r[i->dst] = r[i->a] / r[i->b]; break;
+    case OP_NEGATE: r[i->dst] = -r[i->a]; break;
+    case OP_EQ:     r[i->dst] = compare(r[i->a] == r[i->b], r[i->a], r[i->b]); break;
+    case OP_NEQ:    r[i->dst] = compare(r[i->a] != r[i->b], r[i->a], r[i->b]); break;
+    case OP_LESS:   r[i->dst] = compare(r[i->a] <  r[i->b], r[i->a], r[i->b]); break;
+    case OP_GRT:    r[i->dst] = compare(r[i->a] >  r[i->b], r[i->a], r[i->b]); break;
+    case OP_LSEQ:   r[i->dst] = compare(r[i->a] <= r[i->b], r[i->a], r[i->b]); break;
+    case OP_GREQ:   r[i->dst] = compare(r[i->a] >= r[i->b], r[i->a], r[i->b]); break;
+    case OP_IS_NULL:     r[i->dst] = unknown(r[i->a]); break;
+    case OP_IS_NON_NULL: r[i->dst] = !unknown(r[i->a]); break;
+    case OP_NOT:         r[i->dst] = !r[i->a]; break;
+    case OP_AND: {
+        BoolOrNone bn1 = truth(r[i->a]);
+        BoolOrNone bn2 = truth(r[i->b]);
+        if (bn1==BN_FALSE || bn2==BN_FALSE) r[i->dst] = BN_FALSE;
+        else if (bn1==BN_TRUE && bn2==BN_TRUE) r[i->dst] = BN_TRUE;
+        else r[i->dst] = BN_UNKNOWN;
+        break;
+    }
+    case OP_OR: {
+        BoolOrNone bn1 = truth(r[i->a]);
+        BoolOrNone bn2 = truth(r[i->b]);
+        if (bn1==BN_TRUE || bn2==BN_TRUE) r[i->dst] = BN_TRUE;
+        else if (bn1==BN_FALSE && bn2==BN_FALSE) r[i->dst] = BN_FALSE;
+        else r[i->dst] = BN_UNKNOWN;
+        break;
+    }
+    case OP_JUMP_IF_FALSE:
+        if (truth(r[i->dst])==BN_FALSE) return start + i->x;
+        break;
+    case OP_JUMP_IF_TRUE:
+        if (truth(r[i->dst])==BN_TRUE) return start + i->x;
+        break;
+    case OP_LIKE: {
+        const Value& v = r[i->a];
+        r[i->dst] = v.type==Value::T_STRING ? BoolOrNone(likes()[i->x].match(*v.s)) : BN_UNKNOWN;
+        break;
+    }
+    case OP_BETWEEN: {
+        const Value& ve = r[i->a];
+        const Value& vl = r[i->b];
+        const Value& vu = r[i->x];
+        if (unknown(ve) || unknown(vl) || unknown(vu)) r[i->dst] = BN_UNKNOWN;
+        else r[i->dst] = ve>=vl && ve<=vu;
+        break;
+    }
+    case OP_IN_START:
+        if (unknown(r[i->a])) {
+            r[i->dst] = BN_UNKNOWN;
+            return start + i->x;
+        } else {
+            r[i->dst] = BN_FALSE;
+        }
+        break;
+    case OP_IN_ELEMENT: {
+        const Value& li = r[i->b];
+        if (unknown(li)) {
+            r[i->dst] = BN_UNKNOWN;
+        } else if (r[i->a]==li) {
+            r[i->dst] = BN_TRUE;
+            return start + i->x;
+        }
+        break;
+    }
+    case OP_NOT_IN_START:
+        if (unknown(r[i->a])) {
+            r[i->dst] = BN_UNKNOWN;
+            return start + i->x;
+        } else {
+            r[i->dst] = BN_TRUE;
+        }
+        break;
+    case OP_NOT_IN_ELEMENT: {
+        const Value& ve = r[i->a];
+        const Value& li = r[i->b];
+        if (unknown(li)) {
+            r[i->dst] = BN_UNKNOWN;
+        } else if (!unknown(r[i->dst]) &&
+                   !sameType(ve,li) && !(numeric(ve) && numeric(li))) {
+            // Type incompatibility makes the result FALSE unless something
+            // further in the list is unknown
+            r[i->dst] = BN_FALSE;
+        } else if (ve==li) {
+            r[i->dst] = BN_FALSE;
+            return start + i->x;
+        }
+        break;
+    }
+    case OP_IN_SET:     r[i->dst] = sets()[i->x].in(r[i->a]); break;
+    case OP_NOT_IN_SET: r[i->dst] = sets()[i->x].notIn(r[i->a]); break;
+    case OP_COPY: r[i->dst] = r[i->a]; break;
+    case OP_INT:  r[i->dst] = Value(int32_t(i->x)); break;
+    }
+    return i+1;
+}
+
+template <class Probe>
+void Program::run(const Env& env, Value* r, Probe& probe) const
+{
+    const Instruction* const start = code().data();
+    const Instruction* const end = start + code().size();
+    for (const Instruction* i = start; i<end;) {
+        const Instruction* const at = i;
+        const uint64_t began = probe.start();
+        i = execute(i, env, r);
+        probe.finish(at-start, r[at->dst], i!=at+1, began);
+    }
+}
+
+std::size_t Program::step(const Env& env, Value* r, std::size_t pc) const
+{
+    return execute(code().data()+pc, env, r) - code().data();
+}
+
+template <class Probe>
+Value Program::eval(const Env& env, Probe& probe) const
+{
+    if (registers<=LOCAL_REGISTERS) {
+        Value regs[LOCAL_REGISTERS];
+        run(env, regs, probe);
+        return regs[0];
+    }
+    SpareRegisters regs(registers);
+    run(env, regs.get(), probe);
+    return regs.get()[0];
+}
+
+Value Program::eval(const Env& env) const
+{
+    NoProbe probe;
+    return eval(env, probe);
+}
+
+Value Program::profile(const Env& env, Profile::Node* nodes) const
+{
+    NodeProbe probe{nodes};
+    return eval(env, probe);
+}
+
+BoolOrNone Program::eval_bool(const Env& env) const
+{
+    return truth(eval(env));
+}
+
+///////////////////////////////////////////////////////////
+
+// Batch evaluation
+//
+// Messages are evaluated in blocks of lanes. Each register holds a column of
+// values, one per lane, stored as separate type and payload arrays. Every
+// instruction loops over the lanes that are active at that point:
+// a lane taking a jump is parked until the program reaches the jump target,
+// which works because all jumps are forward.
+
+namespace {
+
+// Messages evaluated together in one pass over the program
+const unsigned BATCH_LANES = 256;
+
+typedef decltype(Value::type) ValueType;
+
+class BatchFrame {
+    vector<uint8_t> types;
+    vector<Payload> data;
+    vector<uint32_t> resume;
+    vector<uint16_t> selected;
+    unsigned count;
+    uint32_t nextResume;
+
+public:
+    static const uint32_t NEVER = std::numeric_limits<uint32_t>::max();
+
+    BatchFrame() :
+        resume(BATCH_LANES),
+        selected(BATCH_LANES),
+        count(0),
+        nextResume(NEVER)
+    {}
+
+    // Make the first lanes of registers unknown, as in a new frame
+    void clear(unsigned registers, unsigned lanes) {
+        if (types.size()<registers*BATCH_LANES) {
+            types.resize(registers*BATCH_LANES);
+            data.resize(registers*BATCH_LANES);
+        }
+        for (unsigned r = 0; r<registers; ++r) {
+            std::fill_n(&types[r*BATCH_LANES], lanes, uint8_t(Value::T_UNKNOWN));
+            std::fill_n(&data[r*BATCH_LANES], lanes, Payload());
+        }
+    }
+
+    // Payloads are always copied through the largest member
+    Value load(unsigned r, unsigned lane) const {
+        Value v;
+        v.type = ValueType(types[r*BATCH_LANES+lane]);
+        v.i = data[r*BATCH_LANES+lane].i;
+        return v;
+    }
+
+    void store(unsigned r, unsigned lane, const Value& v) {
+        types[r*BATCH_LANES+lane] = v.type;
+        data[r*BATCH_LANES+lane].i = v.i;
+    }
+
+    // Every lane of register r for the kernels
+    kernels::Column column(unsigned r) const {
+        return kernels::Column{&types[r*BATCH_LANES], &data[r*BATCH_LANES]};
+    }
+
+    void start(unsigned lanes) {
+        std::fill(resume.begin(), resume.begin()+lanes, 0);
+        for (unsigned l = 0; l<lanes; ++l) selected[l] = l;
+        count = lanes;
+        nextResume = NEVER;
+    }
+
+    // Stop running lane until the program reaches instruction pc
+    void park(unsigned lane, uint32_t pc) {
+        resume[lane] = pc;
+        nextResume = 0;
+    }
+
+    // Work out which lanes are active at instruction pc
+    void select(uint32_t pc, unsigned lanes) {
+        count = 0;
+        nextResume = NEVER;
+        for (unsigned l = 0; l<lanes; ++l) {
+            if (resume[l]<=pc) selected[count++] = l;
+            else nextResume = std::min(nextResume, resume[l]);
+        }
+    }
+
+    bool stale(uint32_t pc) const {
+        return pc>=nextResume;
+    }
+
+    unsigned active() const {
+        return count;
+    }
+
+    unsigned lane(unsigned k) const {
+        return selected[k];
+    }
+
+    uint32_t resumeAt() const {
+        return nextResume;
+    }
+};
+
+// The frame for batches, kept for each thread the same way as SpareRegisters
+class SpareFrame {
+    static thread_local unique_ptr<BatchFrame> spare;
+    static thread_local bool busy;
+
+    unique_ptr<BatchFrame> own;
+    BatchFrame* frame;
+    bool borrowed;
+
+public:
+    SpareFrame(unsigned registers, unsigned lanes) :
+        borrowed(!busy)
+    {
+        if (borrowed) {
+            if (!spare) spare.reset(new BatchFrame);
+            busy = true;
+            frame = spare.get();
+        } else {
+            own.reset(new BatchFrame);
+            frame = own.get();
+        }
+        frame->clear(registers, lanes);
+    }
+
+    ~SpareFrame() {
+        if (borrowed) busy = false;
+    }
+
+    BatchFrame& get() const {
+        return *frame;
+    }
+};
+
+thread_local unique_ptr<BatchFrame> SpareFrame::spare;
+thread_local bool SpareFrame::busy = false;
+
+inline bool bit(const uint64_t* mask, unsigned l)
+{
+    return (mask[l/64] >> (l%64)) & 1;
+}
+
+// Comparison of lanes the kernels didn't handle
+inline Value compare(OpCode op, const Value& v1, const Value& v2)
+{
+    switch (op) {
+    case OP_EQ:   return compare(v1 == v2, v1, v2);
+    case OP_NEQ:  return compare(v1 != v2, v1, v2);
+    case OP_LESS: return compare(v1 <  v2, v1, v2);
+    case OP_GRT:  return compare(v1 >  v2, v1, v2);
+    case OP_LSEQ: return compare(v1 <= v2, v1, v2);
+    case OP_GREQ: return compare(v1 >= v2, v1, v2);
+    default:      return Value();
+    }
+}
+
+struct EnvBatch {
+    const Env* const* envs;
+
+    Value value(uint32_t, std::size_t slot, const string& name, std::size_t m) const {
+        return envs[m]->value(slot, name);
+    }
+};
+
+struct ColumnBatch {
+    const Value* const* columns;
+
+    Value value(uint32_t, std::size_t slot, const string&, std::size_t m) const {
+        const Value* c = columns[slot];
+        return c ? c[m] : Value();
+    }
+};
+
+struct ColumnarBatch {
+    // The column of each identifier and the text of its strings in each lane,
+    // which lasts as long as the lanes
+    vector<const ColumnarEnv::Column*> columns;
+    mutable vector<string> texts;
+
+    Value value(uint32_t x, std::size_t, const string&, std::size_t m) const {
+        const ColumnarEnv::Column* c = columns[x];
+        return c ? ColumnarEnv::value(*c, m, texts[x*BATCH_LANES + m%BATCH_LANES]) : Value();
+    }
+};
+
+}
+
+template <class Source>
+void Program::run_batch(const Source& source, std::size_t n, uint8_t* results) const
+{
+    // Kernels run over whole words of lanes, and later batches over fewer
+    // lanes than the first
+    SpareFrame frame(registers, std::min<std::size_t>(BATCH_LANES, (n+63)/64*64));
+    BatchFrame& f = frame.get();
+    const uint32_t end = code().size();
+    uint64_t handled[BATCH_LANES/64];
+    uint64_t matched[BATCH_LANES/64];
+
+    for (std::size_t base = 0; base<n; base += BATCH_LANES) {
+        const unsigned lanes = std::min<std::size_t>(BATCH_LANES, n-base);
+        // Kernels run over whole words of lanes
+        const unsigned words = (lanes+63)/64;
+        f.start(lanes);
+
+        for (uint32_t pc = 0; pc<end; ++pc) {
+            if (f.stale(pc)) f.select(pc, lanes);
+            if (f.active()==0) {
+                // Every lane is waiting for a later instruction
+                if (f.resumeAt()>=end) break;
+                pc = f.resumeAt()-1;
+                continue;
+            }
+
+            const Instruction& i = code()[pc];
+            const unsigned active = f.active();
+
+#define FOR_ACTIVE(stmt) for (unsigned k = 0; k<active; ++k) { const unsigned l = f.lane(k); stmt; }
+#define LOAD(r) f.load(r, l)
+
+            switch (i.op) {
+            case OP_CONST:
+                FOR_ACTIVE(f.store(i.dst, l, constants()[i.x]));
+                break;
+            case OP_IDENTIFIER: {
+                const Operand& o = identifiers()[i.x];
+                FOR_ACTIVE(f.store(i.dst, l, source.value(i.x, o.slot, *o.name, base+l)));
+                break;
+            }
+            case OP_ADD:    FOR_ACTIVE(f.store(i.dst, l, LOAD(i.a) + LOAD(i.b))); break;
+            case OP_SUB:    FOR_ACTIVE(f.store(i.dst, l, LOAD(i.a) - LOAD(i.b))); break;
+            case OP_MULT:   FOR_ACTIVE(f.store(i.dst, l, LOAD(i.a) * LOAD(i.b))); break;
+            case OP_DIV:    FOR_ACTIVE(f.store(i.dst, l, LOAD(i.a) / LOAD(i.b))); break;
+            case OP_NEGATE: FOR_ACTIVE(f.store(i.dst, l, -LOAD(i.a))); break;
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LESS:
+            case OP_GRT:
+            case OP_LSEQ:
+            case OP_GREQ:
+                kernels::compare(i.op, f.column(i.a), f.column(i.b), words*64, handled, matched);
+                FOR_ACTIVE(
+                    if (bit(handled, l)) f.store(i.dst, l, bit(matched, l));
+                    else f.store(i.dst, l, compare(i.op, LOAD(i.a), LOAD(i.b))));
+                break;
+            case OP_IS_NULL:     FOR_ACTIVE(f.store(i.dst, l, unknown(LOAD(i.a)))); break;
+            case OP_IS_NON_NULL: FOR_ACTIVE(f.store(i.dst, l, !unknown(LOAD(i.a)))); break;
+            case OP_NOT:         FOR_ACTIVE(f.store(i.dst, l, !LOAD(i.a))); break;
+            case OP_AND:
+                FOR_ACTIVE(
+                    BoolOrNone bn1 = truth(LOAD(i.a));
+                    BoolOrNone bn2 = truth(LOAD(i.b));
+                    f.store(i.dst, l, (bn1==BN_FALSE || bn2==BN_FALSE) ? BN_FALSE :
+                                      (bn1==BN_TRUE && bn2==BN_TRUE) ? BN_TRUE : BN_UNKNOWN));
+                break;
+            case OP_OR:
+                FOR_ACTIVE(
+                    BoolOrNone bn1 = truth(LOAD(i.a));
+                    BoolOrNone bn2 = truth(LOAD(i.b));
+                    f.store(i.dst, l, (bn1==BN_TRUE || bn2==BN_TRUE) ? BN_TRUE :
+                                      (bn1==BN_FALSE && bn2==BN_FALSE) ? BN_FALSE : BN_UNKNOWN));
+                break;
+            case OP_JUMP_IF_FALSE:
+                FOR_ACTIVE(if (truth(LOAD(i.dst))==BN_FALSE) f.park(l, i.x));
+                break;
+            case OP_JUMP_IF_TRUE:
+                FOR_ACTIVE(if (truth(LOAD(i.dst))==BN_TRUE) f.park(l, i.x));
+                break;
+            case OP_LIKE:
+                FOR_ACTIVE(
+                    Value v = LOAD(i.a);
+                    f.store(i.dst, l, v.type==Value::T_STRING ? BoolOrNone(likes()[i.x].match(*v.s)) : BN_UNKNOWN));
+                break;
+            case OP_BETWEEN:
+                kernels::between(f.column(i.a), f.column(i.b), f.column(i.x), words*64, handled, matched);
+                FOR_ACTIVE(
+                    if (bit(handled, l)) { f.store(i.dst, l, bit(matched, l)); continue; }
+                    Value ve = LOAD(i.a);
+                    Value vl = LOAD(i.b);
+                    Value vu = LOAD(i.x);
+                    if (unknown(ve) || unknown(vl) || unknown(vu)) f.store(i.dst, l, BN_UNKNOWN);
+                    else f.store(i.dst, l, ve>=vl && ve<=vu));
+                break;
+            case OP_IN_START:
+            case OP_NOT_IN_START:
+                FOR_ACTIVE(
+                    if (unknown(LOAD(i.a))) {
+                        f.store(i.dst, l, BN_UNKNOWN);
+                        f.park(l, i.x);
+                    } else {
+                        f.store(i.dst, l, i.op==OP_IN_START ? BN_FALSE : BN_TRUE);
+                    });
+                break;
+            case OP_IN_ELEMENT:
+                // Numeric lanes are never unknown and only match if equal
+                kernels::compare(OP_EQ, f.column(i.a), f.column(i.b), words*64, handled, matched);
+                FOR_ACTIVE(
+                    if (bit(handled, l)) {
+                        if (bit(matched, l)) {
+                            f.store(i.dst, l, BN_TRUE);
+                            f.park(l, i.x);
+                        }
+                        continue;
+                    }
+                    Value li = LOAD(i.b);
+                    if (unknown(li)) {
+                        f.store(i.dst, l, BN_UNKNOWN);
+                    } else if (LOAD(i.a)==li) {
+                        f.store(i.dst, l, BN_TRUE);
+                        f.park(l, i.x);
+                    });
+                break;
+            case OP_NOT_IN_ELEMENT:
+                // Numeric lanes are never of incompatible type
+                kernels::compare(OP_EQ, f.column(i.a), f.column(i.b), words*64, handled, matched);
+                FOR_ACTIVE(
+                    if (bit(handled, l)) {
+                        if (bit(matched, l)) {
+                            f.store(i.dst, l, BN_FALSE);
+                            f.park(l, i.x);
+                        }
+                        continue;
+                    }
+                    Value ve = LOAD(i.a);
+                    Value li = LOAD(i.b);
+                    if (unknown(li)) {
+                        f.store(i.dst, l, BN_UNKNOWN);
+                    } else if (!unknown(LOAD(i.dst)) &&
+                               !sameType(ve,li) && !(numeric(ve) && numeric(li))) {
+                        f.store(i.dst, l, BN_FALSE);
+                    } else if (ve==li) {
+                        f.store(i.dst, l, BN_FALSE);
+                        f.park(l, i.x);
+                    });
+                break;
+            case OP_IN_SET:
+                FOR_ACTIVE(f.store(i.dst, l, sets()[i.x].in(LOAD(i.a))));
+                break;
+            case OP_NOT_IN_SET:
+                FOR_ACTIVE(f.store(i.dst, l, sets()[i.x].notIn(LOAD(i.a))));
+                break;
+            case OP_COPY:
+                FOR_ACTIVE(f.store(i.dst, l, LOAD(i.a)));
+                break;
+            case OP_INT:
+                FOR_ACTIVE(f.store(i.dst, l, Value(int32_t(i.x))));
+                break;
+            }
+
+#undef LOAD
+#undef FOR_ACTIVE
+        }
+
+        for (unsigned l = 0; l<lanes; ++l) {
+            results[base+l] = truth(f.load(0, l));
+        }
+    }
+}
+
+void Program::eval_batch(const Env* const* envs, std::size_t n, uint8_t* results) const
+{
+    run_batch(EnvBatch{envs}, n, results);
+}
+
+void Program::eval_batch(const Value* const* columns, std::size_t n, uint8_t* results) const
+{
+    for (auto& o : identifiers()) {
+        if (o.slot==SymbolTable::npos) {
+            throw std::logic_error("Identifier not bound to a slot: " + *o.name);
+        }
+    }
+    run_batch(ColumnBatch{columns}, n, results);
+}
+
+void Program::eval_batch(const ColumnarEnv& env, uint8_t* results) const
+{
+    ColumnarBatch batch;
+    for (auto& o : identifiers()) batch.columns.push_back(env.column(*o.name));
+    batch.texts.resize(identifiers().size()*BATCH_LANES);
+    run_batch(batch, env.rows(), results);
+}
+
+///////////////////////////////////////////////////////////
+
+// Saved programs
+//
+// "SELP", the format version, then the register count and the identifier,
+// constant, LIKE, IN set and instruction tables in that order. Identifiers
+// are saved by name only as slots belong to the SymbolTable in use.
+
+namespace {
+
+const char MAGIC[] = "SELP";
+// Version 2 added OP_COPY and 3 OP_INT
+const uint16_t FORMAT_VERSION = 3;
+
+}
+
+void Program::save(string& out) const
+{
+    Encoder e(out);
+    for (unsigned i = 0; i<4; ++i) e.u8(MAGIC[i]);
+    e.u16(FORMAT_VERSION);
+    e.u32(registers);
+    e.u32(identifiers().size());
+    for (auto& o : identifiers()) e.str(*o.name);
+    e.u32(constants().size());
+    for (auto& c : constants()) e.value(c);
+    e.u32(likes().size());
+    for (auto& l : likes()) l.save(e);
+    e.u32(sets().size());
+    for (auto& v : sets()) v.save(e);
+    e.u32(code().size());
+    for (auto& i : code()) {
+        e.u8(i.op);
+        e.u16(i.dst);
+        e.u16(i.a);
+        e.u16(i.b);
+        e.u32(i.x);
+    }
+}
+
+unique_ptr<Program> Program::load(const char* data, std::size_t n, SymbolTable* symbols)
+{
+    Decoder d(data, n);
+    for (unsigned i = 0; i<4; ++i) if (d.u8()!=uint8_t(MAGIC[i])) Decoder::fail("not a compiled selector");
+    const uint16_t version = d.u16();
+    if (version==0 || version>FORMAT_VERSION) Decoder::fail("unsupported format version");
+
+    unique_ptr<Program> p(new Program);
+    vector<Value> constants;
+    vector<Operand> identifiers;
+    vector<Instruction> code;
+    p->registers = d.u32();
+    if (p->registers==0 || p->registers>std::numeric_limits<uint16_t>::max()+1u) Decoder::fail("bad register count");
+    for (uint32_t k = d.count(4); k>0; --k) {
+        const string name = d.str();
+        const std::size_t slot = symbols ? symbols->bind(name) : SymbolTable::npos;
+        identifiers.push_back(Operand{symbols ? &symbols->name(slot) : &p->own(name), slot});
+    }
+    for (uint32_t k = d.count(1); k>0; --k) constants.push_back(d.value(p->ownTables().strings));
+    for (uint32_t k = d.count(8); k>0; --k) p->ownTables().likes.push_back(LikeMatcher::load(d));
+    for (uint32_t k = d.count(20); k>0; --k) p->ownTables().sets.push_back(ValueSet::load(d));
+    for (uint32_t k = d.count(11); k>0; --k) {
+        Instruction i;
+        const uint8_t op = d.u8();
+        if (op>(version<2 ? OP_NOT_IN_SET : version<3 ? OP_COPY : OP_LAST)) Decoder::fail("bad instruction");
+        i.op = OpCode(op);
+        i.dst = d.u16();
+        i.a = d.u16();
+        i.b = d.u16();
+        i.x = d.u32();
+        code.push_back(i);
+    }
+    if (!d.done()) Decoder::fail("trailing data");
+
+    // Everything an instruction refers to must exist, and jumps must go forward
+    const std::size_t size = code.size();
+    const std::size_t likes = p->likes().size();
+    const std::size_t sets = p->sets().size();
+    for (std::size_t pc = 0; pc<size; ++pc) {
+        const Instruction& i = code[pc];
+        bool ok = i.dst<p->registers && i.a<p->registers && i.b<p->registers;
+        switch (i.op) {
+        case OP_CONST: ok = ok && i.x<constants.size(); break;
+        case OP_IDENTIFIER: ok = ok && i.x<identifiers.size(); break;
+        case OP_LIKE: ok = ok && i.x<likes; break;
+        case OP_BETWEEN: ok = ok && i.x<p->registers; break;
+        case OP_IN_SET:
+        case OP_NOT_IN_SET: ok = ok && i.x<sets; break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_IN_START:
+        case OP_IN_ELEMENT:
+        case OP_NOT_IN_START:
+        case OP_NOT_IN_ELEMENT: ok = ok && i.x>pc && i.x<=size; break;
+        default: break;
+        }
+        if (!ok) Decoder::fail("bad operand in instruction " + std::to_string(pc));
+    }
+    p->pack(constants, identifiers, code);
+    return p;
+}
+
+///////////////////////////////////////////////////////////
+
+ProgramBuilder::ProgramBuilder() :
+    program(new Program),
+    registers(0),
+    top(0),
+    finding(false),
+    computations(0),
+    keys(nullptr)
+{}
+
+void ProgramBuilder::identify(const Keys& k)
+{
+    keys = &k;
+}
+
+bool ProgramBuilder::key(const void* node, Key& k) const
+{
+    if (!keys) return false;
+    auto i = keys->find(node);
+    if (i==keys->end()) return false;
+    k = i->second;
+    return true;
+}
+
+void ProgramBuilder::findShared()
+{
+    finding = true;
+}
+
+void ProgramBuilder::share(const ProgramBuilder& finder)
+{
+    assert(code.empty());
+    shared = finder.shared;
+    // Finding allocates only the stack, which is the same height both times,
+    // so kept values go above it
+    registers = finder.registers;
+}
+
+ProgramBuilder::Register ProgramBuilder::push()
+{
+    if (top>std::numeric_limits<Register>::max()) throw std::range_error("Selector too complex to compile");
+    Register r = top++;
+    if (top>registers) registers = top;
+    return r;
+}
+
+void ProgramBuilder::pop(unsigned n)
+{
+    assert(n<=top);
+    top -= n;
+}
+
+std::size_t ProgramBuilder::emit(OpCode op, Register dst, Register a, Register b, uint32_t x)
+{
+    code.push_back(Instruction{op, dst, a, b, x});
+    return code.size()-1;
+}
+
+void ProgramBuilder::patch(std::size_t i)
+{
+    code[i].x = code.size();
+}
+
+bool ProgramBuilder::reuse(Key key, Register dst)
+{
+    auto i = available.find(key);
+    if (i==available.end()) return false;
+    if (finding) shared[i->second.index] = true;
+    else emit(OP_COPY, dst, i->second.reg);
+    return true;
+}
+
+void ProgramBuilder::computed(Key key, Register dst)
+{
+    const std::size_t n = computations++;
+    Register r = 0;
+    if (finding) {
+        shared.push_back(false);
+    } else {
+        if (n>=shared.size() || !shared[n]) return;
+        if (registers>std::numeric_limits<Register>::max()) throw std::range_error("Selector too complex to compile");
+        r = registers++;
+        emit(OP_COPY, r, dst);
+    }
+    available.emplace(key, Computed{n, r});
+    if (!regions.empty()) regions.back().push_back(key);
+}
+
+void ProgramBuilder::conditional()
+{
+    regions.emplace_back();
+}
+
+void ProgramBuilder::unconditional()
+{
+    for (auto& k : regions.back()) available.erase(k);
+    regions.pop_back();
+}
+
+uint32_t ProgramBuilder::constant(const Value& v, bool interned)
+{
+    if (v.type==Value::T_STRING && !interned) {
+        constants.push_back(hashed(program->own(*v.s)));
+    } else {
+        constants.push_back(v);
+    }
+    return constants.size()-1;
+}
+
+uint32_t ProgramBuilder::identifier(const string& name, std::size_t slot)
+{
+    identifiers.push_back(Program::Operand{slot==SymbolTable::npos ? &program->own(name) : &name, slot});
+    return identifiers.size()-1;
+}
+
+uint32_t ProgramBuilder::like(const LikeMatcher& matcher)
+{
+    program->ownTables().likes.push_back(matcher);
+    return program->likes().size()-1;
+}
+
+uint32_t ProgramBuilder::set(const ValueSet& set)
+{
+    program->ownTables().sets.push_back(set);
+    return program->sets().size()-1;
+}
+
+unique_ptr<Program> ProgramBuilder::finish()
+{
+    assert(top==0);
+    program->registers = registers;
+    program->pack(constants, identifiers, code);
+    return std::move(program);
+}
+
+}
@@ -0,0 +1,303 @@
+#ifndef SELECTOR_PROGRAM_H
+#define SELECTOR_PROGRAM_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorExpression.h"
+#include "SelectorLike.h"
+#include "SelectorProfile.h"
+#include "SelectorValue.h"
+#include "SelectorValueSet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace selector {
+
+class Env;
+class SymbolTable;
+
+// Instructions of the register machine that runs compiled selectors.
+// Registers hold Values; jumps are always forward to an absolute instruction index.
+enum OpCode : uint8_t {
+    OP_CONST,           // dst = constants[x]
+    OP_IDENTIFIER,      // dst = env value of identifiers[x]
+    OP_ADD,             // dst = a + b
+    OP_SUB,             // dst = a - b
+    OP_MULT,            // dst = a * b
+    OP_DIV,             // dst = a / b
+    OP_NEGATE,          // dst = -a
+    OP_EQ,              // dst = a == b (UNKNOWN if either is unknown)
+    OP_NEQ,             // ...
+    OP_LESS,
+    OP_GRT,
+    OP_LSEQ,
+    OP_GREQ,
+    OP_IS_NULL,         // dst = a is unknown
+    OP_IS_NON_NULL,     // dst = a is not unknown
+    OP_NOT,             // dst = NOT a
+    OP_AND,             // dst = a AND b
+    OP_OR,              // dst = a OR b
+    OP_JUMP_IF_FALSE,   // if dst is FALSE goto x
+    OP_JUMP_IF_TRUE,    // if dst is TRUE goto x
+    OP_LIKE,            // dst = a matches likes[x]
+    OP_BETWEEN,         // dst = a BETWEEN b AND register x
+    OP_IN_START,        // if a is unknown: dst = UNKNOWN, goto x; otherwise dst = FALSE
+    OP_IN_ELEMENT,      // fold list element b into IN result dst for a; goto x if TRUE
+    OP_NOT_IN_START,    // if a is unknown: dst = UNKNOWN, goto x; otherwise dst = TRUE
+    OP_NOT_IN_ELEMENT,  // fold list element b into NOT IN result dst for a; goto x if FALSE
+    OP_IN_SET,          // dst = a IN sets[x]
+    OP_NOT_IN_SET,      // dst = a NOT IN sets[x]
+    OP_COPY,            // dst = a
+    OP_INT,             // dst = x as a signed 32 bit EXACT
+    OP_LAST = OP_INT
+};
+
+struct Instruction {
+    OpCode op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    uint32_t x;
+};
+
+/**
+ * A selector compiled to a contiguous array of instructions.
+ *
+ * A Program is independent of the Expression it was compiled from and
+ * evaluates to exactly the same three valued results.
+ *
+ * It is kept small for applications holding very many selectors: the
+ * constants, identifiers and instructions share one allocation, the LIKE
+ * patterns, IN sets and strings only some selectors have are in another, and
+ * identifier names and string literals interned in a SymbolTable are pointed
+ * to rather than copied.
+ */
+class Program : public Expression {
+    friend class ProgramBuilder;
+    friend class Profile;
+    friend class JitSelector;
+
+    struct Operand {
+        const std::string* name;
+        std::size_t slot;
+    };
+
+    template <class T>
+    class Span {
+        const T* first;
+        std::size_t n;
+
+    public:
+        Span(const T* f, std::size_t s) : first(f), n(s) {}
+
+        const T* data() const { return first; }
+        const T* begin() const { return first; }
+        const T* end() const { return first+n; }
+        std::size_t size() const { return n; }
+        bool empty() const { return n==0; }
+        const T& operator[](std::size_t i) const { return first[i]; }
+    };
+
+    struct Tables {
+        std::vector<LikeMatcher> likes;
+        std::vector<ValueSet> sets;
+        // The string constants and identifier names that aren't interned
+        std::vector<std::unique_ptr<std::string>> strings;
+    };
+
+    // The constants, then the identifiers, then the code, which need no
+    // padding between them
+    std::unique_ptr<uint64_t[]> storage;
+    std::unique_ptr<Tables> tables;
+    uint32_t constantCount;
+    uint32_t identifierCount;
+    uint32_t codeSize;
+    uint32_t registers;
+
+    Span<Value> constants() const {
+        return Span<Value>(reinterpret_cast<const Value*>(storage.get()), constantCount);
+    }
+    Span<Operand> identifiers() const {
+        return Span<Operand>(reinterpret_cast<const Operand*>(constants().end()), identifierCount);
+    }
+    Span<Instruction> code() const {
+        return Span<Instruction>(reinterpret_cast<const Instruction*>(identifiers().end()), codeSize);
+    }
+    Span<LikeMatcher> likes() const {
+        return tables ? Span<LikeMatcher>(tables->likes.data(), tables->likes.size()) : Span<LikeMatcher>(nullptr, 0);
+    }
+    Span<ValueSet> sets() const {
+        return tables ? Span<ValueSet>(tables->sets.data(), tables->sets.size()) : Span<ValueSet>(nullptr, 0);
+    }
+    Tables& ownTables();
+    // Keep a copy of s
+    const std::string& own(const std::string& s);
+    // Fill storage, dropping tables if they are empty
+    void pack(const std::vector<Value>&, const std::vector<Operand>&, const std::vector<Instruction>&);
+
+    Program();
+
+    const Instruction* execute(const Instruction*, const Env&, Value* regs) const;
+    // Probe is told about every instruction run, see NoProbe
+    template <class Probe>
+    void run(const Env&, Value* regs, Probe&) const;
+    template <class Probe>
+    Value eval(const Env&, Probe&) const;
+
+    // Evaluate adding to the counts of each instruction in nodes
+    Value profile(const Env&, Profile::Node* nodes) const;
+    void repr(std::ostream&, std::size_t pc) const;
+    // Run the single instruction at pc, returning the index of the next
+    std::size_t step(const Env&, Value* regs, std::size_t pc) const;
+
+    template <class Source>
+    void run_batch(const Source&, std::size_t n, uint8_t* results) const;
+
+public:
+    Program(const Program&);
+
+    void repr(std::ostream&) const;
+    Value eval(const Env&) const;
+    BoolOrNone eval_bool(const Env&) const;
+
+    // See eval_batch() in SelectorExpression.h
+    void eval_batch(const Env* const* envs, std::size_t n, uint8_t* results) const;
+    void eval_batch(const Value* const* columns, std::size_t n, uint8_t* results) const;
+    void eval_batch(const ColumnarEnv&, uint8_t* results) const;
+
+    // The name of each identifier read, in order of first use
+    std::vector<std::string> identifierNames() const {
+        std::vector<std::string> names;
+        for (auto& o : identifiers()) {
+            if (std::find(names.begin(), names.end(), *o.name)==names.end()) names.push_back(*o.name);
+        }
+        return names;
+    }
+
+    // See memory_usage() in SelectorExpression.h
+    virtual std::size_t memory() const;
+
+    // See save_selector() and load_selector() in SelectorExpression.h
+    void save(std::string&) const;
+    static std::unique_ptr<Program> load(const char* data, std::size_t n, SymbolTable*);
+};
+
+/**
+ * Used by the Expression tree to emit a Program.
+ *
+ * Registers are allocated as a stack: every node leaves its result in the
+ * register it is given, pushing temporaries for its operands and popping
+ * them before it returns.
+ *
+ * Identical subexpressions are computed once where the first is always
+ * evaluated before the others: the first is copied to a register of its own,
+ * above the stack, and the others copy it back. As a subexpression is only
+ * worth keeping if it is used again, the tree is compiled twice: once with
+ * findShared() to find them and then by a builder given that one to share().
+ * Subexpressions are told apart by a Key, a number that identical ones share.
+ * Code that is only run on some paths, such as the later operands of an AND
+ * or OR, is bracketed by conditional() and unconditional() so that what it
+ * computes isn't reused after it.
+ */
+class ProgramBuilder {
+public:
+    typedef uint16_t Register;
+    typedef std::size_t Key;
+    typedef std::unordered_map<const void*, Key> Keys;
+
+private:
+    std::unique_ptr<Program> program;
+    std::vector<Instruction> code;
+    std::vector<Value> constants;
+    std::vector<Program::Operand> identifiers;
+    uint32_t registers;
+    unsigned top;
+    struct Computed {
+        std::size_t index;
+        uint16_t reg;
+    };
+
+    bool finding;
+    // Whether each subexpression computed, in the order computed, was found
+    // to be used again. The tree is gone through the same way both times.
+    std::vector<bool> shared;
+    std::size_t computations;
+    // The key of each subexpression that may be shared
+    const Keys* keys;
+    // The subexpressions computed that can be reused, and where they are kept
+    std::unordered_map<Key, Computed> available;
+    // The subexpressions computed in each conditional region still open
+    std::vector<std::vector<Key>> regions;
+
+public:
+    ProgramBuilder();
+
+    // Subexpressions not in keys are never shared. Keys must outlive the builder.
+    void identify(const Keys& keys);
+    // Set k to the key of subexpression node and return true if it has one
+    bool key(const void* node, Key& k) const;
+
+    // Compile only to find the subexpressions used more than once
+    void findShared();
+    // Compute the subexpressions found by finder once. Must be called before
+    // anything is emitted.
+    void share(const ProgramBuilder& finder);
+
+    Register push();
+    void pop(unsigned n = 1);
+
+    // Return the index of instruction that was emitted
+    std::size_t emit(OpCode op, Register dst, Register a = 0, Register b = 0, uint32_t x = 0);
+
+    // Point the jump instruction emitted at index i to the next instruction to be emitted
+    void patch(std::size_t i);
+
+    // If the subexpression key has already been computed, emit code putting
+    // its value in dst and return true
+    bool reuse(Key key, Register dst);
+    // The subexpression key has just been computed into dst
+    void computed(Key key, Register dst);
+    // Start and end code that isn't always run
+    void conditional();
+    void unconditional();
+
+    // A string constant is copied unless interned says that it points to a
+    // string interned in a SymbolTable
+    uint32_t constant(const Value&, bool interned = false);
+    // If slot is bound then name must be the SymbolTable's own copy
+    uint32_t identifier(const std::string& name, std::size_t slot);
+    uint32_t like(const LikeMatcher&);
+    uint32_t set(const ValueSet&);
+
+    std::unique_ptr<Program> finish();
+};
+
+}
+
+#endif
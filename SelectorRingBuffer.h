@@ -0,0 +1,129 @@
+#ifndef SELECTOR_RING_BUFFER_H
+#define SELECTOR_RING_BUFFER_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace selector {
+
+/**
+ * Bounded lock free queue for any number of producer and consumer threads.
+ *
+ * Each element has a sequence number saying whether it is waiting to be
+ * written or read on the current lap of the ring, so a push or pop only
+ * contends with other pushes or pops for one atomic position.
+ *
+ * Elements are swapped in and out rather than copied: try_push() leaves v
+ * with the contents of a previously popped element, and try_pop() gives back
+ * what v held, so buffers that elements own go round the ring and are reused
+ * instead of being allocated for each element.
+ */
+template <class T>
+class RingBuffer {
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    const std::size_t mask;
+    const std::unique_ptr<Cell[]> cells;
+    // On separate cache lines so producers and consumers don't share one
+    alignas(64) std::atomic<std::size_t> pushed;
+    alignas(64) std::atomic<std::size_t> popped;
+
+    static std::size_t roundUp(std::size_t n) {
+        std::size_t p = 2;
+        while (p<n) p *= 2;
+        return p;
+    }
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+
+public:
+    // Holds capacity elements rounded up to a power of two
+    explicit RingBuffer(std::size_t capacity) :
+        mask(roundUp(capacity)-1),
+        cells(new Cell[mask+1]),
+        pushed(0),
+        popped(0)
+    {
+        for (std::size_t i = 0; i<=mask; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    std::size_t capacity() const {
+        return mask+1;
+    }
+
+    // Returns false, leaving v alone, if the ring is full
+    bool try_push(T& v) {
+        std::size_t pos = pushed.load(std::memory_order_relaxed);
+        Cell* c;
+        for (;;) {
+            c = &cells[pos & mask];
+            const std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            const std::intptr_t d = std::intptr_t(seq) - std::intptr_t(pos);
+            if (d==0) {
+                if (pushed.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if (d<0) {
+                return false;
+            } else {
+                pos = pushed.load(std::memory_order_relaxed);
+            }
+        }
+        using std::swap;
+        swap(c->value, v);
+        c->sequence.store(pos+1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false, leaving v alone, if the ring is empty
+    bool try_pop(T& v) {
+        std::size_t pos = popped.load(std::memory_order_relaxed);
+        Cell* c;
+        for (;;) {
+            c = &cells[pos & mask];
+            const std::size_t seq = c->sequence.load(std::memory_order_acquire);
+            const std::intptr_t d = std::intptr_t(seq) - std::intptr_t(pos+1);
+            if (d==0) {
+                if (popped.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+            } else if (d<0) {
+                return false;
+            } else {
+                pos = popped.load(std::memory_order_relaxed);
+            }
+        }
+        using std::swap;
+        swap(c->value, v);
+        c->sequence.store(pos+mask+1, std::memory_order_release);
+        return true;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,537 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorSet.h"
+
+#include "SelectorEnv.h"
+#include "SelectorExpression.h"
+#include "SelectorTerms.h"
+#include "SelectorThreadPool.h"
+#include "SelectorValue.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace selector {
+
+using std::size_t;
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+namespace {
+
+const size_t NONE = std::numeric_limits<size_t>::max();
+
+double number(const Value& v)
+{
+    // -0 and 0 are equal so must hash the same
+    double d = v.type==Value::T_EXACT ? double(v.i) : v.x;
+    return d==0 ? 0 : d;
+}
+
+// A term shared by every selector that contains it
+struct Predicate {
+    unique_ptr<Expression> program;
+    string key;
+    size_t refs;
+    // Term's index description, used if it is the access term of any selector
+    SelectorTerm::Kind kind;
+    string identifier;
+    size_t slot;
+    vector<double> numbers;
+    vector<string> strings;
+    unsigned bools;
+    double lower;
+    double upper;
+    // Selectors for which this is the access term
+    vector<size_t> accessors;
+    // Non zero while indexed in an IntervalIndex
+    uint64_t serial;
+
+    Predicate() :
+        refs(0),
+        kind(SelectorTerm::OTHER),
+        slot(0),
+        bools(0),
+        lower(0),
+        upper(0),
+        serial(0)
+    {}
+};
+
+/**
+ * Finds the closed intervals that contain a value.
+ *
+ * Intervals are kept in levels, level i holding up to 2^i of them sorted by
+ * lower bound with an implicit tree of the maximum upper bound in each subrange
+ * above them; adding an interval merges the full levels below the first empty
+ * one into it. Intervals are removed by forgetting their serial number and
+ * skipped until there are as many of them as there are live intervals, when
+ * everything is rebuilt.
+ */
+class IntervalIndex {
+    struct Interval {
+        double lower;
+        double upper;
+        size_t predicate;
+        uint64_t serial;
+    };
+
+    struct Level {
+        vector<Interval> intervals;
+        // Leaves from width, padded with -inf
+        vector<double> upper;
+        size_t width;
+
+        Level() : width(0) {}
+
+        void build(vector<Interval>&& is) {
+            intervals = std::move(is);
+            std::sort(intervals.begin(), intervals.end(),
+                      [](const Interval& a, const Interval& b) { return a.lower < b.lower; });
+            width = 1;
+            while (width < intervals.size()) width *= 2;
+            upper.assign(2*width, -HUGE_VAL);
+            for (size_t i = 0; i<intervals.size(); ++i) upper[width+i] = intervals[i].upper;
+            for (size_t n = width-1; n>0; --n) upper[n] = std::max(upper[2*n], upper[2*n+1]);
+        }
+
+        void clear() {
+            intervals.clear();
+            upper.clear();
+            width = 0;
+        }
+
+        template <typename F>
+        void stab(size_t node, size_t first, size_t last, size_t end, double v, F& f) const {
+            if (first>=end || upper[node]<v) return;
+            if (node>=width) {
+                f(intervals[first]);
+                return;
+            }
+            const size_t mid = first + (last-first)/2;
+            stab(2*node, first, mid, end, v, f);
+            stab(2*node+1, mid, last, end, v, f);
+        }
+
+        // Call f for every interval containing v
+        template <typename F>
+        void stab(double v, F& f) const {
+            if (intervals.empty()) return;
+            auto end = std::upper_bound(intervals.begin(), intervals.end(), v,
+                                        [](double x, const Interval& i) { return x < i.lower; });
+            stab(1, 0, width, end-intervals.begin(), v, f);
+        }
+    };
+
+    vector<Level> levels;
+    size_t live;
+    size_t dead;
+
+    static bool valid(const Interval& i, const vector<Predicate>& ps) {
+        return ps[i.predicate].serial==i.serial;
+    }
+
+    void collect(vector<Interval>& is, Level& l, const vector<Predicate>& ps) {
+        for (auto& i : l.intervals) if (valid(i, ps)) is.push_back(i);
+        l.clear();
+    }
+
+public:
+    IntervalIndex() : live(0), dead(0) {}
+
+    void add(double lower, double upper, size_t predicate, const vector<Predicate>& ps) {
+        vector<Interval> carry{Interval{lower, upper, predicate, ps[predicate].serial}};
+        size_t level = 0;
+        for (; level<levels.size() && !levels[level].intervals.empty(); ++level) {
+            collect(carry, levels[level], ps);
+        }
+        if (level==levels.size()) levels.emplace_back();
+        levels[level].build(std::move(carry));
+        ++live;
+    }
+
+    // Called after the predicate's serial has been changed
+    void remove(const vector<Predicate>& ps) {
+        --live;
+        if (++dead <= live) return;
+        vector<Interval> all;
+        for (auto& l : levels) collect(all, l, ps);
+        levels.clear();
+        dead = 0;
+        if (all.empty()) return;
+        size_t level = 0;
+        while ((size_t(1) << level) < all.size()) ++level;
+        levels.resize(level+1);
+        levels[level].build(std::move(all));
+    }
+
+    template <typename F>
+    void stab(double v, const vector<Predicate>& ps, F f) const {
+        auto g = [&](const Interval& i) { if (valid(i, ps)) f(i.predicate); };
+        for (auto& l : levels) l.stab(v, g);
+    }
+};
+
+// The access terms on one identifier
+struct Field {
+    size_t slot;
+    unordered_map<double, vector<size_t>> numbers;
+    unordered_map<string, vector<size_t>> strings;
+    vector<size_t> bools[2];
+    IntervalIndex ranges;
+    size_t count;
+
+    Field() : slot(0), count(0) {}
+};
+
+struct Selector {
+    bool live;
+    // Predicate used to find the selector in the index, if any
+    size_t access;
+    // Every other predicate of the selector
+    vector<size_t> others;
+};
+
+void insert(vector<size_t>& ps, size_t p)
+{
+    // The values of one IN term can map to the same key
+    if (ps.empty() || ps.back()!=p) ps.push_back(p);
+}
+
+template <typename Map, typename Key>
+void erase(Map& m, const Key& k, size_t p)
+{
+    auto i = m.find(k);
+    if (i==m.end()) return;
+    auto& ps = i->second;
+    ps.erase(std::remove(ps.begin(), ps.end(), p), ps.end());
+    if (ps.empty()) m.erase(i);
+}
+
+void erase(vector<size_t>& ps, size_t p)
+{
+    ps.erase(std::remove(ps.begin(), ps.end(), p), ps.end());
+}
+
+// Lower is better as the access term of a selector
+int rank(const Predicate& p)
+{
+    switch (p.kind) {
+    case SelectorTerm::EQUAL: return 0;
+    case SelectorTerm::IN: return 1;
+    case SelectorTerm::RANGE: return std::isinf(p.lower) || std::isinf(p.upper) ? 3 : 2;
+    default: return 4;
+    }
+}
+
+// Matches one message, evaluating each predicate at most once
+class Matching {
+    const vector<Predicate>& predicates;
+    const vector<Selector>& selectors;
+    const Env& env;
+    unordered_map<size_t, BoolOrNone> results;
+
+    BoolOrNone eval(size_t p) {
+        auto i = results.find(p);
+        if (i!=results.end()) return i->second;
+        BoolOrNone r = predicates[p].program->eval_bool(env);
+        results.emplace(p, r);
+        return r;
+    }
+
+public:
+    Matching(const vector<Predicate>& ps, const vector<Selector>& ss, const Env& e) :
+        predicates(ps),
+        selectors(ss),
+        env(e)
+    {}
+
+    // Whether the rest of s's terms are TRUE
+    bool complete(const Selector& s) {
+        for (size_t p : s.others) if (eval(p)!=BN_TRUE) return false;
+        return true;
+    }
+
+    // Add the selectors accessed by p which are TRUE to ids
+    void accessed(size_t p, vector<size_t>& ids) {
+        if (eval(p)!=BN_TRUE) return;
+        for (size_t s : predicates[p].accessors) if (complete(selectors[s])) ids.push_back(s);
+    }
+};
+
+}
+
+struct SelectorSet::State {
+    vector<Predicate> predicates;
+    vector<size_t> freePredicates;
+    unordered_map<string, size_t> keys;
+    vector<Selector> selectors;
+    size_t count;
+    // Selectors with no access term
+    vector<size_t> scan;
+    unordered_map<string, Field> fields;
+    uint64_t serial;
+
+    State() : count(0), serial(0) {}
+
+    size_t predicate(const SelectorTerm& t) {
+        const string key = selectorKey(*t.expression);
+        auto i = keys.find(key);
+        if (i!=keys.end()) {
+            ++predicates[i->second].refs;
+            return i->second;
+        }
+
+        size_t id;
+        if (freePredicates.empty()) {
+            id = predicates.size();
+            predicates.emplace_back();
+        } else {
+            id = freePredicates.back();
+            freePredicates.pop_back();
+            predicates[id] = Predicate();
+        }
+        Predicate& p = predicates[id];
+        p.program = compile(*t.expression);
+        p.key = key;
+        p.refs = 1;
+        p.kind = t.kind;
+        p.identifier = t.identifier;
+        p.slot = t.slot;
+        p.lower = t.lower;
+        p.upper = t.upper;
+        for (auto& v : t.values) {
+            switch (v.type) {
+            case Value::T_BOOL: p.bools |= 1u << v.b; break;
+            case Value::T_STRING: p.strings.push_back(*v.s); break;
+            case Value::T_EXACT:
+            case Value::T_INEXACT: if (!std::isnan(number(v))) p.numbers.push_back(number(v)); break;
+            default: break;
+            }
+        }
+        keys[key] = id;
+        return id;
+    }
+
+    void release(size_t id) {
+        Predicate& p = predicates[id];
+        if (--p.refs) return;
+        keys.erase(p.key);
+        p.program.reset();
+        freePredicates.push_back(id);
+    }
+
+    void index(size_t id) {
+        Predicate& p = predicates[id];
+        Field& f = fields[p.identifier];
+        f.slot = p.slot;
+        ++f.count;
+        for (double d : p.numbers) insert(f.numbers[d], id);
+        for (auto& s : p.strings) insert(f.strings[s], id);
+        for (unsigned b = 0; b<2; ++b) if (p.bools & 1u << b) insert(f.bools[b], id);
+        if (p.kind==SelectorTerm::RANGE) {
+            p.serial = ++serial;
+            f.ranges.add(p.lower, p.upper, id, predicates);
+        }
+    }
+
+    void unindex(size_t id) {
+        Predicate& p = predicates[id];
+        auto fi = fields.find(p.identifier);
+        Field& f = fi->second;
+        for (double d : p.numbers) erase(f.numbers, d, id);
+        for (auto& s : p.strings) erase(f.strings, s, id);
+        for (unsigned b = 0; b<2; ++b) erase(f.bools[b], id);
+        if (p.kind==SelectorTerm::RANGE) {
+            p.serial = 0;
+            f.ranges.remove(predicates);
+        }
+        if (--f.count==0) fields.erase(fi);
+    }
+
+    // Call f(p) for every access predicate that could be TRUE for env; the
+    // same predicate may be passed more than once
+    template <typename F>
+    void access(const Env& env, F f) const {
+        auto list = [&](const vector<size_t>& ps) {
+            for (size_t p : ps) f(p);
+        };
+        for (auto& fi : fields) {
+            const Field& fd = fi.second;
+            const Value& v = env.value(fd.slot, fi.first);
+            switch (v.type) {
+            case Value::T_BOOL:
+                list(fd.bools[v.b]);
+                break;
+            case Value::T_STRING: {
+                auto i = fd.strings.find(*v.s);
+                if (i!=fd.strings.end()) list(i->second);
+                break;
+            }
+            case Value::T_EXACT:
+            case Value::T_INEXACT: {
+                const double d = number(v);
+                if (std::isnan(d)) break;
+                auto i = fd.numbers.find(d);
+                if (i!=fd.numbers.end()) list(i->second);
+                fd.ranges.stab(d, predicates, f);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+};
+
+SelectorSet::SelectorSet() :
+    state(new State)
+{}
+
+SelectorSet::~SelectorSet()
+{}
+
+SelectorSet::Id SelectorSet::add(const Expression& e)
+{
+    State& st = *state;
+    vector<SelectorTerm> terms;
+    selectorTerms(e, terms);
+
+    Selector s{true, NONE, {}};
+    for (auto& t : terms) {
+        size_t p = st.predicate(t);
+        // A AND A has only one term
+        if (std::find(s.others.begin(), s.others.end(), p)!=s.others.end()) st.release(p);
+        else s.others.push_back(p);
+    }
+
+    auto best = s.others.end();
+    for (auto i = s.others.begin(); i!=s.others.end(); ++i) {
+        if (rank(st.predicates[*i]) < 4 && (best==s.others.end() || rank(st.predicates[*i]) < rank(st.predicates[*best]))) best = i;
+    }
+
+    const Id id = st.selectors.size();
+    if (best!=s.others.end()) {
+        s.access = *best;
+        s.others.erase(best);
+        Predicate& p = st.predicates[s.access];
+        if (p.accessors.empty()) st.index(s.access);
+        p.accessors.push_back(id);
+    } else {
+        st.scan.push_back(id);
+    }
+    st.selectors.push_back(std::move(s));
+    ++st.count;
+    return id;
+}
+
+bool SelectorSet::remove(Id id)
+{
+    State& st = *state;
+    if (id>=st.selectors.size() || !st.selectors[id].live) return false;
+    Selector& s = st.selectors[id];
+    if (s.access!=NONE) {
+        Predicate& p = st.predicates[s.access];
+        erase(p.accessors, id);
+        if (p.accessors.empty()) st.unindex(s.access);
+        st.release(s.access);
+    } else {
+        erase(st.scan, id);
+    }
+    for (size_t p : s.others) st.release(p);
+    s = Selector{false, NONE, {}};
+    --st.count;
+    return true;
+}
+
+std::size_t SelectorSet::size() const
+{
+    return state->count;
+}
+
+void SelectorSet::match(const Env& env, vector<Id>& ids) const
+{
+    const State& st = *state;
+    ids.clear();
+
+    Matching m(st.predicates, st.selectors, env);
+    std::unordered_set<size_t> seen;
+    st.access(env, [&](size_t p) {
+        if (seen.insert(p).second) m.accessed(p, ids);
+    });
+    for (size_t s : st.scan) if (m.complete(st.selectors[s])) ids.push_back(s);
+    std::sort(ids.begin(), ids.end());
+}
+
+void SelectorSet::match(const Env& env, vector<Id>& ids, ThreadPool& pool) const
+{
+    const State& st = *state;
+    ids.clear();
+
+    // Finding the candidates is cheap next to evaluating them so isn't shared out
+    vector<size_t> candidates;
+    std::unordered_set<size_t> seen;
+    st.access(env, [&](size_t p) {
+        if (seen.insert(p).second) candidates.push_back(p);
+    });
+
+    // The candidates then the scan list, in a few chunks for each thread. Each
+    // chunk has its own results so a predicate shared between chunks may be
+    // evaluated more than once, but the chunks need no locking.
+    const size_t work = candidates.size() + st.scan.size();
+    const size_t chunks = std::min<size_t>(work, 4*pool.threads());
+    vector<vector<Id>> found(chunks);
+    pool.run(chunks, [&](size_t c) {
+        Matching m(st.predicates, st.selectors, env);
+        vector<Id>& out = found[c];
+        const size_t last = work * (c+1) / chunks;
+        for (size_t i = work * c / chunks; i<last; ++i) {
+            if (i<candidates.size()) {
+                m.accessed(candidates[i], out);
+            } else {
+                const size_t s = st.scan[i-candidates.size()];
+                if (m.complete(st.selectors[s])) out.push_back(s);
+            }
+        }
+    });
+    for (auto& f : found) ids.insert(ids.end(), f.begin(), f.end());
+    std::sort(ids.begin(), ids.end());
+}
+
+void SelectorSet::match(const vector<const Env*>& envs, vector<vector<Id>>& ids, ThreadPool& pool) const
+{
+    ids.resize(envs.size());
+    pool.run(envs.size(), [&](size_t i) {
+        match(*envs[i], ids[i]);
+    });
+}
+
+}
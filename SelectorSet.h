@@ -0,0 +1,84 @@
+#ifndef SELECTOR_SET_H
+#define SELECTOR_SET_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace selector {
+
+class Env;
+class Expression;
+class ThreadPool;
+
+/**
+ * Matches a message against many selectors at once.
+ *
+ * Each selector is split into the terms that must all be TRUE for it to be
+ * TRUE. Terms that are the same in different selectors are evaluated once per
+ * message, and every selector that contains a term comparing an identifier with
+ * constants (A = 'x', A IN (1, 2), A > 10, A BETWEEN 1 AND 5) is indexed by the
+ * values of that identifier that could make the term TRUE. So matching a
+ * message costs in proportion to the number of selectors that could match it
+ * rather than to the number of selectors in the set; selectors with no such
+ * term are evaluated every time.
+ *
+ * The SelectorSet doesn't refer to an Expression once it has been added. The
+ * selectors in one set should all have been made with the same SymbolTable, or
+ * without one.
+ *
+ * The matches for one message, or for a batch of messages, can be shared out
+ * between the threads of a ThreadPool and are merged in the same order as
+ * the single threaded match().
+ *
+ * match() may be called concurrently, but add() and remove() must not be
+ * called concurrently with anything else.
+ */
+class __attribute__((visibility("default")))
+SelectorSet {
+    struct State;
+    std::unique_ptr<State> state;
+
+public:
+    typedef std::size_t Id;
+
+    SelectorSet();
+    ~SelectorSet();
+
+    Id add(const Expression&);
+    // Returns false if id isn't in the set
+    bool remove(Id);
+    std::size_t size() const;
+
+    // Set ids to the ids of the selectors that are TRUE for env in increasing order
+    void match(const Env& env, std::vector<Id>& ids) const;
+    // The same, evaluating the candidate selectors on pool's threads
+    void match(const Env& env, std::vector<Id>& ids, ThreadPool& pool) const;
+    // Set ids[i] to the matches for *envs[i], matching the messages on pool's threads
+    void match(const std::vector<const Env*>& envs, std::vector<std::vector<Id>>& ids, ThreadPool& pool) const;
+};
+
+}
+
+#endif
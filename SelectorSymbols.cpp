@@ -0,0 +1,52 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorSymbols.h"
+
+#include <string>
+
+namespace selector {
+
+constexpr std::size_t SymbolTable::npos;
+
+std::size_t SymbolTable::bind(const std::string& identifier)
+{
+    auto i = slots.find(identifier);
+    if (i!=slots.end()) return i->second;
+
+    std::size_t s = names.size();
+    i = slots.emplace(identifier, s).first;
+    names.push_back(&i->first);
+    return s;
+}
+
+std::size_t SymbolTable::slot(const std::string& identifier) const
+{
+    auto i = slots.find(identifier);
+    return i!=slots.end() ? i->second : npos;
+}
+
+const std::string& SymbolTable::intern(const std::string& s)
+{
+    return *strings.insert(s).first;
+}
+
+}
@@ -0,0 +1,80 @@
+#ifndef SELECTOR_SYMBOLS_H
+#define SELECTOR_SYMBOLS_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace selector {
+
+/**
+ * Assigns each distinct identifier used by a selector a small integer slot.
+ *
+ * The same SymbolTable can be given to make_selector for many selectors so that
+ * they all share one slot numbering. The table must outlive any selectors bound
+ * to it and is not safe to modify from multiple threads at once.
+ *
+ * The selectors bound to a table also share its copies of their identifier
+ * names and string literals rather than each keeping its own, so a large
+ * population of similar selectors holds each distinct string once.
+ */
+class __attribute__((visibility("default")))
+SymbolTable {
+    // The keys of slots, which never move
+    std::vector<const std::string*> names;
+    std::unordered_map<std::string, std::size_t> slots;
+    std::unordered_set<std::string> strings;
+
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+public:
+    static constexpr std::size_t npos = std::size_t(-1);
+
+    SymbolTable() = default;
+
+    // Return the slot for identifier, assigning the next free slot if it is new
+    std::size_t bind(const std::string& identifier);
+
+    // Return the slot for identifier or npos if it has never been bound
+    std::size_t slot(const std::string& identifier) const;
+
+    // The name bound to slot, which lasts as long as the table
+    const std::string& name(std::size_t slot) const {
+        return *names[slot];
+    }
+
+    // Return the table's own copy of s, which lasts as long as the table
+    const std::string& intern(const std::string& s);
+
+    std::size_t size() const {
+        return names.size();
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef SELECTOR_TERMS_H
+#define SELECTOR_TERMS_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorAnalysis.h"
+#include "SelectorValue.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+class Expression;
+
+/**
+ * One of the terms of a selector, all of which must be TRUE for the selector
+ * to be TRUE.
+ *
+ * Terms that compare a single identifier with constants are described so that
+ * they can be looked up in an index; the index only needs to find a superset
+ * of the terms that are TRUE as every term is still evaluated.
+ */
+struct SelectorTerm {
+    enum Kind {
+        OTHER,
+        EQUAL,      // identifier = values[0]
+        IN,         // identifier IN values
+        RANGE       // identifier is numeric and within [lower, upper]
+    };
+
+    // Points into the selector the term came from
+    const Expression* expression;
+    Kind kind;
+    std::string identifier;
+    std::size_t slot;
+    // Any strings belong to the selector the term came from
+    std::vector<Value> values;
+    double lower;
+    double upper;
+
+    explicit SelectorTerm(const Expression* e) :
+        expression(e),
+        kind(OTHER),
+        slot(0),
+        lower(0),
+        upper(0)
+    {}
+};
+
+/**
+ * A node of the boolean structure of a selector: AND, OR and NOT over leaf
+ * expressions that compute a truth value some other way.
+ */
+struct SelectorNode {
+    enum Kind {
+        LEAF,
+        AND,
+        OR,
+        NOT
+    };
+
+    Kind kind;
+    // For a LEAF; points into the selector the node came from
+    const Expression* expression;
+    // Indexes of the operand nodes, always before this one
+    std::vector<std::size_t> operands;
+
+    SelectorNode(Kind k, const Expression* e) :
+        kind(k),
+        expression(e)
+    {}
+};
+
+// Append the nodes of selector e to nodes and return the index of its root,
+// which is the last
+std::size_t selectorNodes(const Expression& e, std::vector<SelectorNode>& nodes);
+
+// Append the terms of selector e to terms
+void selectorTerms(const Expression& e, std::vector<SelectorTerm>& terms);
+
+// What selector e evaluates to whenever identifier has no value
+SelectorAnalysis::Missing selectorMissing(const Expression& e, const std::string& identifier);
+
+// The same for any two expressions that compute the same thing in the same
+// way, and different for any others
+std::string selectorKey(const Expression& e);
+
+}
+
+#endif
@@ -19,24 +19,75 @@
  *
  */
 
+#include "SelectorAnalysis.h"
+#include "SelectorArena.h"
+#include "SelectorCache.h"
 #include "SelectorExpression.h"
 #include "SelectorEnv.h"
+#include "SelectorIncremental.h"
+#include "SelectorJit.h"
+#include "SelectorPipeline.h"
+#include "SelectorProfile.h"
+#include "SelectorRingBuffer.h"
+#include "SelectorSet.h"
+#include "SelectorSymbols.h"
+#include "SelectorThreadPool.h"
 #include "SelectorToken.h"
 #include "SelectorValue.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
 #include <string>
+#include <limits>
 #include <map>
 #include <memory>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 
 #define BOOST_TEST_MAIN
 #include <boost/test/included/unit_test.hpp>
 
+// BOOST_MESSAGE was removed from newer Boost.Test releases
+#ifndef BOOST_MESSAGE
+#define BOOST_MESSAGE BOOST_TEST_MESSAGE
+#endif
+
 using std::string;
 using std::make_unique;
 using std::map;
 using std::unique_ptr;
 using std::vector;
 
+// Counts the allocations made by the current thread while counting is on, so
+// that tests can check that evaluation doesn't allocate
+namespace {
+thread_local bool countAllocations = false;
+thread_local std::size_t allocations = 0;
+
+void* allocate(std::size_t n)
+{
+    if (countAllocations) ++allocations;
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+}
+
+void* operator new(std::size_t n) { return allocate(n); }
+void* operator new[](std::size_t n) { return allocate(n); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+    if (countAllocations) ++allocations;
+    return std::malloc(n ? n : 1);
+}
+void* operator new[](std::size_t n, const std::nothrow_t& t) noexcept { return operator new(n, t); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
 namespace selector {
 namespace tests {
 
@@ -211,6 +262,39 @@ BOOST_AUTO_TEST_CASE(tokeniseFailure)
     verifyTokeniserFail(&tokenise, "0X_34Longer");
 }
 
+BOOST_AUTO_TEST_CASE(reservedWords)
+{
+    const std::pair<const char*, TokenType> words[] = {
+        {"and", selector::T_AND}, {"between", selector::T_BETWEEN}, {"escape", selector::T_ESCAPE},
+        {"false", selector::T_FALSE}, {"in", selector::T_IN}, {"is", selector::T_IS},
+        {"like", selector::T_LIKE}, {"not", selector::T_NOT}, {"null", selector::T_NULL},
+        {"or", selector::T_OR}, {"true", selector::T_TRUE}
+    };
+    for (auto& w : words) {
+        string lower(w.first);
+        string upper(lower), mixed(lower);
+        for (std::size_t i = 0; i<lower.size(); ++i) {
+            upper[i] = char(lower[i] - 'a' + 'A');
+            if (i%2) mixed[i] = upper[i];
+        }
+        verifyTokeniserSuccess(&tokenise, lower.c_str(), w.second, lower.c_str(), "");
+        verifyTokeniserSuccess(&tokenise, (upper + " x").c_str(), w.second, upper.c_str(), " x");
+        verifyTokeniserSuccess(&tokenise, (mixed + "(").c_str(), w.second, mixed.c_str(), "(");
+        // Same length or first letter but not a reserved word
+        string other(lower);
+        other.back() = other.back()=='z' ? 'y' : 'z';
+        verifyTokeniserSuccess(&tokenise, other.c_str(), selector::T_IDENTIFIER, other.c_str(), "");
+        verifyTokeniserSuccess(&tokenise, (lower + "s").c_str(), selector::T_IDENTIFIER, (lower + "s").c_str(), "");
+        verifyTokeniserSuccess(&tokenise, lower.substr(1).c_str(), selector::T_IDENTIFIER, lower.substr(1).c_str(), "");
+    }
+
+    // Only ASCII is significant whatever the locale
+    verifyTokeniserSuccess(&tokenise, "\t\n\r\v\f a", selector::T_IDENTIFIER, "a", "");
+    verifyTokeniserFail(&tokenise, "\xe9t\xe9");
+    verifyTokeniserSuccess(&tokenise, "a\xe9", selector::T_IDENTIFIER, "a", "\xe9");
+    verifyTokeniserSuccess(&tokenise, "0xfF_1g", selector::T_NUMERIC_EXACT, "0xfF_1", "g");
+}
+
 BOOST_AUTO_TEST_CASE(tokenString)
 {
 
@@ -366,6 +450,10 @@ public:
 bool eval_selector(const string& s, const TestSelectorEnv& e)
 {
     auto exp = test_selector(s);
+    // The compiled form must always agree with the expression tree
+    auto p = compile(*exp);
+    BOOST_MESSAGE("  Compiled: " << *p);
+    BOOST_CHECK_EQUAL(p->eval_bool(e), exp->eval_bool(e));
     return eval(*exp, e);
 }
 
@@ -435,6 +523,12 @@ BOOST_AUTO_TEST_CASE(numericEval)
     BOOST_CHECK(!eval_selector("A/0=0", env));
     BOOST_CHECK(eval_selector("A*B+19<A*(B+19)", env));
     BOOST_CHECK(eval_selector("-A=0-A", env));
+    // Arithmetic on anything but two numbers is unknown
+    BOOST_CHECK(eval_selector("(1 / C) IS NULL", env));
+    BOOST_CHECK(eval_selector("(C * B) IS NULL", env));
+    BOOST_CHECK(eval_selector("(B + TRUE) IS NULL", env));
+    BOOST_CHECK(eval_selector("(A - 'hello') IS NULL", env));
+    BOOST_CHECK(eval_selector("('hello' / B) IS NULL", env));
 }
 
 BOOST_AUTO_TEST_CASE(numericLiterals)
@@ -460,6 +554,43 @@ BOOST_AUTO_TEST_CASE(numericLiterals)
     BOOST_CHECK(eval_selector(" 077L=63", env));
 }
 
+BOOST_AUTO_TEST_CASE(tokenViews)
+{
+    const string s("name = 'plain' OR \"odd \"\"id\"\"\" <> 'it''s' OR n = 1_000_000");
+    Tokeniser t(s.begin(), s.end());
+    auto inInput = [&s](const Token& tok) {
+        return tok.val.data()>=s.data() && tok.val.data()<s.data()+s.size();
+    };
+
+    // Only text that had to be unescaped isn't a view of the input
+    Token name = t.nextToken();
+    BOOST_CHECK(inInput(name));
+    BOOST_CHECK_EQUAL(name, Token(selector::T_IDENTIFIER, "name"));
+    t.nextToken();
+    BOOST_CHECK(inInput(t.nextToken()));
+    t.nextToken();
+    Token odd = t.nextToken();
+    BOOST_CHECK(!inInput(odd));
+    t.nextToken();
+    Token its = t.nextToken();
+    BOOST_CHECK(!inInput(its));
+
+    // Copies of unescaped tokens have their own text
+    Token copy(its);
+    its = odd;
+    BOOST_CHECK_EQUAL(copy, Token(selector::T_STRING, "it's"));
+    BOOST_CHECK_EQUAL(its, Token(selector::T_IDENTIFIER, "odd \"id\""));
+    BOOST_CHECK(its.val.data()!=odd.val.data());
+
+    for (int i = 0; i<3; ++i) t.nextToken();
+    BOOST_CHECK_EQUAL(t.nextToken(), Token(selector::T_NUMERIC_EXACT, "1_000_000"));
+
+    TestSelectorEnv env;
+    env.set("odd \"id\"", "its");
+    env.set("n", selector::Value(int64_t(1000000)));
+    BOOST_CHECK(eval_selector(s, env));
+}
+
 BOOST_AUTO_TEST_CASE(comparisonEval)
 {
     TestSelectorEnv env;
@@ -471,6 +602,12 @@ BOOST_AUTO_TEST_CASE(comparisonEval)
     BOOST_CHECK(!eval_selector("'hello'>42 and 'hello'<42 and 'hello'=42 and 'hello'<>42", env));
     BOOST_CHECK(eval_selector("20 >= 19.0 and 20 > 19", env));
     BOOST_CHECK(eval_selector("42 <= 42.0 and 37.0 >= 37", env));
+    // Values of different types are never in order
+    BOOST_CHECK(!eval_selector("3 >= TRUE", env));
+    BOOST_CHECK(!eval_selector("TRUE < 3", env));
+    BOOST_CHECK(!eval_selector("'hello' <= 3.5", env));
+    BOOST_CHECK(!eval_selector("TRUE > 'hello'", env));
+    BOOST_CHECK(eval_selector("NOT 3 >= TRUE AND NOT 'hello' > FALSE", env));
     BOOST_CHECK(eval_selector("(A IN ('hello', 'there', 1 , true, (1-17))) IS NULL", env));
     BOOST_CHECK(eval_selector("(-16 IN ('hello', A, 'there', true)) IS NULL", env));
     BOOST_CHECK(eval_selector("(-16 NOT IN ('hello', 'there', A, true)) IS NULL", env));
@@ -504,6 +641,35 @@ BOOST_AUTO_TEST_CASE(comparisonEval)
     BOOST_CHECK(eval_selector("14 BETWEEN -11 and 54367", env));
 }
 
+BOOST_AUTO_TEST_CASE(typedComparisons)
+{
+    // The tree specialises identifier/literal comparisons, the compiled form doesn't
+    const char* literals[] = {"0", "-7", "100", "9007199254740993", "2.5", "-0.0", "1e300", "'EU'", "''", "TRUE"};
+    const char* ops[] = {"=", "<>", "<", ">", "<=", ">="};
+    const string eu("EU"), other("ORDER_NEW"), empty;
+    const selector::Value values[] = {
+        selector::Value(), int64_t(0), int64_t(-7), int64_t(100), int64_t(101), int64_t(9007199254740993),
+        int64_t(9007199254740992), 0.0, -0.0, 2.5, 99.5, 1e300, std::numeric_limits<double>::quiet_NaN(),
+        eu, hashed(eu), other, empty, true, false
+    };
+    for (auto l : literals) for (auto op : ops) for (int flip = 0; flip<2; ++flip) {
+        const string sel = flip ? string(l) + " " + op + " A" : string("A ") + op + " " + l;
+        auto e = make_selector(sel);
+        auto p = compile(*e);
+        for (auto& v : values) {
+            struct OneEnv : public Env {
+                selector::Value v;
+                const selector::Value& value(const string&) const { return v; }
+            } env;
+            env.v = v;
+            BOOST_CHECK_MESSAGE(e->eval_bool(env)==p->eval_bool(env), sel << " with " << v);
+        }
+    }
+    std::ostringstream o;
+    o << *make_selector("3 > A");
+    BOOST_CHECK_EQUAL(o.str(), "(EXACT:3>I:A)");
+}
+
 BOOST_AUTO_TEST_CASE(NullEval)
 {
     TestSelectorEnv env;
@@ -518,6 +684,1621 @@ BOOST_AUTO_TEST_CASE(NullEval)
     BOOST_CHECK(eval_selector("P > 19.0 or 17 <= 19.0", env));
 }
 
+class TestSlotEnv : public SlotEnv {
+    SymbolTable& symbols;
+    vector<selector::Value> values;
+    vector<unique_ptr<string>> strings;
+    static const selector::Value EMPTY;
+
+    const selector::Value& value(std::size_t slot) const {
+        const selector::Value& r = slot<values.size() ? values[slot] : EMPTY;
+        BOOST_MESSAGE("  Slot: " << slot << " -> " << r);
+        return r;
+    }
+
+public:
+    TestSlotEnv(SymbolTable& s) :
+        SlotEnv(s),
+        symbols(s)
+    {}
+
+    void set(const string& id, const char* value) {
+        strings.push_back(make_unique<string>(value));
+        set(id, selector::Value(*strings[strings.size()-1]));
+    }
+
+    void set(const string& id, const selector::Value& value) {
+        std::size_t slot = symbols.bind(id);
+        if (slot>=values.size()) values.resize(slot+1);
+        values[slot] = value;
+    }
+};
+
+const selector::Value TestSlotEnv::EMPTY;
+
+string repr(const Expression& e)
+{
+    std::ostringstream o;
+    o << e;
+    return o.str();
+}
+
+string simplified(const string& s)
+{
+    return repr(*test_selector(s));
+}
+
+BOOST_AUTO_TEST_CASE(simplifySelectors)
+{
+    // Constants are folded
+    BOOST_CHECK_EQUAL(simplified("17/4>-4"), simplified("TRUE"));
+    BOOST_CHECK_EQUAL(simplified("A IN (1-17, 3*2)"), simplified("A IN (-16, 6)"));
+    BOOST_CHECK_EQUAL(simplified("A > -2.5"), simplified("A > (0-2.5)"));
+    BOOST_CHECK_EQUAL(simplified("'abc' LIKE 'a%' AND 'x' NOT IN ('y', 1)"), simplified("FALSE"));
+    // Boolean identities
+    BOOST_CHECK_EQUAL(simplified("NOT NOT (A > 1)"), simplified("A > 1"));
+    BOOST_CHECK_EQUAL(simplified("TRUE AND A > 1"), simplified("A > 1"));
+    BOOST_CHECK_EQUAL(simplified("A > 1 AND 2 > 1"), simplified("A > 1"));
+    BOOST_CHECK_EQUAL(simplified("A > 1 AND FALSE"), simplified("FALSE"));
+    BOOST_CHECK_EQUAL(simplified("A > 1 OR 1 = 1"), simplified("TRUE"));
+    BOOST_CHECK_EQUAL(simplified("FALSE OR A LIKE 'x'"), simplified("A LIKE 'x'"));
+    BOOST_CHECK_EQUAL(simplified("A BETWEEN 1 AND 1.0"), simplified("A = 1"));
+    // Not if that would change the value of a non boolean operand
+    BOOST_CHECK(simplified("TRUE AND A")!=simplified("A"));
+    BOOST_CHECK(simplified("NOT NOT A")!=simplified("A"));
+    BOOST_CHECK(simplified("A BETWEEN 'a' AND 'a'")!=simplified("A = 'a'"));
+    // Integer division is never folded if it would trap
+    BOOST_CHECK_NO_THROW(test_selector("A = 1/0 OR A IN (2, 3/0)"));
+
+    TestSelectorEnv env;
+    env.set("A", selector::Value(int64_t(5)));
+    env.set("B", "5");
+    BOOST_CHECK(!eval_selector("TRUE AND A", env));
+    BOOST_CHECK(!eval_selector("NOT NOT A", env));
+    BOOST_CHECK(!eval_selector("(NOT NOT A) = 5", env));
+    BOOST_CHECK(!eval_selector("(TRUE AND A) = 5", env));
+    BOOST_CHECK(eval_selector("(TRUE AND A > 4) = TRUE", env));
+    BOOST_CHECK(eval_selector("A BETWEEN 5 AND 5.0", env));
+    BOOST_CHECK(!eval_selector("B BETWEEN '5' AND '5'", env));
+    BOOST_CHECK(eval_selector("B = '5' OR 1/0 = 1", env));
+}
+
+BOOST_AUTO_TEST_CASE(reorderOperands)
+{
+    // Cheap and selective operands first
+    BOOST_CHECK_EQUAL(simplified("S LIKE '%abc%' AND R = 'EU'"), simplified("R = 'EU' AND S LIKE '%abc%'"));
+    BOOST_CHECK_EQUAL(simplified("S LIKE '%abc%' AND R = 'EU'").find("(I:R"), 1u);
+    BOOST_CHECK_EQUAL(simplified("S LIKE '%abc%' AND (R = 'EU' AND A IS NULL)"),
+                      simplified("A IS NULL AND R = 'EU' AND S LIKE '%abc%'"));
+    BOOST_CHECK_EQUAL(simplified("A IN (1, 2, 3, 4, 5, 6, 7, 8, 9, 10) OR B IS NOT NULL"),
+                      simplified("B IS NOT NULL OR A IN (1, 2, 3, 4, 5, 6, 7, 8, 9, 10)"));
+    // Nothing moves across an operand that might trap
+    BOOST_CHECK_EQUAL(simplified("S LIKE '%x%' AND A <> 0 AND B/A > 1 AND C LIKE '%x%' AND A IS NULL"),
+                      simplified("((A <> 0 AND S LIKE '%x%') AND B/A > 1) AND (A IS NULL AND C LIKE '%x%')"));
+
+    TestSelectorEnv env;
+    env.set("A", selector::Value(int64_t(0)));
+    env.set("B", selector::Value(int64_t(1)));
+    BOOST_CHECK(!eval_selector("A <> 0 AND B/A > 1", env));
+    BOOST_CHECK(eval_selector("A = 0 OR B/A > 1", env));
+}
+
+BOOST_AUTO_TEST_CASE(adaptiveEval)
+{
+    // Statically A and B are equally good but B = 2 is nearly always FALSE
+    const string sel("A = 1 AND B = 2");
+    auto adaptive = make_adaptive_selector(sel);
+    auto fixed = make_selector(sel);
+    BOOST_CHECK_EQUAL(simplified(sel).find("(I:A"), 1u);
+    for (int i = 0; i<2000; ++i) {
+        TestSelectorEnv env;
+        env.set("A", selector::Value(int64_t(1)));
+        if (i%10) env.set("B", selector::Value(int64_t(i)));
+        else if (i%20) env.set("B", selector::Value(int64_t(2)));
+        BOOST_CHECK_EQUAL(adaptive->eval_bool(env), fixed->eval_bool(env));
+    }
+    BOOST_CHECK_EQUAL(repr(*adaptive).find("(I:B"), 1u);
+    BOOST_CHECK_EQUAL(repr(*compile(*adaptive)), repr(*compile(*fixed)));
+}
+
+BOOST_AUTO_TEST_CASE(naryJunctions)
+{
+    BOOST_CHECK_EQUAL(simplified("A=1 AND (B=2 AND (C=3 AND D=4))"), simplified("A=1 AND B=2 AND C=3 AND D=4"));
+    BOOST_CHECK_EQUAL(simplified("(A=1 OR B=2) OR (C=3 OR D=4)"), simplified("A=1 OR B=2 OR C=3 OR D=4"));
+    BOOST_CHECK_EQUAL(simplified("A=1 AND (B=2 OR C=3)"), "((I:A==EXACT:1) AND ((I:B==EXACT:2) OR (I:C==EXACT:3)))");
+
+    // Long generated chains are a single node
+    string chain("A > 0");
+    for (int i = 1; i<5000; ++i) chain += (i%2 ? " AND A <> " : " AND NOT A = ") + std::to_string(i);
+    TestSelectorEnv env;
+    env.set("A", selector::Value(int64_t(5000)));
+    BOOST_CHECK(eval_selector(chain, env));
+    env.set("A", selector::Value(int64_t(4999)));
+    BOOST_CHECK(!eval_selector(chain, env));
+    BOOST_CHECK_EQUAL(make_selector(chain)->eval_bool(TestSelectorEnv()), BN_UNKNOWN);
+
+    // Adaptive ordering of many operands
+    auto adaptive = make_adaptive_selector("A = 1 OR B = 2 OR C = 3 OR D = 4");
+    for (int i = 0; i<1000; ++i) {
+        TestSelectorEnv e;
+        e.set("C", selector::Value(int64_t(i%4 ? 3 : 4)));
+        BOOST_CHECK_EQUAL(adaptive->eval_bool(e), i%4 ? BN_TRUE : BN_UNKNOWN);
+    }
+    BOOST_CHECK_EQUAL(repr(*adaptive).find("(I:C"), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(selectorSet)
+{
+    const char* selectors[] = {
+        "A = 1",
+        "A = 1 AND B = 'x'",
+        "B = 'x' AND A = 1.0",
+        "A IN (1, 2, 3) AND C",
+        "A > 2",
+        "3 >= A AND B <> 'y'",
+        "A BETWEEN 2 AND 4 AND B LIKE 'x%'",
+        "A BETWEEN 2 AND 4 OR B = 'y'",
+        "NOT A = 1",
+        "B IS NULL",
+        "B IN ('x', 'z') AND A < 0",
+        // Prints like the list above
+        "B IN ('x'', ''z') AND A < 0",
+        "C = TRUE AND A = -0.0",
+        "C AND C",
+        "A = 1 AND A = 2",
+        "TRUE",
+        "A <> 0 AND 4 / A = 2"
+    };
+    const std::size_t count = sizeof(selectors)/sizeof(selectors[0]);
+
+    SelectorSet set;
+    vector<unique_ptr<Expression>> exps;
+    vector<SelectorSet::Id> ids;
+    for (auto sel : selectors) {
+        exps.push_back(make_selector(sel));
+        ids.push_back(set.add(*exps.back()));
+    }
+    BOOST_CHECK_EQUAL(set.size(), count);
+
+    const string one("1");
+    const selector::Value as[] = {
+        selector::Value(), int64_t(0), 0.0, int64_t(1), 1.0, int64_t(2), 2.5,
+        int64_t(3), int64_t(4), 4.0, int64_t(5), -1.0, one, true
+    };
+    const char* bs[] = {0, "x", "y", "z", "xyz"};
+    const selector::Value cs[] = {selector::Value(), true, false, int64_t(1)};
+
+    auto check = [&](const SelectorSet& set, const vector<SelectorSet::Id>& ids, const vector<bool>& present) {
+        for (auto& a : as) for (auto b : bs) for (auto& c : cs) {
+            TestSelectorEnv env;
+            if (!unknown(a)) env.set("A", a);
+            if (b) env.set("B", b);
+            if (!unknown(c)) env.set("C", c);
+            vector<SelectorSet::Id> expected;
+            for (std::size_t i = 0; i<count; ++i) {
+                if (present[i] && eval(*exps[i], env)) expected.push_back(ids[i]);
+            }
+            std::sort(expected.begin(), expected.end());
+            vector<SelectorSet::Id> matched;
+            set.match(env, matched);
+            BOOST_CHECK_EQUAL_COLLECTIONS(matched.begin(), matched.end(), expected.begin(), expected.end());
+        }
+    };
+    vector<bool> present(count, true);
+    check(set, ids, present);
+
+    // Remove every other selector, then put them back
+    for (std::size_t i = 0; i<count; i += 2) {
+        BOOST_CHECK(set.remove(ids[i]));
+        BOOST_CHECK(!set.remove(ids[i]));
+        present[i] = false;
+    }
+    BOOST_CHECK_EQUAL(set.size(), count/2);
+    check(set, ids, present);
+    for (std::size_t i = 0; i<count; i += 2) {
+        ids[i] = set.add(*exps[i]);
+        present[i] = true;
+    }
+    check(set, ids, present);
+
+    // Compiled selectors are added whole, and told apart however they print
+    SelectorSet programs;
+    SymbolTable symbols;
+    vector<unique_ptr<Expression>> compiled;
+    vector<SelectorSet::Id> programIds;
+    for (std::size_t i = 0; i<count; ++i) {
+        string saved;
+        save_selector(*exps[i], saved);
+        switch (i%4) {
+        case 0: compiled.push_back(compile(*exps[i])); break;
+        case 1: compiled.push_back(load_selector(saved.data(), saved.size())); break;
+        case 2: compiled.push_back(make_compact_selector(selectors[i], symbols)); break;
+        default: compiled.push_back(make_jit_selector(*exps[i], 0)); break;
+        }
+        programIds.push_back(programs.add(*compiled.back()));
+    }
+    BOOST_CHECK_EQUAL(programs.size(), count);
+    check(programs, programIds, present);
+
+    // Many overlapping ranges, added and removed
+    SelectorSet ranges;
+    vector<SelectorSet::Id> rangeIds;
+    for (int i = 0; i<200; ++i) {
+        auto e = make_selector("A BETWEEN " + std::to_string(i) + " AND " + std::to_string(i + i%17));
+        rangeIds.push_back(ranges.add(*e));
+    }
+    for (int i = 0; i<200; i += 3) ranges.remove(rangeIds[i]);
+    for (int v = -1; v<220; ++v) {
+        TestSelectorEnv env;
+        env.set("A", selector::Value(int64_t(v)));
+        vector<SelectorSet::Id> expected;
+        for (int i = 0; i<200; ++i) {
+            if (i%3 && i<=v && v<=i + i%17) expected.push_back(rangeIds[i]);
+        }
+        vector<SelectorSet::Id> matched;
+        ranges.match(env, matched);
+        BOOST_CHECK_EQUAL_COLLECTIONS(matched.begin(), matched.end(), expected.begin(), expected.end());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(selectorAnalysis)
+{
+    auto a = analyse(*make_selector("region IN ('EU', 'US', 'ASIA') AND region <> 'x' AND price BETWEEN 10 AND 20 AND "
+                                    "price > 12 AND qty IN (1, 2.0, 30) AND qty < 5 AND (flag OR note IS NULL)"));
+    BOOST_CHECK(!a.never);
+    BOOST_REQUIRE_EQUAL(a.identifiers.size(), 5u);
+    const SelectorAnalysis::Identifier* region = a.find("region");
+    BOOST_REQUIRE(region);
+    BOOST_CHECK(region->restricted);
+    BOOST_CHECK(!region->ranged);
+    BOOST_CHECK_EQUAL(region->strings.size(), 3u);
+    BOOST_CHECK_EQUAL(region->missing, SelectorAnalysis::MISSING_NOT_TRUE);
+    const SelectorAnalysis::Identifier* price = a.find("price");
+    BOOST_REQUIRE(price);
+    BOOST_CHECK(price->ranged && !price->restricted);
+    BOOST_CHECK_EQUAL(price->lower, 12);
+    BOOST_CHECK_EQUAL(price->upper, 20);
+    const SelectorAnalysis::Identifier* qty = a.find("qty");
+    BOOST_REQUIRE(qty);
+    BOOST_CHECK(qty->restricted && qty->ranged);
+    BOOST_REQUIRE_EQUAL(qty->numbers.size(), 2u);
+    BOOST_CHECK_EQUAL(qty->numbers[1], 2);
+    BOOST_CHECK_EQUAL(a.find("flag")->missing, SelectorAnalysis::MISSING_ANY);
+    BOOST_CHECK(!a.find("flag")->restricted && !a.find("flag")->ranged);
+    BOOST_CHECK_EQUAL(a.find("note")->missing, SelectorAnalysis::MISSING_ANY);
+    BOOST_CHECK(!a.find("other"));
+
+    // Contradictions
+    BOOST_CHECK(analyse(*make_selector("A = 1 AND A = 2")).never);
+    BOOST_CHECK(analyse(*make_selector("A > 5 AND A < 3")).never);
+    BOOST_CHECK(analyse(*make_selector("A = 'x' AND A > 3")).never);
+    BOOST_CHECK(!analyse(*make_selector("A = 1 OR A = 2")).never);
+    BOOST_CHECK(!analyse(*make_selector("A = 1 OR A = 2")).find("A")->restricted);
+
+    // What a missing property does
+    auto missing = [](const char* s, const char* id) {
+        return analyse(*make_selector(s)).find(id)->missing;
+    };
+    BOOST_CHECK_EQUAL(missing("A + 1 > B", "A"), SelectorAnalysis::MISSING_UNKNOWN);
+    BOOST_CHECK_EQUAL(missing("NOT (A LIKE 'x%')", "A"), SelectorAnalysis::MISSING_UNKNOWN);
+    BOOST_CHECK_EQUAL(missing("A = 1 OR B = 1", "A"), SelectorAnalysis::MISSING_ANY);
+    BOOST_CHECK_EQUAL(missing("A = 1 OR A IN (2, 3)", "A"), SelectorAnalysis::MISSING_UNKNOWN);
+    BOOST_CHECK_EQUAL(missing("A = 1 OR A IS NOT NULL", "A"), SelectorAnalysis::MISSING_NOT_TRUE);
+    BOOST_CHECK_EQUAL(missing("A = 1 AND B = 2", "A"), SelectorAnalysis::MISSING_NOT_TRUE);
+    BOOST_CHECK_EQUAL(missing("NOT (A = 1 AND B = 2)", "A"), SelectorAnalysis::MISSING_ANY);
+    BOOST_CHECK_EQUAL(missing("A IS NULL", "A"), SelectorAnalysis::MISSING_ANY);
+    BOOST_CHECK_EQUAL(missing("B BETWEEN A AND 3", "A"), SelectorAnalysis::MISSING_UNKNOWN);
+
+    // Compiled selectors only list their identifiers
+    auto c = analyse(*compile(*make_selector("A = 1 AND B > 2 AND A < 3")));
+    BOOST_REQUIRE_EQUAL(c.identifiers.size(), 2u);
+    BOOST_CHECK(!c.identifiers[0].restricted);
+    BOOST_CHECK_EQUAL(c.identifiers[0].missing, SelectorAnalysis::MISSING_ANY);
+}
+
+BOOST_AUTO_TEST_CASE(selectorCache)
+{
+    SelectorCache cache(2);
+    auto e1 = cache.get("A = 1 and B");
+    BOOST_CHECK(cache.get("A=1   AND  B")==e1);
+    BOOST_CHECK(cache.get("\"A\" = 1 And B")==e1);
+    BOOST_CHECK(cache.get("a = 1 AND B")!=e1);
+    BOOST_CHECK(cache.get("A = '1' AND B")!=e1);
+    BOOST_CHECK_EQUAL(cache.hits(), 2u);
+    BOOST_CHECK_EQUAL(cache.misses(), 3u);
+    BOOST_CHECK_EQUAL(cache.size(), 2u);
+
+    // e1 was least recently used so has gone, but is still usable
+    BOOST_CHECK(cache.get("A = 1 AND B")!=e1);
+    TestSelectorEnv env;
+    env.set("A", selector::Value(int64_t(1)));
+    env.set("B", selector::Value(true));
+    BOOST_CHECK(eval(*e1, env));
+
+    BOOST_CHECK_THROW(cache.get("A = "), std::range_error);
+    BOOST_CHECK_THROW(cache.get("A = "), std::range_error);
+    BOOST_CHECK_EQUAL(cache.size(), 2u);
+    cache.clear();
+    BOOST_CHECK_EQUAL(cache.size(), 0u);
+
+    SelectorCache none(0);
+    BOOST_CHECK(none.get("A")!=none.get("A"));
+    BOOST_CHECK_EQUAL(none.size(), 0u);
+
+    // Concurrent lookups of a few selectors
+    SelectorCache shared(8);
+    vector<std::thread> threads;
+    vector<int> found(4, 0);
+    for (int t = 0; t<4; ++t) {
+        threads.emplace_back([&shared, &found, t] {
+            for (int i = 0; i<500; ++i) {
+                if (shared.get("A > " + std::to_string((i+t)%4))) ++found[t];
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    for (int f : found) BOOST_CHECK_EQUAL(f, 500);
+    BOOST_CHECK_EQUAL(shared.hits() + shared.misses(), 2000u);
+    BOOST_CHECK_EQUAL(shared.size(), 4u);
+}
+
+BOOST_AUTO_TEST_CASE(arena)
+{
+    Arena arena(64);
+    vector<std::pair<char*, std::size_t>> blocks;
+    for (std::size_t i = 0; i<200; ++i) {
+        const std::size_t n = 1 + (i*37) % 300;
+        const std::size_t align = std::size_t(1) << (i % 5);
+        char* p = static_cast<char*>(arena.allocate(n, align));
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(p) % align, 0u);
+        std::fill(p, p+n, char(i));
+        blocks.push_back(std::make_pair(p, n));
+    }
+    // Nothing was overwritten by a later allocation
+    for (std::size_t i = 0; i<blocks.size(); ++i) {
+        BOOST_CHECK(std::count(blocks[i].first, blocks[i].first+blocks[i].second, char(i))==long(blocks[i].second));
+    }
+    BOOST_CHECK(arena.reserved() >= arena.allocated());
+
+    // A selector's nodes and any long strings outlive the text parsed
+    unique_ptr<Expression> e;
+    {
+        string text("A = 'a string too long to fit inside a std::string object' OR B LIKE '%x%'");
+        e = make_selector(text);
+    }
+    TestSelectorEnv env;
+    env.set("A", "a string too long to fit inside a std::string object");
+    BOOST_CHECK(eval(*e, env));
+    BOOST_CHECK(eval(*compile(*e), env));
+}
+
+BOOST_AUTO_TEST_CASE(hashedStrings)
+{
+    StringPool pool;
+    const string eu("EU");
+    selector::Value a = pool.intern(eu);
+    selector::Value b = pool.intern(string("E") + "U");
+    BOOST_CHECK_EQUAL(a.s, b.s);
+    BOOST_CHECK_EQUAL(pool.size(), 1u);
+    BOOST_CHECK(a.hash!=0);
+    pool.intern("US");
+    BOOST_CHECK_EQUAL(pool.size(), 2u);
+
+    const string other("EU");
+    const selector::Value plain(other);
+    const selector::Value hashedPlain = hashed(other);
+    BOOST_CHECK_EQUAL(plain.hash, 0u);
+    BOOST_CHECK_EQUAL(hashedPlain.hash, a.hash);
+
+    // Values from a pool evaluate like any other strings, hashed or not
+    struct PoolEnv : public Env {
+        map<string, selector::Value> values;
+        const selector::Value& value(const string& id) const {
+            static const selector::Value none;
+            auto i = values.find(id);
+            return i==values.end() ? none : i->second;
+        }
+    } env;
+    env.values["B"] = plain;
+    env.values["C"] = hashedPlain;
+    const char* selectors[] = {
+        "A = B", "A <> B", "A = C", "B = C", "A <> C", "A IN (B, C)",
+        "A = 'EU'", "A <> 'EU'", "'US' = A", "A IN ('EU', 'US')", "A NOT IN ('UK', 'FR')",
+        "A IN ('a0', 'a1', 'a2', 'a3', 'a4', 'a5', 'a6', 'a7', 'a8', 'a9', 'b0', 'b1', 'b2', 'b3', 'b4', 'b5', 'b6', 'US')"
+    };
+    const char* values[] = {"EU", "US", "UK", "b3", ""};
+    for (auto sel : selectors) {
+        auto e = make_selector(sel);
+        auto p = compile(*e);
+        for (auto v : values) {
+            TestSelectorEnv plainEnv;
+            plainEnv.set("A", v);
+            plainEnv.set("B", "EU");
+            plainEnv.set("C", "EU");
+            env.values["A"] = pool.intern(v);
+            BOOST_CHECK_EQUAL(e->eval_bool(env), e->eval_bool(plainEnv));
+            BOOST_CHECK_EQUAL(p->eval_bool(env), e->eval_bool(plainEnv));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lazyEnv)
+{
+    map<string, int> decoded;
+    map<string, string> message;
+    LazyEnv::Fetch fetch = [&](const string& id, string& text) {
+        ++decoded[id];
+        auto i = message.find(id);
+        if (i==message.end()) return selector::Value();
+        if (i->second[0]=='\'') {
+            text = i->second.substr(1);
+            return selector::Value(text);
+        }
+        return selector::Value(int64_t(std::stoll(i->second)));
+    };
+
+    message["a"] = "50";
+    message["s"] = "'EU";
+    LazyEnv env(fetch);
+    auto e = make_selector("a > 1 AND a < 10 OR a = 50");
+    BOOST_CHECK(eval(*e, env));
+    BOOST_CHECK(eval(*compile(*e), env));
+    BOOST_CHECK_EQUAL(decoded["a"], 1);
+    BOOST_CHECK_EQUAL(env.fetches(), 1u);
+
+    // Short circuiting means b is never decoded
+    BOOST_CHECK(!eval(*make_selector("a = 0 AND b = 1"), env));
+    BOOST_CHECK_EQUAL(decoded.count("b"), 0u);
+    BOOST_CHECK(eval(*make_selector("s = 'EU' AND s LIKE 'E%'"), env));
+    BOOST_CHECK_EQUAL(decoded["s"], 1);
+    BOOST_CHECK_EQUAL(decoded["a"], 1);
+
+    // The next message
+    env.reset();
+    message["a"] = "5";
+    message["s"] = "'US";
+    BOOST_CHECK(eval(*e, env));
+    BOOST_CHECK(eval(*make_selector("s = 'US' AND c IS NULL AND c IS NULL"), env));
+    BOOST_CHECK_EQUAL(decoded["a"], 2);
+    BOOST_CHECK_EQUAL(decoded["s"], 2);
+    BOOST_CHECK_EQUAL(decoded["c"], 1);
+
+    // By slot
+    SymbolTable symbols;
+    auto bound = make_selector("x = 1 OR x = 2 OR y = x", symbols);
+    LazyEnv slotEnv(fetch, symbols);
+    message["x"] = "3";
+    message["y"] = "3";
+    BOOST_CHECK(eval(*bound, slotEnv));
+    BOOST_CHECK(eval(*compile(*bound), slotEnv));
+    BOOST_CHECK_EQUAL(decoded["x"], 1);
+    BOOST_CHECK_EQUAL(decoded["y"], 1);
+    BOOST_CHECK_EQUAL(slotEnv.fetches(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE(incrementalEval)
+{
+    auto e = make_selector("status = 'done' AND retries < 3 AND body LIKE '%urgent%' OR priority > 5 OR NOT (owner IS NULL)");
+    TestSelectorEnv env;
+    env.set("status", "done");
+    env.set("retries", selector::Value(int64_t(0)));
+    env.set("body", "very urgent");
+    env.set("priority", 1);
+    IncrementalEval incremental(*e);
+    BOOST_CHECK_EQUAL(incremental.eval_bool(env), BN_TRUE);
+    const uint64_t first = incremental.leaf_evaluations();
+    BOOST_CHECK_EQUAL(incremental.eval_bool(env), BN_TRUE);
+    BOOST_CHECK_EQUAL(incremental.leaf_evaluations(), first);
+
+    // Only the retries comparison is evaluated again, the other leaves are cached
+    env.set("retries", 3);
+    incremental.changed("retries");
+    BOOST_CHECK_EQUAL(incremental.eval_bool(env), e->eval_bool(env));
+    BOOST_CHECK_EQUAL(incremental.leaf_evaluations(), first + 1);
+    env.set("retries", 2);
+    incremental.changed("retries");
+    BOOST_CHECK_EQUAL(incremental.eval_bool(env), BN_TRUE);
+    BOOST_CHECK_EQUAL(incremental.leaf_evaluations(), first + 2);
+    incremental.changed("unused");
+    BOOST_CHECK_EQUAL(incremental.eval_bool(env), BN_TRUE);
+    BOOST_CHECK_EQUAL(incremental.leaf_evaluations(), first + 2);
+
+    // Any sequence of changes gives the same results as evaluating afresh
+    const char* selectors[] = {
+        "A > 1 AND (B = 'x' OR C) AND NOT (A = 3 OR B LIKE 'y%')",
+        "A <> 0 AND 4 / A = 2 OR B IS NULL",
+        "NOT C OR A BETWEEN 1 AND 3 AND B IN ('x', 'yz')"
+    };
+    const string x("x"), yz("yz");
+    const selector::Value as[] = {selector::Value(), int64_t(0), int64_t(2), int64_t(3), 2.5};
+    const selector::Value bs[] = {selector::Value(), x, yz};
+    const selector::Value cs[] = {selector::Value(), true, false};
+    for (auto sel : selectors) {
+        auto s = make_selector(sel);
+        IncrementalEval inc(*s);
+        TestSelectorEnv env;
+        for (unsigned step = 0; step<200; ++step) {
+            const unsigned k = (step * 7 + step/5) % 3;
+            const char* id = k==0 ? "A" : k==1 ? "B" : "C";
+            const selector::Value& v = k==0 ? as[step % 5] : k==1 ? bs[step % 3] : cs[(step/3) % 3];
+            env.set(id, v);
+            inc.changed(id);
+            BOOST_CHECK_EQUAL(inc.eval_bool(env), s->eval_bool(env));
+        }
+        inc.reset();
+        BOOST_CHECK_EQUAL(inc.eval_bool(env), s->eval_bool(env));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(concurrentEval)
+{
+    // One selector of each kind shared by every thread
+    SymbolTable symbols;
+    auto tree = make_selector("A > 10 AND B LIKE 'x%' OR A IN (1, 3, 5) OR B = 'y'", symbols);
+    auto adaptive = make_adaptive_selector("A = 3 OR A = 4 OR B LIKE '%z' OR A BETWEEN 20 AND 30");
+    auto program = compile(*tree);
+    SelectorSet set;
+    set.add(*tree);
+    set.add(*adaptive);
+
+    // Envs that are safe to read from many threads
+    struct MapEnv : public Env {
+        map<string, selector::Value> values;
+        string b;
+        const selector::Value& value(const string& id) const {
+            static const selector::Value none;
+            auto i = values.find(id);
+            return i==values.end() ? none : i->second;
+        }
+    };
+    const int count = 200;
+    vector<unique_ptr<MapEnv>> envs;
+    const char* bs[] = {"xa", "y", "az", "b"};
+    for (int i = 0; i<count; ++i) {
+        envs.push_back(make_unique<MapEnv>());
+        envs.back()->b = bs[i % 4];
+        envs.back()->values["A"] = selector::Value(int64_t(i % 40));
+        envs.back()->values["B"] = selector::Value(envs.back()->b);
+    }
+    vector<int> expected;
+    for (auto& env : envs) {
+        vector<SelectorSet::Id> ids;
+        set.match(*env, ids);
+        expected.push_back(tree->eval_bool(*env) + 3*adaptive->eval_bool(*env) + 9*int(ids.size()));
+    }
+
+    vector<std::thread> threads;
+    vector<int> mismatches(8, 0);
+    for (unsigned t = 0; t<mismatches.size(); ++t) {
+        threads.emplace_back([&, t] {
+            vector<SelectorSet::Id> ids;
+            for (int round = 0; round<50; ++round) {
+                for (int i = 0; i<count; ++i) {
+                    const Env& env = *envs[(i + t*7) % count];
+                    set.match(env, ids);
+                    int r = tree->eval_bool(env) + 3*adaptive->eval_bool(env) + 9*int(ids.size());
+                    if (r!=expected[(i + t*7) % count] || program->eval_bool(env)!=tree->eval_bool(env)) ++mismatches[t];
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    for (int m : mismatches) BOOST_CHECK_EQUAL(m, 0);
+}
+
+BOOST_AUTO_TEST_CASE(parallelMatch)
+{
+    struct MapEnv : public Env {
+        map<string, selector::Value> values;
+        string b;
+        const selector::Value& value(const string& id) const {
+            static const selector::Value none;
+            auto i = values.find(id);
+            return i==values.end() ? none : i->second;
+        }
+    };
+
+    // Enough selectors of every kind to share out
+    SelectorSet set;
+    const char* bs[] = {"x", "y", "xy", "z"};
+    for (int i = 0; i<300; ++i) {
+        const string n = std::to_string(i % 50);
+        switch (i % 5) {
+        case 0: set.add(*make_selector("A = " + n)); break;
+        case 1: set.add(*make_selector("A BETWEEN " + n + " AND " + std::to_string(i % 50 + 10) + " AND B LIKE 'x%'")); break;
+        case 2: set.add(*make_selector("B = '" + string(bs[i % 4]) + "' AND A > " + n)); break;
+        case 3: set.add(*make_selector("A IN (" + n + ", 7, 9) OR B = 'z'")); break;
+        case 4: set.add(*make_selector("A / 2 > " + n)); break;
+        }
+    }
+    vector<unique_ptr<MapEnv>> envs;
+    vector<const Env*> batch;
+    for (int i = 0; i<100; ++i) {
+        envs.push_back(make_unique<MapEnv>());
+        envs.back()->b = bs[i % 4];
+        envs.back()->values["A"] = selector::Value(int64_t(i % 60));
+        envs.back()->values["B"] = selector::Value(envs.back()->b);
+        batch.push_back(envs.back().get());
+    }
+    // An unknown identifier in the batch too
+    MapEnv empty;
+    batch.push_back(&empty);
+
+    for (unsigned threads : {0u, 1u, 3u}) {
+        ThreadPool pool(threads);
+        BOOST_CHECK(pool.threads()>=1);
+        vector<vector<SelectorSet::Id>> matched;
+        set.match(batch, matched, pool);
+        BOOST_REQUIRE_EQUAL(matched.size(), batch.size());
+        for (std::size_t i = 0; i<batch.size(); ++i) {
+            vector<SelectorSet::Id> expected, shared;
+            set.match(*batch[i], expected);
+            set.match(*batch[i], shared, pool);
+            BOOST_CHECK_EQUAL_COLLECTIONS(matched[i].begin(), matched[i].end(), expected.begin(), expected.end());
+            BOOST_CHECK_EQUAL_COLLECTIONS(shared.begin(), shared.end(), expected.begin(), expected.end());
+        }
+    }
+
+    // Loops run to completion, one after another
+    ThreadPool pool(3);
+    std::atomic<int> total(0);
+    vector<int> hits(1000, 0);
+    vector<std::thread> callers;
+    for (int t = 0; t<2; ++t) {
+        callers.emplace_back([&] {
+            for (int round = 0; round<20; ++round) pool.run(hits.size(), [&](std::size_t i) { ++hits[i]; ++total; });
+        });
+    }
+    for (auto& t : callers) t.join();
+    BOOST_CHECK_EQUAL(total.load(), 40000);
+    BOOST_CHECK(std::all_of(hits.begin(), hits.end(), [](int h) { return h==40; }));
+    pool.run(0, [](std::size_t) {});
+
+    // Loops that are over before the workers wake up for them
+    for (int round = 0; round<2000; ++round) {
+        int runs = 0;
+        pool.run(1, [&](std::size_t) { ++runs; });
+        BOOST_CHECK_EQUAL(runs, 1);
+    }
+
+    // The first exception stops the loop and is rethrown once every thread
+    // has left it, on whichever thread it was thrown
+    for (int round = 0; round<100; ++round) {
+        BOOST_CHECK_THROW(pool.run(1000, [&](std::size_t i) {
+            if (i%100==std::size_t(round)) throw std::runtime_error("body");
+        }), std::runtime_error);
+    }
+    struct ThrowingEnv : public Env {
+        const selector::Value& value(const string&) const {
+            throw std::runtime_error("env");
+        }
+    };
+    ThrowingEnv throwing;
+    vector<SelectorSet::Id> none;
+    BOOST_CHECK_THROW(set.match(throwing, none, pool), std::runtime_error);
+    total = 0;
+    pool.run(hits.size(), [&](std::size_t) { ++total; });
+    BOOST_CHECK_EQUAL(total.load(), 1000);
+
+    // Loops inside loops run on the thread that starts them
+    total = 0;
+    pool.run(10, [&](std::size_t) {
+        pool.run(10, [&](std::size_t) { ++total; });
+    });
+    BOOST_CHECK_EQUAL(total.load(), 100);
+}
+
+BOOST_AUTO_TEST_CASE(pipelineEval)
+{
+    struct MapEnv : public Env {
+        map<string, selector::Value> values;
+        string b;
+        const selector::Value& value(const string& id) const {
+            static const selector::Value none;
+            auto i = values.find(id);
+            return i==values.end() ? none : i->second;
+        }
+    };
+
+    // Elements are swapped through the ring
+    RingBuffer<vector<int>> ring(3);
+    BOOST_CHECK_EQUAL(ring.capacity(), 4u);
+    vector<int> v;
+    for (int i = 0; i<4; ++i) {
+        v.assign(1, i);
+        BOOST_CHECK(ring.try_push(v));
+    }
+    BOOST_CHECK(!ring.try_push(v));
+    for (int i = 0; i<4; ++i) {
+        BOOST_CHECK(ring.try_pop(v));
+        BOOST_CHECK_EQUAL(v.size(), 1u);
+        BOOST_CHECK_EQUAL(v[0], i);
+    }
+    BOOST_CHECK(!ring.try_pop(v));
+
+    const char* bs[] = {"x", "y", "xy", "z"};
+    vector<unique_ptr<MapEnv>> envs;
+    for (int i = 0; i<2000; ++i) {
+        envs.push_back(make_unique<MapEnv>());
+        envs.back()->b = bs[i % 4];
+        envs.back()->values["A"] = selector::Value(int64_t(i % 60));
+        if (i % 7) envs.back()->values["B"] = selector::Value(envs.back()->b);
+    }
+    vector<unique_ptr<Expression>> owned;
+    for (auto sel : {"A > 30", "B LIKE 'x%' AND A < 50", "B IS NULL OR A IN (1, 2, 3)", "A / 2 = 7"}) {
+        owned.push_back(make_selector(sel));
+    }
+    vector<const Expression*> selectors;
+    for (auto& e : owned) selectors.push_back(e.get());
+
+    // Small rings so the producers keep waiting for the consumer
+    for (unsigned workers : {1u, 3u}) {
+        SelectorPipeline pipeline(selectors, workers, 8, 5);
+        std::vector<std::thread> producers;
+        for (unsigned p = 0; p<2; ++p) {
+            producers.emplace_back([&, p] {
+                for (std::size_t i = p; i<envs.size(); i += 2) pipeline.push(*envs[i], i);
+            });
+        }
+        vector<int> seen(envs.size(), 0);
+        std::thread closer([&] {
+            for (auto& t : producers) t.join();
+            pipeline.close();
+        });
+        SelectorPipeline::Result r;
+        std::size_t results = 0;
+        while (pipeline.pop(r)) {
+            ++results;
+            BOOST_REQUIRE(r.tag<envs.size());
+            BOOST_CHECK_EQUAL(r.env, envs[r.tag].get());
+            ++seen[r.tag];
+            vector<uint32_t> expected;
+            for (uint32_t s = 0; s<selectors.size(); ++s) {
+                if (selectors[s]->eval_bool(*r.env)==BN_TRUE) expected.push_back(s);
+            }
+            BOOST_CHECK_EQUAL_COLLECTIONS(r.matches.begin(), r.matches.end(), expected.begin(), expected.end());
+        }
+        closer.join();
+        BOOST_CHECK_EQUAL(results, envs.size());
+        BOOST_CHECK(std::all_of(seen.begin(), seen.end(), [](int n) { return n==1; }));
+        BOOST_CHECK_THROW(pipeline.push(*envs[0], 0), std::logic_error);
+        BOOST_CHECK(!pipeline.try_pop(r));
+    }
+
+    // Pushes racing close() either throw or have their messages evaluated
+    for (int round = 0; round<20; ++round) {
+        SelectorPipeline pipeline(selectors, 2, 16, 4);
+        std::atomic<std::size_t> accepted(0);
+        std::vector<std::thread> producers;
+        for (unsigned p = 0; p<2; ++p) {
+            producers.emplace_back([&, p] {
+                try {
+                    for (std::size_t i = p; ; i = (i+2) % envs.size()) {
+                        if (pipeline.try_push(*envs[i], i)) ++accepted;
+                        else std::this_thread::yield();
+                    }
+                } catch (const std::logic_error&) {}
+            });
+        }
+        for (int k = 0; k<round*10; ++k) std::this_thread::yield();
+        pipeline.close();
+        SelectorPipeline::Result r;
+        std::size_t results = 0;
+        while (pipeline.pop(r)) ++results;
+        for (auto& t : producers) t.join();
+        BOOST_CHECK_EQUAL(results, accepted.load());
+    }
+
+    // Results nobody pops don't stop the pipeline being destroyed
+    SelectorPipeline abandoned(selectors, 2, 4, 2);
+    for (std::size_t i = 0; i<6; ++i) abandoned.push(*envs[i], i);
+}
+
+BOOST_AUTO_TEST_CASE(symbolTable)
+{
+    SymbolTable symbols;
+    auto e1 = make_selector("A > 1 AND B = 'x' OR A < -1 OR C IS NULL", symbols);
+    BOOST_CHECK_EQUAL(symbols.size(), 3u);
+    BOOST_CHECK_EQUAL(symbols.slot("A"), 0u);
+    BOOST_CHECK_EQUAL(symbols.slot("B"), 1u);
+    BOOST_CHECK_EQUAL(symbols.slot("C"), 2u);
+    BOOST_CHECK_EQUAL(symbols.slot("D"), SymbolTable::npos);
+    BOOST_CHECK_EQUAL(symbols.name(1), "B");
+
+    // A second selector shares the existing slots
+    auto e2 = make_selector("D = A", symbols);
+    BOOST_CHECK_EQUAL(symbols.size(), 4u);
+    BOOST_CHECK_EQUAL(symbols.slot("A"), 0u);
+    BOOST_CHECK_EQUAL(symbols.slot("D"), 3u);
+}
+
+BOOST_AUTO_TEST_CASE(slotEval)
+{
+    SymbolTable symbols;
+    auto e1 = make_selector("A > 1 AND B = 'x' OR A < -1", symbols);
+    auto e2 = make_selector("C IS NULL AND B LIKE 'x%'", symbols);
+    auto e3 = make_selector("A IN (1, 2, B)");
+
+    TestSlotEnv env(symbols);
+    env.set("A", 2);
+    env.set("B", "x");
+
+    BOOST_CHECK(eval(*e1, env));
+    BOOST_CHECK(eval(*e2, env));
+    // Not bound to slots so looked up by name
+    BOOST_CHECK(eval(*e3, env));
+
+    env.set("A", selector::Value(0));
+    BOOST_CHECK(!eval(*e1, env));
+    env.set("A", -2);
+    BOOST_CHECK(eval(*e1, env));
+    env.set("C", 1.5);
+    BOOST_CHECK(!eval(*e2, env));
+    BOOST_CHECK(!eval(*e3, env));
+}
+
+BOOST_AUTO_TEST_CASE(compiledEval)
+{
+    TestSelectorEnv env;
+    env.set("A", 42);
+    env.set("S", "hello");
+
+    BOOST_CHECK_EQUAL(compile(*make_selector("A > 40 AND S LIKE 'he%'"))->eval_bool(env), BN_TRUE);
+    BOOST_CHECK_EQUAL(compile(*make_selector("A > 40 AND Z = 1"))->eval_bool(env), BN_UNKNOWN);
+    BOOST_CHECK_EQUAL(compile(*make_selector("A < 40 AND Z = 1"))->eval_bool(env), BN_FALSE);
+    BOOST_CHECK_EQUAL(compile(*make_selector("Z = 1 OR A = 42"))->eval_bool(env), BN_TRUE);
+    BOOST_CHECK_EQUAL(compile(*make_selector("Z = 1 OR A = 41"))->eval_bool(env), BN_UNKNOWN);
+    BOOST_CHECK_EQUAL(compile(*make_selector("A NOT IN (1, 'x', Z)"))->eval_bool(env), BN_UNKNOWN);
+    BOOST_CHECK_EQUAL(compile(*make_selector("A NOT IN (1, 'x')"))->eval_bool(env), BN_FALSE);
+    BOOST_CHECK_EQUAL(compile(*make_selector("A IN (1, 'x', 42.0)"))->eval_bool(env), BN_TRUE);
+    BOOST_CHECK_EQUAL(compile(*make_selector("A BETWEEN 40 AND Z"))->eval_bool(env), BN_UNKNOWN);
+
+    // Value results and copies of compiled selectors are independent of the original
+    auto p = compile(*make_selector("A*2 - 4"));
+    auto q = compile(*p);
+    p.reset();
+    selector::Value v = q->eval(env);
+    BOOST_CHECK_EQUAL(v.type, selector::Value::T_EXACT);
+    BOOST_CHECK_EQUAL(v.i, 80);
+
+    auto s = compile(*compile(*make_selector("'hello'")));
+    v = s->eval(env);
+    BOOST_CHECK_EQUAL(v.type, selector::Value::T_STRING);
+    BOOST_CHECK_EQUAL(*v.s, "hello");
+
+    // Long AND chains still only need a few registers
+    string chain("A=42");
+    for (int i = 0; i<100; ++i) chain += " AND A>" + std::to_string(i-100);
+    BOOST_CHECK(eval(*compile(*make_selector(chain)), env));
+}
+
+std::size_t occurrences(const string& s, const string& of)
+{
+    std::size_t n = 0;
+    for (std::size_t i = s.find(of); i!=string::npos; i = s.find(of, i+1)) ++n;
+    return n;
+}
+
+BOOST_AUTO_TEST_CASE(commonSubexpressions)
+{
+    // Computed once when the first is always evaluated first
+    std::ostringstream o;
+    o << *compile(*make_selector("(price * qty) > 1000 OR (price * qty) < 10"));
+    BOOST_CHECK_EQUAL(occurrences(o.str(), "MULT"), 1u);
+    BOOST_CHECK_EQUAL(occurrences(o.str(), "IDENTIFIER"), 2u);
+
+    // Not reused after code that doesn't always run
+    o.str("");
+    o << *compile(*make_selector("(A OR B LIKE 'x%') AND (C OR B LIKE 'x%')"));
+    BOOST_CHECK_EQUAL(occurrences(o.str(), "LIKE"), 2u);
+
+    // Identical in print at the default precision isn't identical
+    o.str("");
+    o << *compile(*make_selector("A + 0.1 > 1 AND A + 0.10000000000000002 < 2"));
+    BOOST_CHECK_EQUAL(occurrences(o.str(), "ADD"), 2u);
+
+    const char* selectors[] = {
+        "(price * qty) > 1000 OR (price * qty) < 10",
+        "(A OR B*C > 1) AND B*C < 5",
+        "A IN (B*C, 3, B*C+1) AND B*C IS NOT NULL",
+        "NOT (A AND B > C) OR (A AND B > C) = (C BETWEEN B AND B*2)",
+        "(B - C) * (B - C) > B - C AND S LIKE '%y' OR (S LIKE '%y') IS NULL",
+        "A + 0.1 > 1 AND A + 0.10000000000000002 < 2",
+        // Quotes in a string don't make two lists look alike
+        "S IN ('xy', 'y') AND NOT (S IN ('xy'', ''y'))"
+    };
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    const char* ss[] = {"xy", "y", "yy"};
+    for (int i = 0; i<60; ++i) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        TestSelectorEnv& env = *envs.back();
+        if (i%5) env.set("price", selector::Value(int64_t(i*7 % 90)));
+        if (i%7) env.set("qty", selector::Value(int64_t(i % 30)));
+        if (i%4) env.set("A", selector::Value(bool(i%3)));
+        if (i%6) env.set("B", selector::Value(int64_t(i%5 - 1)));
+        if (i%9) env.set("C", i%2 ? selector::Value(int64_t(i%4)) : selector::Value(double(i%3)/2));
+        if (i%8) env.set("S", ss[i%3]);
+        if (i%2) env.set("A", selector::Value(0.9 - double(i%3)/3));
+    }
+    vector<const Env*> envps;
+    for (auto& e : envs) envps.push_back(e.get());
+    for (auto sel : selectors) {
+        BOOST_MESSAGE("Shared: " << sel);
+        auto e = make_selector(sel);
+        auto p = compile(*e);
+        string saved;
+        save_selector(*p, saved);
+        auto l = load_selector(saved.data(), saved.size());
+        vector<uint8_t> results(envs.size());
+        eval_batch(*p, envps.data(), envps.size(), results.data());
+        for (std::size_t i = 0; i<envs.size(); ++i) {
+            const BoolOrNone r = e->eval_bool(*envs[i]);
+            BOOST_CHECK_EQUAL(p->eval_bool(*envs[i]), r);
+            BOOST_CHECK_EQUAL(l->eval_bool(*envs[i]), r);
+            BOOST_CHECK_EQUAL(results[i], r);
+        }
+    }
+
+    // Selector sets share terms that only differ past the default precision
+    SelectorSet set;
+    set.add(*make_selector("A = 0.1"));
+    set.add(*make_selector("A = 0.10000000000000002"));
+    TestSelectorEnv env;
+    env.set("A", 0.1);
+    vector<SelectorSet::Id> ids;
+    set.match(env, ids);
+    BOOST_CHECK_EQUAL(ids.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(memoryUsage)
+{
+    SymbolTable symbols;
+    BOOST_CHECK_EQUAL(&symbols.intern("abc"), &symbols.intern(string("abc")));
+    BOOST_CHECK_NE(&symbols.intern("abc"), &symbols.intern("abd"));
+
+    // Interned strings aren't counted against each selector
+    const string text(100, 'x');
+    const std::size_t quoted = memory_usage(*make_compact_selector("S = '" + text + "'", symbols));
+    BOOST_CHECK_EQUAL(quoted, memory_usage(*make_compact_selector("S = 'x'", symbols)));
+    BOOST_CHECK_GE(memory_usage(*compile(*make_selector("S = '" + text + "'"))), quoted + text.size());
+    BOOST_CHECK_LT(memory_usage(*make_compact_selector("A = 1", symbols)), 100u);
+
+    // A LIKE pattern is kept only as what it matches
+    std::ostringstream o;
+    o << *make_selector("S LIKE 'a%%b!%_!c' ESCAPE '!'");
+    BOOST_CHECK_EQUAL(o.str(), "I:S LIKE 'a%b!%_c' ESCAPE '!'");
+
+    const char* selectors[] = {
+        "A = 1",
+        "A > 100000000000 AND S = 'xy'",
+        "S LIKE 'x!%%' ESCAPE '!' OR T = '" "a string too long to fit inside a std::string object" "'",
+        "A IN (1, 2, 3) AND S NOT IN ('x', 'yy', A)",
+        "A BETWEEN -5 AND 5 OR A * 2.5 > 10"
+    };
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    const char* ss[] = {"xy", "x%z", "yy"};
+    for (int i = 0; i<30; ++i) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        if (i%4) envs.back()->set("A", i%3 ? selector::Value(int64_t(i%7 - 3)) : selector::Value(int64_t(100000000000 + i%2)));
+        if (i%5) envs.back()->set("S", ss[i%3]);
+        if (i%2) envs.back()->set("T", "a string too long to fit inside a std::string object");
+    }
+    for (auto sel : selectors) {
+        BOOST_MESSAGE("Memory: " << sel);
+        auto e = make_selector(sel);
+        auto c = make_compact_selector(sel, symbols);
+        BOOST_CHECK_LT(memory_usage(*c), memory_usage(*e));
+        BOOST_CHECK_LE(memory_usage(*c), memory_usage(*compile(*e)));
+
+        // Copies own the strings that aren't interned
+        unique_ptr<Expression> copy;
+        {
+            auto p = compile(*e);
+            copy = compile(*p);
+            BOOST_CHECK_EQUAL(memory_usage(*copy), memory_usage(*p));
+        }
+        string saved;
+        save_selector(*c, saved);
+        auto l = load_selector(saved.data(), saved.size(), symbols);
+        for (auto& env : envs) {
+            const BoolOrNone r = e->eval_bool(*env);
+            BOOST_CHECK_EQUAL(c->eval_bool(*env), r);
+            BOOST_CHECK_EQUAL(copy->eval_bool(*env), r);
+            BOOST_CHECK_EQUAL(l->eval_bool(*env), r);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(profiledEval)
+{
+    auto e = make_selector("A > 10 AND B LIKE 'x%'");
+    Profile profile(*e);
+    for (int i = 0; i<20; ++i) {
+        TestSelectorEnv env;
+        env.set("A", i);
+        if (i%2) env.set("B", "xy");
+        BOOST_CHECK_EQUAL(profile.eval_bool(env), e->eval_bool(env));
+    }
+    BOOST_CHECK_EQUAL(profile.evaluations(), 20u);
+
+    // A > 10 is FALSE for 11 of them, which skip the LIKE; B is unknown for 4 of the rest
+    const auto& nodes = profile.counts();
+    BOOST_REQUIRE(!nodes.empty());
+    BOOST_CHECK_EQUAL(nodes.front().calls, 20u);
+    uint64_t jumps = 0, likes = 0, unknowns = 0, trues = 0;
+    for (auto& n : nodes) jumps += n.jumps;
+    BOOST_CHECK_EQUAL(jumps, 11u);
+    for (auto& n : nodes) if (n.calls==9 && n.trues==5 && n.unknowns==4) ++likes;
+    BOOST_CHECK(likes>=1);
+    for (auto& n : nodes) {
+        unknowns = std::max(unknowns, n.unknowns);
+        trues = std::max(trues, n.trues);
+    }
+    BOOST_CHECK_EQUAL(unknowns, 4u);
+    BOOST_CHECK_EQUAL(trues, 9u);
+
+    std::ostringstream o;
+    profile.repr(o);
+    BOOST_CHECK(o.str().find("PROFILE evaluations=20") == 0);
+    BOOST_CHECK(o.str().find("LIKE") != string::npos);
+    BOOST_CHECK(o.str().find("jumps=11") != string::npos);
+
+    profile.reset();
+    BOOST_CHECK_EQUAL(profile.evaluations(), 0u);
+    BOOST_CHECK_EQUAL(profile.counts().front().calls, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(savedSelectors)
+{
+    string big("A IN (");
+    for (int i = 0; i<40; ++i) big += (i ? ", " : "") + std::to_string(i*3);
+    big += ", 'x', 2.5)";
+    const char* selectors[] = {
+        "A > 10 AND B LIKE 'x%'",
+        "B LIKE '%a!_b%' ESCAPE '!' OR B NOT LIKE '_y%'",
+        "A IN (1, 2.0, 'x', TRUE) OR A NOT IN (4, C)",
+        "A BETWEEN 2 AND C * 2 AND NOT (B = 'xy')",
+        "-A / 2 + C <> 3.5 OR B IS NULL",
+        "TRUE",
+        "'x'"
+    };
+    vector<string> texts(std::begin(selectors), std::end(selectors));
+    texts.push_back(big);
+
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    const string x("x");
+    const selector::Value as[] = {selector::Value(), int64_t(1), 2.5, int64_t(12), int64_t(39), x, true};
+    const char* bs[] = {0, "xy", "za_by", "zyx"};
+    for (auto& a : as) for (auto b : bs) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        if (!unknown(a)) envs.back()->set("A", a);
+        if (b) envs.back()->set("B", b);
+        envs.back()->set("C", int64_t(3));
+    }
+
+    for (auto& t : texts) {
+        auto e = make_selector(t);
+        string saved;
+        save_selector(*e, saved);
+        auto loaded = load_selector(saved.data(), saved.size());
+        SymbolTable symbols;
+        auto bound = load_selector(saved.data(), saved.size(), symbols);
+        BOOST_CHECK(symbols.size()<=3);
+        // Saving a compiled selector gives the same bytes
+        string again;
+        save_selector(*loaded, again);
+        BOOST_CHECK(again==saved);
+        std::ostringstream r1, r2;
+        r1 << *compile(*e);
+        r2 << *loaded;
+        BOOST_CHECK_EQUAL(r1.str(), r2.str());
+        for (auto& env : envs) {
+            BOOST_CHECK_EQUAL(loaded->eval_bool(*env), e->eval_bool(*env));
+            BOOST_CHECK_EQUAL(bound->eval_bool(*env), e->eval_bool(*env));
+        }
+    }
+
+    // Damaged data is rejected or at worst evaluates to something
+    string saved;
+    save_selector(*make_selector(texts[2]), saved);
+    for (std::size_t n = 0; n<saved.size(); ++n) {
+        BOOST_CHECK_THROW(load_selector(saved.data(), n), std::range_error);
+    }
+    BOOST_CHECK_THROW(load_selector((saved + "x").data(), saved.size()+1), std::range_error);
+    string bad = saved;
+    bad[0] = 'X';
+    BOOST_CHECK_THROW(load_selector(bad.data(), bad.size()), std::range_error);
+    for (std::size_t i = 0; i<saved.size(); ++i) {
+        for (int bit = 0; bit<8; ++bit) {
+            bad = saved;
+            bad[i] ^= char(1 << bit);
+            try {
+                auto e = load_selector(bad.data(), bad.size());
+                for (auto& env : envs) e->eval_bool(*env);
+            } catch (const std::range_error&) {
+            }
+        }
+    }
+
+    // An IN list whose fields disagree with its elements is rejected: the
+    // string hashes, the types and the order of the elements
+    saved.clear();
+    save_selector(*make_selector(big), saved);
+    const string exacts("\x28\0\0\0" "\0\0\0\0\0\0\0\0" "\x03\0\0\0\0\0\0\0", 20);
+    const std::size_t hashes = saved.find(exacts) - 8;
+    BOOST_REQUIRE(hashes<saved.size());
+    BOOST_CHECK(load_selector(saved.data(), saved.size())->eval_bool(*envs[5*4])==BN_TRUE);
+    bad = saved;
+    std::fill_n(&bad[hashes], 8, '\0');
+    BOOST_CHECK_THROW(load_selector(bad.data(), bad.size()), std::range_error);
+    bad = saved;
+    bad[hashes-2] &= ~(1 << selector::Value::T_STRING);
+    BOOST_CHECK_THROW(load_selector(bad.data(), bad.size()), std::range_error);
+    bad = saved;
+    std::swap_ranges(&bad[hashes+12], &bad[hashes+20], &bad[hashes+20]);
+    BOOST_CHECK_THROW(load_selector(bad.data(), bad.size()), std::range_error);
+}
+
+BOOST_AUTO_TEST_CASE(jitSelectors)
+{
+    const char* selectors[] = {
+        "A > 10 AND B LIKE 'x%'",
+        "A = 2.5 OR A < 0 OR A >= 12 AND A <> 39",
+        "A IN (1, 2.5, 'x', TRUE) OR A NOT IN (4, C)",
+        "A BETWEEN 2 AND C * 4 AND NOT (B = 'xy')",
+        "-A / 2 + C <> 3.5 OR B IS NULL",
+        "A <= C OR A > C OR A = C",
+        "B > 'x' OR B = 'zyx'",
+        "TRUE",
+        "A"
+    };
+    const string x("x");
+    const selector::Value as[] = {
+        selector::Value(), int64_t(1), 2.5, int64_t(12), int64_t(39), 12.0,
+        std::numeric_limits<double>::quiet_NaN(), x, true, false
+    };
+    const char* bs[] = {0, "xy", "zyx"};
+    const selector::Value cs[] = {selector::Value(), int64_t(3), 3.0};
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    for (auto& a : as) for (auto b : bs) for (auto& c : cs) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        if (!unknown(a)) envs.back()->set("A", a);
+        if (b) envs.back()->set("B", b);
+        if (!unknown(c)) envs.back()->set("C", c);
+    }
+
+    for (auto sel : selectors) {
+        auto e = make_selector(sel);
+        auto now = make_jit_selector(*e, 0);
+        BOOST_CHECK_EQUAL(jit_compiled(*now), jit_available());
+        auto later = make_jit_selector(*e, 5);
+        for (auto& env : envs) {
+            BOOST_CHECK_EQUAL(now->eval_bool(*env), e->eval_bool(*env));
+            BOOST_CHECK_EQUAL(later->eval_bool(*env), e->eval_bool(*env));
+            const selector::Value v1 = now->eval(*env);
+            const selector::Value v2 = compile(*e)->eval(*env);
+            BOOST_CHECK_EQUAL(v1.type, v2.type);
+        }
+        BOOST_CHECK_EQUAL(jit_compiled(*later), jit_available());
+        // Still usable as a compiled selector
+        BOOST_CHECK(!jit_compiled(*compile(*later)));
+        string saved;
+        save_selector(*later, saved);
+        BOOST_CHECK_EQUAL(load_selector(saved.data(), saved.size())->eval_bool(*envs[20]), e->eval_bool(*envs[20]));
+    }
+
+    auto e = make_selector("A > 10 AND B LIKE 'x%'");
+    auto j = make_jit_selector(*e, 3);
+    TestSelectorEnv env;
+    env.set("A", 11);
+    env.set("B", "xa");
+    BOOST_CHECK(eval(*j, env));
+    BOOST_CHECK(eval(*j, env));
+    BOOST_CHECK(!jit_compiled(*j));
+    BOOST_CHECK(eval(*j, env));
+    BOOST_CHECK_EQUAL(jit_compiled(*j), jit_available());
+    BOOST_CHECK(eval(*j, env));
+
+    // Compiled with a large register file, but not with too many registers
+    // to keep on the stack
+    env.set("A", 1);
+    for (int depth : {100, 400}) {
+        string deep("A");
+        for (int i = 0; i<depth; ++i) deep = "A + (" + deep + ")";
+        auto d = make_selector(deep + " = " + std::to_string(depth+1));
+        auto dj = make_jit_selector(*d, 0);
+        BOOST_CHECK_EQUAL(jit_compiled(*dj), jit_available() && depth<256);
+        BOOST_CHECK(dj->eval_bool(env));
+        BOOST_CHECK_EQUAL(dj->eval_bool(env), d->eval_bool(env));
+    }
+
+    // Hot selectors are promoted once sampled counting reaches the threshold
+    auto hot = make_jit_selector(*e, 1000);
+    for (int i = 0; i<100000 && !jit_compiled(*hot); ++i) BOOST_CHECK(eval(*hot, env) == eval(*e, env));
+    BOOST_CHECK_EQUAL(jit_compiled(*hot), jit_available());
+}
+
+BOOST_AUTO_TEST_CASE(allocationFreeEval)
+{
+    struct MapEnv : public Env {
+        map<string, selector::Value> values;
+        const selector::Value& value(const string& id) const {
+            static const selector::Value none;
+            auto i = values.find(id);
+            return i==values.end() ? none : i->second;
+        }
+    };
+    struct Slots : public SlotEnv {
+        vector<selector::Value> values;
+        Slots(const SymbolTable& s) : SlotEnv(s) {}
+        const selector::Value& value(std::size_t slot) const {
+            static const selector::Value none;
+            return slot<values.size() ? values[slot] : none;
+        }
+        using SlotEnv::value;
+    };
+
+    const char* selectors[] = {
+        "A = 'hello' AND B > 3 OR C",
+        "A LIKE 'he%' OR A LIKE '%lo' OR A LIKE '%ell%' OR A LIKE 'h_l%o' OR A LIKE 'x!%%' ESCAPE '!'",
+        "A NOT LIKE 'hello' AND B BETWEEN 1 AND 10 AND B NOT BETWEEN 5 AND 6",
+        "A IN ('hello', 'there', 'x') AND B NOT IN (1, 2.5, 3) AND D IS NULL",
+        "(B + 1) * 2 - B / 2 > -B AND X IS NOT NULL OR NOT C",
+        "E = 2.5 OR E < B OR TRUE = C AND A <> 'x'",
+        // Enough nesting for more registers than are kept on the stack
+        "B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+(B+B)))))))))))))))))) > 0"
+    };
+    const string hello("hello");
+    MapEnv env;
+    env.values["A"] = hello;
+    env.values["B"] = int64_t(4);
+    env.values["C"] = true;
+    env.values["E"] = 2.5;
+    env.values["X"] = int64_t(0);
+
+    for (auto sel : selectors) {
+        BOOST_MESSAGE("No allocation: " << sel);
+        SymbolTable symbols;
+        vector<unique_ptr<Expression>> es;
+        es.push_back(make_selector(sel));
+        es.push_back(make_adaptive_selector(sel));
+        es.push_back(compile(*es[0]));
+        es.push_back(make_jit_selector(*es[0], 1));
+        es.push_back(make_selector(sel, symbols));
+        Slots slots(symbols);
+        for (std::size_t s = 0; s<symbols.size(); ++s) slots.values.push_back(env.value(symbols.name(s)));
+        for (std::size_t i = 0; i<es.size(); ++i) {
+            const Env& e = i==4 ? static_cast<const Env&>(slots) : env;
+            // Values only, so the same results as the tree
+            const BoolOrNone expected = es[0]->eval_bool(env);
+            es[i]->eval_bool(e);
+            countAllocations = true;
+            allocations = 0;
+            BoolOrNone r = BN_UNKNOWN;
+            // Enough evaluations for adaptive selectors to reorder their operands
+            for (int k = 0; k<2000; ++k) {
+                r = es[i]->eval_bool(e);
+                es[i]->eval(e);
+            }
+            countAllocations = false;
+            BOOST_CHECK_EQUAL(r, expected);
+            BOOST_CHECK_EQUAL(allocations, 0u);
+        }
+
+        // Batches of any size reuse the space of the thread's first one
+        const Env* envs[300];
+        std::fill_n(envs, 300, &env);
+        uint8_t results[300];
+        eval_batch(*es[2], envs, 300, results);
+        countAllocations = true;
+        allocations = 0;
+        for (int k = 0; k<100; ++k) {
+            for (std::size_t n : {1, 64, 300}) eval_batch(*es[2], envs, n, results);
+        }
+        countAllocations = false;
+        BOOST_CHECK_EQUAL(BoolOrNone(results[299]), es[0]->eval_bool(env));
+        BOOST_CHECK_EQUAL(allocations, 0u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(constantInEval)
+{
+    // Lists of constants are looked up in a prebuilt set: check against the
+    // same list made non constant by repeating its first element as identifier Z
+    string small("1, 2.5, -3, 'a', 'bc', TRUE, -0.5");
+    string large("'x', 10");
+    for (int i = 0; i<200; ++i) large += ", " + std::to_string(i*3) + (i%5 ? "" : ".5");
+    string numbers("1, 2.5, -3, 4, 5.0");
+    const string lists[] = {
+        small, large, numbers, "TRUE, FALSE", "'a'", "-'a', 3, 'b'"
+    };
+    // -'a' is a constant unknown
+    const string x("x"), a("a");
+    const selector::Value firsts[] = {
+        int64_t(1), x, int64_t(1), true, a, selector::Value()
+    };
+    vector<selector::Value> values = {
+        int64_t(1), int64_t(2), int64_t(-3), int64_t(10), int64_t(30), int64_t(33), int64_t(5),
+        1.0, 2.5, -0.5, 30.0, 15.5, 16.5, 5.0,
+        true, false, selector::Value()
+    };
+    const string strs[] = {"a", "bc", "x", "y"};
+    for (auto& str : strs) values.push_back(str);
+
+    for (std::size_t li = 0; li<sizeof(lists)/sizeof(lists[0]); ++li) {
+        for (string op : {" IN (", " NOT IN ("}) {
+            auto constant = make_selector("X" + op + lists[li] + ")");
+            auto reference = make_selector("X" + op + lists[li] + ", Z)");
+            auto compiled = compile(*constant);
+            for (auto& v : values) {
+                TestSelectorEnv env;
+                if (!unknown(v)) env.set("X", v);
+                if (!unknown(firsts[li])) env.set("Z", firsts[li]);
+                BoolOrNone r = reference->eval_bool(env);
+                BOOST_CHECK_EQUAL(constant->eval_bool(env), r);
+                BOOST_CHECK_EQUAL(compiled->eval_bool(env), r);
+            }
+        }
+    }
+}
+
+// Straightforward backtracking LIKE to check the matcher against
+bool referenceLike(const char* s, const char* p, char escape)
+{
+    if (!*p) return !*s;
+    if (*p==escape) return p[1] ? (*s==p[1] && referenceLike(s+1, p+2, escape)) : referenceLike(s, p+1, escape);
+    if (*p=='%') return referenceLike(s, p+1, escape) || (*s && referenceLike(s+1, p, escape));
+    if (!*s) return false;
+    return (*p=='_' || *p==*s) && referenceLike(s+1, p+1, escape);
+}
+
+BOOST_AUTO_TEST_CASE(likeEval)
+{
+    const char* const patterns[] = {
+        "", "%", "%%", "_", "abc", "abc%", "%abc", "%abc%", "a%c", "a_c", "%b_%", "_%_",
+        "%a%b%c%", "a%%b", "%aa%a", "ab%ab%ab", "%_b%", "z%%", "z_b", "a%z_", "zz", "%zab%"
+    };
+    const char* const strings[] = {
+        "", "a", "b", "c", "ab", "abc", "abcabc", "aabc", "abca", "xabcx", "acb", "aaa",
+        "ab%ab_ab", "a_c", "a%c", "%", "_", "z", "abababab", "aab", "baaba", "ab%"
+    };
+    for (auto p : patterns) {
+        string pattern(p);
+        for (auto s : strings) {
+            TestSelectorEnv env;
+            env.set("S", s);
+            BOOST_CHECK_EQUAL(eval_selector("S LIKE '" + pattern + "'", env), referenceLike(s, p, 0));
+            // Escape with 'z' unless the pattern has a doubled escape character
+            if (pattern.find("zz")==string::npos) {
+                BOOST_CHECK_EQUAL(eval_selector("S LIKE '" + pattern + "' ESCAPE 'z'", env),
+                                  referenceLike(s, p, 'z'));
+            }
+        }
+    }
+}
+
+const char* const batchSelectors[] = {
+    "",
+    "A > 10",
+    "A > 10 AND B = 'x'",
+    "A > 10 OR B = 'x' OR C IS NULL",
+    "NOT (A < 5 AND B <> 'y')",
+    "A BETWEEN 3 AND 12.5 AND C IS NOT NULL",
+    "A NOT BETWEEN 3 AND C",
+    "A IN (1, 4, 7, 'x', C)",
+    "A NOT IN (1, 4, 7, 'x')",
+    "A NOT IN (1, 4, 7, 'x', C)",
+    "B IN ('x', 'y') OR A*2+1 = 9",
+    "B LIKE 'x%' AND -A < -2",
+    "(A IS NULL OR B IS NULL) AND (C = 1 OR C = 2.5)"
+};
+
+BOOST_AUTO_TEST_CASE(batchEval)
+{
+    // Enough messages to need more than one block of lanes
+    const std::size_t n = 700;
+    SymbolTable symbols;
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    vector<selector::Value> columns[3];
+    vector<unique_ptr<string>> strings;
+    for (std::size_t i = 0; i<n; ++i) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        selector::Value a, b, c;
+        switch (i%5) {
+        case 0: a = int64_t(i%17); break;
+        case 1: a = double(i%13)/2; break;
+        case 2: a = bool(i%2); break;
+        case 3: strings.push_back(make_unique<string>("x")); a = *strings.back(); break;
+        default: break;
+        }
+        if (i%3) {
+            strings.push_back(make_unique<string>(i%2 ? "x" : "yz"));
+            b = *strings.back();
+        }
+        if (i%7==1) c = int64_t(1);
+        else if (i%7==2) c = 2.5;
+        else if (i%7==3) c = int64_t(i);
+        if (!unknown(a)) envs.back()->set("A", a);
+        if (!unknown(b)) envs.back()->set("B", b);
+        if (!unknown(c)) envs.back()->set("C", c);
+        columns[0].push_back(a);
+        columns[1].push_back(b);
+        columns[2].push_back(c);
+    }
+    vector<const Env*> envps;
+    for (auto& e : envs) envps.push_back(e.get());
+
+    for (auto sel : batchSelectors) {
+        BOOST_MESSAGE("Batch: " << sel);
+        auto e = make_selector(sel, symbols);
+        BOOST_REQUIRE(symbols.size()<=3);
+        // Slots are in the order the identifiers were first seen
+        const selector::Value* cols[3] = {0, 0, 0};
+        for (std::size_t s = 0; s<symbols.size(); ++s) {
+            cols[s] = columns[symbols.name(s)[0]-'A'].data();
+        }
+
+        vector<uint8_t> treeResults(n, 0xff);
+        vector<uint8_t> programResults(n, 0xff);
+        vector<uint8_t> columnResults(n, 0xff);
+        eval_batch(*e, envps.data(), n, treeResults.data());
+        auto p = compile(*e);
+        eval_batch(*p, envps.data(), n, programResults.data());
+        eval_batch(*p, cols, n, columnResults.data());
+        for (std::size_t i = 0; i<n; ++i) {
+            BoolOrNone r = e->eval_bool(*envs[i]);
+            BOOST_CHECK_EQUAL(treeResults[i], r);
+            BOOST_CHECK_EQUAL(programResults[i], r);
+            BOOST_CHECK_EQUAL(columnResults[i], r);
+        }
+    }
+
+    // Columns can only be used when identifiers are bound to slots
+    uint8_t r;
+    const selector::Value* none = 0;
+    BOOST_CHECK_THROW(eval_batch(*make_selector("A = 1"), &none, 1, &r), std::logic_error);
+}
+
+const char* const numericSelectors[] = {
+    "X = Y",
+    "X <> Y",
+    "X < Y",
+    "X > Y OR Z >= X",
+    "X <= Z AND Y >= Z",
+    "X BETWEEN Y AND Z",
+    "X NOT BETWEEN Z AND Y",
+    "X IN (Y, Z, 3, 2.5)",
+    "X NOT IN (Y, Z, 3, 2.5)",
+    "X+1 > Y*2"
+};
+
+BOOST_AUTO_TEST_CASE(numericBatchEval)
+{
+    // Numeric columns are compared by the SIMD kernels: check every lane
+    // including the ones the kernels leave to the generic comparison
+    const std::size_t n = 1000;
+    const int64_t exacts[] = {
+        0, 1, 2, 3, -1,
+        std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min()
+    };
+    const double inexacts[] = {
+        0.0, -0.0, 2.5, 3.0, -1.5,
+        std::numeric_limits<double>::infinity(),
+        std::numeric_limits<double>::quiet_NaN()
+    };
+    SymbolTable symbols;
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    vector<const Env*> envps;
+    vector<selector::Value> columns[3];
+    string str("3");
+    for (std::size_t i = 0; i<n; ++i) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        envps.push_back(envs.back().get());
+        for (unsigned c = 0; c<3; ++c) {
+            // Mostly exact or mostly inexact blocks with the odd other type mixed in
+            const std::size_t k = (i*(c+3) + i/7) % 29;
+            selector::Value v;
+            if (k==0) v = str;
+            else if (k==1) v = true;
+            else if (k==2) v = selector::Value();
+            else if ((i/256 + (k==3)) % 2) v = inexacts[(i+k+c) % 7];
+            else v = exacts[(i+k*c) % 7];
+            if (!unknown(v)) envs.back()->set(string(1, 'X'+c), v);
+            columns[c].push_back(v);
+        }
+    }
+
+    for (auto sel : numericSelectors) {
+        BOOST_MESSAGE("Numeric batch: " << sel);
+        auto e = make_selector(sel, symbols);
+        const selector::Value* cols[3] = {0, 0, 0};
+        for (std::size_t s = 0; s<symbols.size(); ++s) {
+            cols[s] = columns[symbols.name(s)[0]-'X'].data();
+        }
+
+        auto p = compile(*e);
+        vector<uint8_t> programResults(n, 0xff);
+        vector<uint8_t> columnResults(n, 0xff);
+        eval_batch(*p, envps.data(), n, programResults.data());
+        eval_batch(*p, cols, n, columnResults.data());
+        for (std::size_t i = 0; i<n; ++i) {
+            BoolOrNone r = e->eval_bool(*envs[i]);
+            BOOST_CHECK_EQUAL(programResults[i], r);
+            BOOST_CHECK_EQUAL(columnResults[i], r);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(columnarEval)
+{
+    // Arrow layout columns, E sliced from one row in
+    const std::size_t n = 600;
+    vector<int64_t> as(n);
+    vector<uint8_t> aValid((n+7)/8), bValid((n+7)/8), cs((n+7)/8);
+    vector<int32_t> bOffsets(1, 0), gOffsets(1, 0), eValues(n+1);
+    string bData, gData;
+    vector<double> ds(n);
+    vector<unique_ptr<TestSelectorEnv>> envs;
+    for (std::size_t i = 0; i<n; ++i) {
+        envs.push_back(make_unique<TestSelectorEnv>());
+        as[i] = int64_t(i%11) - 3;
+        if (i%4) {
+            aValid[i/8] |= 1 << (i%8);
+            envs.back()->set("A", as[i]);
+        }
+        const string b = i%3==0 ? "" : i%3==1 ? "xyz" : "y";
+        bData += b;
+        bOffsets.push_back(bData.size());
+        if (i%5) {
+            bValid[i/8] |= 1 << (i%8);
+            envs.back()->set("B", b.c_str());
+        }
+        // A second string column, sometimes equal to the first
+        const string g = i%4==0 ? "y" : i%4==1 ? "xyz" : "q";
+        gData += g;
+        gOffsets.push_back(gData.size());
+        envs.back()->set("G", g.c_str());
+        if (i%2) cs[i/8] |= 1 << (i%8);
+        envs.back()->set("C", bool(i%2));
+        ds[i] = double(i%7)/2;
+        envs.back()->set("D", ds[i]);
+        eValues[i+1] = int32_t(i%9);
+        envs.back()->set("E", selector::Value(int32_t(i%9)));
+    }
+    ColumnarEnv columns(n);
+    columns.add_int64s("A", as.data(), aValid.data());
+    columns.add_strings("B", bOffsets.data(), bData.data(), bValid.data());
+    columns.add_bools("C", cs.data());
+    columns.add_doubles("D", ds.data());
+    columns.add_int32s("E", eValues.data(), nullptr, 1);
+    columns.add_strings("G", gOffsets.data(), gData.data());
+    BOOST_CHECK_EQUAL(columns.rows(), n);
+    BOOST_CHECK(columns.column("B"));
+    BOOST_CHECK(!columns.column("F"));
+
+    const char* selectors[] = {
+        "A > 2 AND B LIKE 'x%'",
+        "A IS NULL OR B IS NULL",
+        "C AND D >= 1.5 OR E IN (1, 4, 7)",
+        "NOT C AND B = 'y' AND A + E < D * 2",
+        "F IS NULL AND B IN ('', 'y')",
+        "B = G",
+        "B <> G AND G > B"
+    };
+    for (auto sel : selectors) {
+        BOOST_MESSAGE("Columnar: " << sel);
+        auto e = make_selector(sel);
+        vector<uint8_t> results(n, 0xff);
+        eval_batch(*e, columns, results.data());
+        for (std::size_t i = 0; i<n; ++i) {
+            const BoolOrNone r = e->eval_bool(*envs[i]);
+            BOOST_CHECK_EQUAL(results[i], r);
+            columns.row(i);
+            BOOST_CHECK_EQUAL(e->eval_bool(columns), r);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 }}
@@ -0,0 +1,134 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorThreadPool.h"
+
+#include <algorithm>
+
+namespace selector {
+
+namespace {
+
+// The pool whose loop this thread is running iterations of, if any
+thread_local const ThreadPool* inside = nullptr;
+
+}
+
+ThreadPool::ThreadPool(unsigned n) :
+    generation(0),
+    joined(0),
+    busy(0),
+    stopping(false)
+{
+    if (n==0) {
+        unsigned cores = std::thread::hardware_concurrency();
+        n = cores > 1 ? cores-1 : 0;
+    }
+    loop.body = nullptr;
+    loop.n = 0;
+    loop.grain = 1;
+    loop.next = 0;
+    for (unsigned i = 0; i<n; ++i) workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers) w.join();
+}
+
+// Run iterations of the current loop until there are none left
+void ThreadPool::iterate()
+{
+    const ThreadPool* const outer = inside;
+    inside = this;
+    for (;;) {
+        const std::size_t first = loop.next.fetch_add(loop.grain, std::memory_order_relaxed);
+        if (first>=loop.n) break;
+        const std::size_t last = std::min(first + loop.grain, loop.n);
+        try {
+            for (std::size_t i = first; i<last; ++i) (*loop.body)(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> l(lock);
+            if (!loop.error) loop.error = std::current_exception();
+            // Hand out no more iterations
+            loop.next.store(loop.n, std::memory_order_relaxed);
+        }
+    }
+    inside = outer;
+}
+
+void ThreadPool::work()
+{
+    unsigned seen = 0;
+    std::unique_lock<std::mutex> l(lock);
+    for (;;) {
+        wake.wait(l, [&] { return stopping || generation!=seen; });
+        if (stopping) return;
+        seen = generation;
+        ++joined;
+        ++busy;
+        l.unlock();
+        iterate();
+        l.lock();
+        // The caller waits for every worker to join and leave the loop
+        if (--busy==0) finished.notify_all();
+    }
+}
+
+void ThreadPool::run(std::size_t n, const std::function<void(std::size_t)>& body)
+{
+    if (n==0) return;
+    if (inside==this) {
+        // The pool is busy with the loop this is nested in
+        for (std::size_t i = 0; i<n; ++i) body(i);
+        return;
+    }
+    std::lock_guard<std::mutex> r(running);
+    {
+        std::lock_guard<std::mutex> l(lock);
+        loop.body = &body;
+        loop.n = n;
+        // Small enough batches for the threads to balance the load
+        loop.grain = std::max<std::size_t>(1, n / (8*threads()));
+        loop.next.store(0, std::memory_order_relaxed);
+        ++generation;
+        joined = 0;
+    }
+    wake.notify_all();
+    iterate();
+    // Every worker must have taken up this loop and left it, so that none can
+    // still be reading it when the next one is set up, and then the iterations
+    // they took are done too
+    std::unique_lock<std::mutex> l(lock);
+    finished.wait(l, [&] { return joined==workers.size() && busy==0; });
+    loop.body = nullptr;
+    std::exception_ptr error;
+    std::swap(error, loop.error);
+    l.unlock();
+    if (error) std::rethrow_exception(error);
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef SELECTOR_THREAD_POOL_H
+#define SELECTOR_THREAD_POOL_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace selector {
+
+/**
+ * Fixed set of worker threads for running loops in parallel.
+ *
+ * run() shares out the iterations of a loop between the workers and the
+ * calling thread, each taking the next few iterations whenever it is free, so
+ * that uneven iterations balance out. Calls to run() from different threads
+ * are run one after another.
+ */
+class __attribute__((visibility("default")))
+ThreadPool {
+    struct Loop {
+        const std::function<void(std::size_t)>* body;
+        std::size_t n;
+        std::size_t grain;
+        std::atomic<std::size_t> next;
+        // The first exception thrown by body, guarded by lock
+        std::exception_ptr error;
+    };
+
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    // Serialises calls to run()
+    std::mutex running;
+    Loop loop;
+    unsigned generation;
+    // Workers that have taken up the current loop, and those still in it
+    unsigned joined;
+    unsigned busy;
+    bool stopping;
+
+    void work();
+    void iterate();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+public:
+    // With n workers as well as the calling thread; 0 for one per core besides
+    // the calling thread
+    explicit ThreadPool(unsigned n = 0);
+    ~ThreadPool();
+
+    // Threads that run the iterations of a loop, including the caller
+    unsigned threads() const {
+        return workers.size() + 1;
+    }
+
+    // Call body(i) for every i in [0, n) and return when they are all done.
+    // If body throws, no more iterations are started and the first exception
+    // is rethrown once every thread has left the loop. A run() from inside
+    // body runs its loop on the calling thread.
+    void run(std::size_t n, const std::function<void(std::size_t)>& body);
+};
+
+}
+
+#endif
@@ -25,7 +25,7 @@
 #include <algorithm>
 #include <iostream>
 #include <cassert>
-#include <cctype>
+#include <cstdint>
 
 namespace selector {
 
@@ -33,6 +33,11 @@ namespace selector {
 // if the tokenise is successful then the start iterator is advanced, if the tokenise fails then the start
 // iterator is unchanged.
 
+std::ostream& operator<<(std::ostream& os, const TokenText& t)
+{
+    return os.write(t.data(), t.size());
+}
+
 std::ostream& operator<<(std::ostream& os, const Token& t)
 {
     os << "T<" << t.type << ", " << t.val << ">";
@@ -43,64 +48,113 @@ TokenException::TokenException(const std::string& msg) :
     range_error(msg)
 {}
 
-// Lexically, reserved words are a subset of identifiers
-// so we parse an identifier first then check if it is a reserved word and
-// convert it if it is a reserved word
 namespace {
 
-struct RWEntry {
-    const char* word;
-    TokenType type;
+// Character classes of the selector syntax, independent of the locale (only
+// ASCII characters are in any class)
+enum CharClass : uint8_t {
+    C_SPACE = 1,
+    C_DIGIT = 2,
+    C_XDIGIT = 4,
+    C_IDENTIFIER_START = 8,
+    C_IDENTIFIER_PART = 16
+};
+
+struct CharTable {
+    uint8_t classes[256];
+    char lower[256];
 };
 
-inline bool caseless(const char* s1, const char* s2)
+constexpr CharTable makeCharTable()
 {
-    do {
-        char ls1 = std::tolower(*s1);
-        char ls2 = std::tolower(*s2);
-        if (ls1<ls2)
-            return true;
-        else if (ls1>ls2)
-            return false;
-    } while ( *s1++ && *s2++ );
-    // Equal
-    return false;
+    CharTable t{};
+    for (unsigned c = 0; c<256; ++c) {
+        uint8_t k = 0;
+        const bool digit = c>='0' && c<='9';
+        const bool upper = c>='A' && c<='Z';
+        const bool alpha = upper || (c>='a' && c<='z');
+        if (c==' ' || (c>='\t' && c<='\r')) k |= C_SPACE;
+        if (digit) k |= C_DIGIT;
+        if (digit || (c>='a' && c<='f') || (c>='A' && c<='F')) k |= C_XDIGIT;
+        if (alpha || c=='_' || c=='$') k |= C_IDENTIFIER_START | C_IDENTIFIER_PART;
+        if (digit || c=='.') k |= C_IDENTIFIER_PART;
+        t.classes[c] = k;
+        t.lower[c] = char(upper ? c + ('a'-'A') : c);
+    }
+    return t;
 }
 
-inline bool operator<(const RWEntry& lhs, const RWEntry& rhs) {
-    return caseless(lhs.word, rhs.word);
+constexpr CharTable charTable = makeCharTable();
+
+inline bool is(char c, CharClass k)
+{
+    return charTable.classes[uint8_t(c)] & k;
 }
 
+inline char lower(char c)
+{
+    return charTable.lower[uint8_t(c)];
 }
 
-bool tokeniseReservedWord(Token& tok)
+// True if t is word (which is in lower case) ignoring case
+inline bool caselessEqual(const TokenText& t, const char* word)
 {
-    // This must be sorted!!
-    static const RWEntry reserved[] = {
-        {"and", T_AND},
-        {"between", T_BETWEEN},
-        {"escape", T_ESCAPE},
-        {"false", T_FALSE},
-        {"in", T_IN},
-        {"is", T_IS},
-        {"like", T_LIKE},
-        {"not", T_NOT},
-        {"null", T_NULL},
-        {"or", T_OR},
-        {"true", T_TRUE}
-    };
+    for (char c : t) {
+        if (lower(c)!=*word++) return false;
+    }
+    return true;
+}
 
-    const int reserved_size = sizeof(reserved)/sizeof(RWEntry);
+}
 
+// Lexically, reserved words are a subset of identifiers
+// so we parse an identifier first then check if it is a reserved word and
+// convert it if it is a reserved word
+bool tokeniseReservedWord(Token& tok)
+{
     if ( tok.type != T_IDENTIFIER ) return false;
 
-    RWEntry rw;
-    rw.word = tok.val.c_str();
-    auto entry = std::equal_range(&reserved[0], &reserved[reserved_size], rw);
+    // The length and first letter leave at most one candidate
+    const TokenText& w = tok.val;
+    const char* word = 0;
+    TokenType type = T_IDENTIFIER;
+    switch (w.size()) {
+    case 2:
+        switch (lower(w[0])) {
+        case 'i':
+            if (lower(w[1])=='n') {word = "in"; type = T_IN;}
+            else {word = "is"; type = T_IS;}
+            break;
+        case 'o': word = "or"; type = T_OR; break;
+        }
+        break;
+    case 3:
+        switch (lower(w[0])) {
+        case 'a': word = "and"; type = T_AND; break;
+        case 'n': word = "not"; type = T_NOT; break;
+        }
+        break;
+    case 4:
+        switch (lower(w[0])) {
+        case 'l': word = "like"; type = T_LIKE; break;
+        case 'n': word = "null"; type = T_NULL; break;
+        case 't': word = "true"; type = T_TRUE; break;
+        }
+        break;
+    case 5:
+        if (lower(w[0])=='f') {word = "false"; type = T_FALSE;}
+        break;
+    case 6:
+        if (lower(w[0])=='e') {word = "escape"; type = T_ESCAPE;}
+        break;
+    case 7:
+        if (lower(w[0])=='b') {word = "between"; type = T_BETWEEN;}
+        break;
+    }
 
-    if ( entry.first==entry.second ) return false;
+    if ( !word || !caselessEqual(w, word) ) return false;
 
-    tok.type = entry.first->type;
+    tok.type = type;
     return true;
 }
 
@@ -112,30 +166,43 @@ bool processString(std::string::const_iterator& s, std::string::const_iterator&
     std::string::const_iterator q = std::find(s+1, e, quoteChar);
     if ( q==e ) return false;
 
-    std::string content(s+1, q);
-    ++q;
+    // Without embedded quotes the content is just a view of the input
+    if ( q+1==e || *(q+1)!=quoteChar ) {
+        tok = Token(type, s, TokenText(&*(s+1), q-(s+1)));
+        s = q+1;
+        return true;
+    }
+
+    // Find the end of the string before copying the content just once
+    std::string::const_iterator end = q;
+    std::size_t quotes = 0;
+    while ( end+1!=e && *(end+1)==quoteChar ) {
+        end = std::find(end+2, e, quoteChar);
+        if ( end==e ) return false;
+        ++quotes;
+    }
 
-    while ( q!=e && *q==quoteChar ) {
-        std::string::const_iterator p = q;
-        q = std::find(p+1, e, quoteChar);
-        if ( q==e ) return false;
-        content += std::string(p, q);
-        ++q;
+    std::string content;
+    content.reserve((end-s) - 1 - quotes);
+    for (std::string::const_iterator p = s+1; p!=end; ++p) {
+        content += *p;
+        // Skip the second quote of each pair
+        if ( *p==quoteChar ) ++p;
     }
 
     tok = Token(type, s, content);
-    s = q;
+    s = end+1;
     return true;
 }
 
 inline bool isIdentifierStart(char c)
 {
-    return std::isalpha(c) || c=='_' || c=='$';
+    return is(c, C_IDENTIFIER_START);
 }
 
 inline bool isIdentifierPart(char c)
 {
-    return std::isalnum(c) || c=='_' || c=='$' || c=='.';
+    return is(c, C_IDENTIFIER_PART);
 }
 
 bool tokenise(std::string::const_iterator& s, std::string::const_iterator& e, Token& tok)
@@ -168,8 +235,8 @@ bool tokenise(std::string::const_iterator& s, std::string::const_iterator& e, To
     while (true)
     switch (state) {
     case START:
-        if (t==e) {tok = Token(T_EOS, s, "<END>"); return true;}
-        else if (std::isspace(*t)) {++t; ++s; continue;}
+        if (t==e) {tok = Token(T_EOS, s, TokenText("<END>", 5)); return true;}
+        else if (is(*t, C_SPACE)) {++t; ++s; continue;}
         else switch (*t) {
         case '(': tokType = T_LPAREN; state = ACCEPT_INC; continue;
         case ')': tokType = T_RPAREN; state = ACCEPT_INC; continue;
@@ -198,7 +265,7 @@ bool tokenise(std::string::const_iterator& s, std::string::const_iterator& e, To
         else if (*t=='\'') {return processString(s, e, '\'', T_STRING, tok);}
         else if (*t=='\"') {return processString(s, e, '\"', T_IDENTIFIER, tok);}
         else if (*t=='0') {++t; state = ZERO;}
-        else if (std::isdigit(*t)) {++t; state = DIGIT;}
+        else if (is(*t, C_DIGIT)) {++t; state = DIGIT;}
         else if (*t=='.') {++t; state = DECIMAL_START;}
         else state = REJECT;
         continue;
@@ -209,18 +276,18 @@ bool tokenise(std::string::const_iterator& s, std::string::const_iterator& e, To
         continue;
     case DECIMAL_START:
         if (t==e) {state = REJECT;}
-        else if (std::isdigit(*t)) {++t; state = DECIMAL;}
+        else if (is(*t, C_DIGIT)) {++t; state = DECIMAL;}
         else state = REJECT;
         continue;
     case EXPONENT_SIGN:
         if (t==e) {state = REJECT;}
         else if (*t=='-' || *t=='+') {++t; state = EXPONENT_START;}
-        else if (std::isdigit(*t)) {++t; state = EXPONENT;}
+        else if (is(*t, C_DIGIT)) {++t; state = EXPONENT;}
         else state = REJECT;
         continue;
     case EXPONENT_START:
         if (t==e) {state = REJECT;}
-        else if (std::isdigit(*t)) {++t; state = EXPONENT;}
+        else if (is(*t, C_DIGIT)) {++t; state = EXPONENT;}
         else state = REJECT;
         continue;
     case ZERO:
@@ -232,13 +299,13 @@ bool tokenise(std::string::const_iterator& s, std::string::const_iterator& e, To
         continue;
     case HEXDIGIT_START:
         if (t==e) {state = REJECT;}
-        else if (std::isxdigit(*t)) {++t; state = HEXDIGIT;}
+        else if (is(*t, C_XDIGIT)) {++t; state = HEXDIGIT;}
         else state = REJECT;
         continue;
     case HEXDIGIT:
         if (t==e) {tokType = T_NUMERIC_EXACT; state = ACCEPT_NOINC;}
         else if (*t=='l' || *t=='L') {tokType = T_NUMERIC_EXACT; state = ACCEPT_INC;}
-        else if (std::isxdigit(*t) || *t=='_') {++t; state = HEXDIGIT;}
+        else if (is(*t, C_XDIGIT) || *t=='_') {++t; state = HEXDIGIT;}
         else if (*t=='p' || *t=='P') {++t; state = EXPONENT_SIGN;}
         else {tokType = T_NUMERIC_EXACT; state = ACCEPT_NOINC;}
         continue;
@@ -256,28 +323,28 @@ bool tokenise(std::string::const_iterator& s, std::string::const_iterator& e, To
     case OCTDIGIT:
         if (t==e) {tokType = T_NUMERIC_EXACT; state = ACCEPT_NOINC;}
         else if (*t=='l' || *t=='L') {tokType = T_NUMERIC_EXACT; state = ACCEPT_INC;}
-        else if ((std::isdigit(*t) && *t<'8') || *t=='_') {++t; state = OCTDIGIT;}
+        else if ((is(*t, C_DIGIT) && *t<'8') || *t=='_') {++t; state = OCTDIGIT;}
         else {tokType = T_NUMERIC_EXACT; state = ACCEPT_NOINC;}
         continue;
     case DIGIT:
         if (t==e) {tokType = T_NUMERIC_EXACT; state = ACCEPT_NOINC;}
         else if (*t=='l' || *t=='L') {tokType = T_NUMERIC_EXACT; state = ACCEPT_INC;}
         else if (*t=='f' || *t=='F' || *t=='d' || *t=='D') {tokType = T_NUMERIC_APPROX; state = ACCEPT_INC;}
-        else if (std::isdigit(*t) || *t=='_') {++t; state = DIGIT;}
+        else if (is(*t, C_DIGIT) || *t=='_') {++t; state = DIGIT;}
         else if (*t=='.') {++t; state = DECIMAL;}
         else if (*t=='e' || *t=='E') {++t; state = EXPONENT_SIGN;}
         else {tokType = T_NUMERIC_EXACT; state = ACCEPT_NOINC;}
         continue;
     case DECIMAL:
         if (t==e) {tokType = T_NUMERIC_APPROX; state = ACCEPT_NOINC;}
-        else if (std::isdigit(*t) || *t=='_') {++t; state = DECIMAL;}
+        else if (is(*t, C_DIGIT) || *t=='_') {++t; state = DECIMAL;}
         else if (*t=='e' || *t=='E') {++t; state = EXPONENT_SIGN;}
         else if (*t=='f' || *t=='F' || *t=='d' || *t=='D') {tokType = T_NUMERIC_APPROX; state = ACCEPT_INC;}
         else {tokType = T_NUMERIC_APPROX; state = ACCEPT_NOINC;}
         continue;
     case EXPONENT:
         if (t==e) {tokType = T_NUMERIC_APPROX; state = ACCEPT_NOINC;}
-        else if (std::isdigit(*t)) {++t; state = EXPONENT;}
+        else if (is(*t, C_DIGIT)) {++t; state = EXPONENT;}
         else if (*t=='f' || *t=='F' || *t=='d' || *t=='D') {tokType = T_NUMERIC_APPROX; state = ACCEPT_INC;}
         else {tokType = T_NUMERIC_APPROX; state = ACCEPT_NOINC;}
         continue;
@@ -303,6 +370,8 @@ Tokeniser::Tokeniser(const std::string::const_iterator& s, const std::string::co
     inp(s),
     inEnd(e)
 {
+    // Enough for most selectors without the vector growing
+    tokens.reserve(16);
 }
 
 /**
@@ -22,6 +22,9 @@
  *
  */
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 #include <iosfwd>
 #include <string>
 #include <stdexcept>
@@ -61,31 +64,110 @@ typedef enum {
     T_GREQ
 } TokenType;
 
+// The text of a token: a view of the selector it came from, unless the Token
+// had to unescape it
+class TokenText {
+    const char* text;
+    std::size_t length;
+
+public:
+    TokenText() :
+        text(""),
+        length(0)
+    {}
+
+    TokenText(const char* t, std::size_t n) :
+        text(t),
+        length(n)
+    {}
+
+    const char* data() const { return text; }
+    std::size_t size() const { return length; }
+    bool empty() const { return length==0; }
+    const char* begin() const { return text; }
+    const char* end() const { return text+length; }
+    char operator[](std::size_t i) const { return text[i]; }
+
+    std::string str() const { return std::string(text, length); }
+    operator std::string() const { return str(); }
+
+    bool operator==(const TokenText& r) const {
+        return length==r.length && std::equal(text, text+length, r.text);
+    }
+    bool operator==(const char* r) const {
+        return *this==TokenText(r, std::strlen(r));
+    }
+    bool operator!=(const TokenText& r) const { return !(*this==r); }
+};
+
+__attribute__((visibility("default")))
+std::ostream& operator<<(std::ostream& os, const TokenText& t);
+
+inline std::string& operator+=(std::string& s, const TokenText& t) {
+    return s.append(t.data(), t.size());
+}
+
 struct Token {
     TokenType type;
-    std::string val;
+    TokenText val;
     std::string::const_iterator tokenStart;
 
-    Token()
+private:
+    // Holds val when it isn't simply part of the input
+    std::string owned;
+
+    void own(const std::string& v) {
+        owned = v;
+        val = TokenText(owned.data(), owned.size());
+    }
+
+    void assign(const Token& r) {
+        type = r.type;
+        tokenStart = r.tokenStart;
+        if (r.val.data()==r.owned.data()) own(r.owned);
+        else val = r.val;
+    }
+
+public:
+    Token() :
+        type(T_EOS)
     {}
 
     Token(TokenType t, const std::string& v) :
-        type(t),
-        val(v)
-    {}
+        type(t)
+    {
+        own(v);
+    }
 
     Token(TokenType t, const std::string::const_iterator& s, const std::string& v) :
         type(t),
-        val(v),
         tokenStart(s)
-    {}
+    {
+        own(v);
+    }
 
     Token(TokenType t, const std::string::const_iterator& s, const std::string::const_iterator& e) :
         type(t),
-        val(std::string(s,e)),
+        val(s==e ? TokenText() : TokenText(&*s, e-s)),
         tokenStart(s)
     {}
 
+    // Only the input the token came from, not the token, needs to outlive val
+    Token(TokenType t, const std::string::const_iterator& s, const TokenText& v) :
+        type(t),
+        val(v),
+        tokenStart(s)
+    {}
+
+    Token(const Token& r) {
+        assign(r);
+    }
+
+    Token& operator=(const Token& r) {
+        if (this!=&r) assign(r);
+        return *this;
+    }
+
     bool operator==(const Token& r) const
     {
         return
@@ -40,6 +40,27 @@ ostream& operator<<(ostream& os, const Value& v)
     return os;
 }
 
+// The hash only uses the padding after type
+static_assert(sizeof(Value)==2*sizeof(int64_t), "Value must not grow");
+
+uint32_t stringHash(const char* s, std::size_t n)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (std::size_t i = 0; i<n; ++i) {
+        h ^= uint8_t(s[i]);
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+Value StringPool::intern(const std::string& s)
+{
+    // Elements of an unordered_set don't move when it rehashes
+    const Entry& e = *strings.insert(Entry{s, stringHash(s.data(), s.size())}).first;
+    return Value(e.text, e.hash);
+}
+
 inline void promoteNumeric(Value& v1, Value& v2)
 {
     if (!numeric(v1) || !numeric(v2)) return;
@@ -58,7 +79,7 @@ bool operator==(Value v1, Value v2)
 
     switch (v1.type) {
     case Value::T_BOOL:    return  v1.b == v2.b;
-    case Value::T_STRING:  return *v1.s == *v2.s;
+    case Value::T_STRING:  return v1.s==v2.s || (maybeEqual(v1, v2) && *v1.s == *v2.s);
     case Value::T_EXACT:   return  v1.i == v2.i;
     case Value::T_INEXACT: return  v1.x == v2.x;
     default:               return false;
@@ -72,7 +93,7 @@ bool operator!=(Value v1, Value v2)
 
     switch (v1.type) {
     case Value::T_BOOL:    return  v1.b != v2.b;
-    case Value::T_STRING:  return *v1.s != *v2.s;
+    case Value::T_STRING:  return v1.s!=v2.s && (!maybeEqual(v1, v2) || *v1.s != *v2.s);
     case Value::T_EXACT:   return  v1.i != v2.i;
     case Value::T_INEXACT: return  v1.x != v2.x;
     default:               return false;
@@ -82,6 +103,7 @@ bool operator!=(Value v1, Value v2)
 bool operator<(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return false;
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i < v2.i;
@@ -94,6 +116,7 @@ bool operator<(Value v1, Value v2)
 bool operator>(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return false;
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i > v2.i;
@@ -106,6 +129,7 @@ bool operator>(Value v1, Value v2)
 bool operator<=(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return false;
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i <= v2.i;
@@ -118,6 +142,7 @@ bool operator<=(Value v1, Value v2)
 bool operator>=(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return false;
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i >= v2.i;
@@ -139,6 +164,7 @@ BoolOrNone operator!(const Value& v)
 Value operator+(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return Value();
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i + v2.i;
@@ -151,6 +177,7 @@ Value operator+(Value v1, Value v2)
 Value operator-(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return Value();
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i - v2.i;
@@ -163,6 +190,7 @@ Value operator-(Value v1, Value v2)
 Value operator*(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return Value();
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i * v2.i;
@@ -175,6 +203,7 @@ Value operator*(Value v1, Value v2)
 Value operator/(Value v1, Value v2)
 {
     promoteNumeric(v1, v2);
+    if (!sameType(v1,v2)) return Value();
 
     switch (v1.type) {
     case Value::T_EXACT:   return v1.i / v2.i;
@@ -22,9 +22,11 @@
  *
  */
 
+#include <cstddef>
 #include <cstdint>
 #include <iosfwd>
 #include <string>
+#include <unordered_set>
 
 namespace selector {
 
@@ -34,9 +36,17 @@ enum BoolOrNone {
     BN_UNKNOWN
 };
 
+// Hash of a string used to tell strings apart quickly: never 0
+__attribute__((visibility("default")))
+uint32_t stringHash(const char* s, std::size_t n);
+
 // The user of the Value class for strings must ensure that
 // the string has a lifetime longer than the string used and
 // is responsible for managing its lifetime.
+//
+// A string Value can also carry the stringHash() of its string (otherwise
+// hash is 0). Two strings with different hashes are unequal without looking at
+// the strings, so Values that are compared with many others should be hashed.
 class Value {
 public:
     union {
@@ -52,45 +62,97 @@ public:
         T_EXACT,
         T_INEXACT
     } type;
+    uint32_t hash;
 
     // Default copy contructor
     // Default assignment operator
     // Default destructor
     Value() :
-        type(T_UNKNOWN)
+        type(T_UNKNOWN),
+        hash(0)
     {}
 
     Value(const std::string& s0) :
         s(&s0),
-        type(T_STRING)
+        type(T_STRING),
+        hash(0)
+    {}
+
+    Value(const std::string& s0, uint32_t h) :
+        s(&s0),
+        type(T_STRING),
+        hash(h)
     {}
 
     Value(const int64_t i0) :
         i(i0),
-        type(T_EXACT)
+        type(T_EXACT),
+        hash(0)
     {}
 
     Value(const int32_t i0) :
         i(i0),
-        type(T_EXACT)
+        type(T_EXACT),
+        hash(0)
     {}
 
     Value(const double x0) :
         x(x0),
-        type(T_INEXACT)
+        type(T_INEXACT),
+        hash(0)
     {}
 
     Value(bool b0) :
         b(b0),
-        type(T_BOOL)
+        type(T_BOOL),
+        hash(0)
     {}
 
     Value(BoolOrNone bn) :
         b(bn),
-        type(bn==BN_UNKNOWN ? T_UNKNOWN : T_BOOL)
+        type(bn==BN_UNKNOWN ? T_UNKNOWN : T_BOOL),
+        hash(0)
     {}
 };
 
+// A hashed string Value
+inline Value hashed(const std::string& s) {
+    return Value(s, stringHash(s.data(), s.size()));
+}
+
+// Two hashed strings are only equal if their hashes are
+inline bool maybeEqual(const Value& v1, const Value& v2) {
+    return !v1.hash || !v2.hash || v1.hash==v2.hash;
+}
+
+/**
+ * Keeps one copy of each distinct string, so that an Env can hand out hashed
+ * Values for them without hashing or allocating each time, and equal strings
+ * from the same pool are the same string.
+ *
+ * Not safe to intern into from multiple threads at once; Values from the pool
+ * can be read from any thread.
+ */
+class __attribute__((visibility("default")))
+StringPool {
+    struct Entry {
+        std::string text;
+        uint32_t hash;
+    };
+    struct Hash {
+        std::size_t operator()(const Entry& e) const { return e.hash; }
+    };
+    struct Equal {
+        bool operator()(const Entry& a, const Entry& b) const { return a.hash==b.hash && a.text==b.text; }
+    };
+    std::unordered_set<Entry, Hash, Equal> strings;
+
+public:
+    // The Value is valid for the life of the pool
+    Value intern(const std::string& s);
+    std::size_t size() const { return strings.size(); }
+};
+
 inline bool unknown(const Value& v) {
     return v.type == Value::T_UNKNOWN;
 }
@@ -0,0 +1,208 @@
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorValueSet.h"
+
+#include "SelectorCodec.h"
+
+#include "SelectorValue.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace selector {
+
+namespace {
+
+inline unsigned typeBit(unsigned type)
+{
+    return 1u << type;
+}
+
+const unsigned NUMERIC_TYPES = typeBit(Value::T_EXACT) | typeBit(Value::T_INEXACT);
+
+// Saved in order so that the same set always saves the same
+template <typename T, typename Lookup>
+std::vector<T> ordered(const Lookup& l)
+{
+    std::vector<T> vs;
+    vs.reserve(l.size());
+    l.each([&](const T& v) { vs.push_back(v); });
+    std::sort(vs.begin(), vs.end());
+    return vs;
+}
+
+}
+
+ValueSet::ValueSet() :
+    stringHashes(0),
+    bools(0),
+    types(0),
+    unknowns(false),
+    count(0)
+{}
+
+ValueSet::ValueSet(const std::vector<Value>& elements) :
+    stringHashes(0),
+    bools(0),
+    types(0),
+    unknowns(false),
+    count(elements.size())
+{
+    for (auto& v : elements) {
+        switch (v.type) {
+        case Value::T_UNKNOWN:
+            unknowns = true;
+            continue;
+        case Value::T_BOOL:
+            bools |= 1u << v.b;
+            break;
+        case Value::T_STRING:
+            strings.add(*v.s);
+            stringHashes |= uint64_t(1) << stringHash(v.s->data(), v.s->size())%64;
+            break;
+        case Value::T_EXACT:
+            exacts.add(v.i);
+            promotedExacts.add(double(v.i));
+            break;
+        case Value::T_INEXACT:
+            // NaN is never equal to anything
+            if (!std::isnan(v.x)) inexacts.add(v.x);
+            break;
+        }
+        types |= typeBit(v.type);
+    }
+    exacts.finish();
+    inexacts.finish();
+    promotedExacts.finish();
+    strings.finish();
+}
+
+// Equivalent to v==e for some element e
+bool ValueSet::contains(const Value& v) const
+{
+    switch (v.type) {
+    case Value::T_BOOL:    return bools & (1u << v.b);
+    case Value::T_STRING:  return (!v.hash || stringHashes & (uint64_t(1) << v.hash%64)) && strings.contains(*v.s);
+    case Value::T_EXACT:   return exacts.contains(v.i) || inexacts.contains(double(v.i));
+    case Value::T_INEXACT: return inexacts.contains(v.x) || promotedExacts.contains(v.x);
+    default:               return false;
+    }
+}
+
+// Is there an element neither the same type as v nor numeric like v
+bool ValueSet::incompatible(const Value& v) const
+{
+    return types & ~(numeric(v) ? NUMERIC_TYPES : typeBit(v.type));
+}
+
+BoolOrNone ValueSet::in(const Value& v) const
+{
+    if (unknown(v)) return BN_UNKNOWN;
+    if (contains(v)) return BN_TRUE;
+    return unknowns ? BN_UNKNOWN : BN_FALSE;
+}
+
+BoolOrNone ValueSet::notIn(const Value& v) const
+{
+    if (unknown(v)) return BN_UNKNOWN;
+    if (contains(v)) return BN_FALSE;
+    if (unknowns) return BN_UNKNOWN;
+    return incompatible(v) ? BN_FALSE : BN_TRUE;
+}
+
+void ValueSet::save(Encoder& e) const
+{
+    e.u32(count);
+    e.u8(bools);
+    e.u8(types);
+    e.u8(unknowns);
+    e.u64(stringHashes);
+    const auto es = ordered<int64_t>(exacts);
+    e.u32(es.size());
+    for (auto v : es) e.u64(v);
+    const auto xs = ordered<double>(inexacts);
+    e.u32(xs.size());
+    for (auto v : xs) e.f64(v);
+    const auto ss = ordered<std::string>(strings);
+    e.u32(ss.size());
+    for (auto& v : ss) e.str(v);
+}
+
+ValueSet ValueSet::load(Decoder& d)
+{
+    ValueSet s;
+    s.count = d.u32();
+    s.bools = d.u8();
+    s.types = d.u8();
+    const unsigned unknowns = d.u8();
+    const uint64_t stringHashes = d.u64();
+    if (s.bools>3 || s.types>=typeBit(Value::T_INEXACT+1) || unknowns>1) Decoder::fail("bad IN list");
+    s.unknowns = unknowns;
+
+    // The elements were saved in order without duplicates, and the fields
+    // above must be those they give
+    const uint32_t nExacts = d.count(8);
+    int64_t lastExact = 0;
+    for (uint32_t i = 0; i<nExacts; ++i) {
+        const int64_t v = d.u64();
+        if (i>0 && v<=lastExact) Decoder::fail("bad IN list");
+        lastExact = v;
+        s.exacts.add(v);
+        s.promotedExacts.add(double(v));
+    }
+    const uint32_t nInexacts = d.count(8);
+    double lastInexact = 0;
+    for (uint32_t i = 0; i<nInexacts; ++i) {
+        const double v = d.f64();
+        if (std::isnan(v) || (i>0 && !(v>lastInexact))) Decoder::fail("bad IN list");
+        lastInexact = v;
+        s.inexacts.add(v);
+    }
+    const uint32_t nStrings = d.count(4);
+    std::string lastString;
+    for (uint32_t i = 0; i<nStrings; ++i) {
+        std::string v = d.str();
+        if (i>0 && v<=lastString) Decoder::fail("bad IN list");
+        s.stringHashes |= uint64_t(1) << stringHash(v.data(), v.size())%64;
+        s.strings.add(v);
+        lastString = std::move(v);
+    }
+
+    // Only NaN elements give an inexact type with no inexact elements
+    const unsigned nans = (s.types & typeBit(Value::T_INEXACT)) && nInexacts==0;
+    const unsigned types =
+        (s.bools ? typeBit(Value::T_BOOL) : 0) |
+        (nStrings ? typeBit(Value::T_STRING) : 0) |
+        (nExacts ? typeBit(Value::T_EXACT) : 0) |
+        (nInexacts || nans ? typeBit(Value::T_INEXACT) : 0);
+    const std::size_t elements = std::size_t(nExacts) + nInexacts + nStrings + nans + s.unknowns + (s.bools & 1) + (s.bools >> 1);
+    if (s.types!=types || stringHashes!=s.stringHashes || s.count<elements) Decoder::fail("bad IN list");
+
+    s.exacts.finish();
+    s.inexacts.finish();
+    s.promotedExacts.finish();
+    s.strings.finish();
+    return s;
+}
+
+}
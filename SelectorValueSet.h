@@ -0,0 +1,143 @@
+#ifndef SELECTOR_VALUESET_H
+#define SELECTOR_VALUESET_H
+
+/*
+ *
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ *
+ */
+
+#include "SelectorMemory.h"
+#include "SelectorValue.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace selector {
+
+class Decoder;
+class Encoder;
+
+/**
+ * The constant elements of an IN or NOT IN list, prebuilt for fast lookup.
+ *
+ * Gives exactly the same results as testing each element of the list in
+ * turn, including the effect of unknown elements and elements of a type
+ * incompatible with the value tested.
+ */
+class ValueSet {
+    // Lookups with no more elements than this are a sorted array, larger ones are hashed
+    static const std::size_t SMALL = 16;
+
+    // Heap memory held by an element
+    static std::size_t owned(int64_t) { return 0; }
+    static std::size_t owned(double) { return 0; }
+    static std::size_t owned(const std::string& s) { return heapMemory(s); }
+
+    template <typename T>
+    class Lookup {
+        std::vector<T> sorted;
+        std::unordered_set<T> hashed;
+
+    public:
+        void add(const T& v) {
+            sorted.push_back(v);
+        }
+
+        void finish() {
+            if (sorted.size()>SMALL) {
+                hashed.insert(sorted.begin(), sorted.end());
+                std::vector<T>().swap(sorted);
+            } else {
+                std::sort(sorted.begin(), sorted.end());
+                sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+                sorted.shrink_to_fit();
+            }
+        }
+
+        bool contains(const T& v) const {
+            return hashed.empty() ?
+                std::binary_search(sorted.begin(), sorted.end(), v) :
+                hashed.count(v)>0;
+        }
+
+        std::size_t size() const {
+            return sorted.size() + hashed.size();
+        }
+
+        template <typename F>
+        void each(F f) const {
+            for (auto& v : sorted) f(v);
+            for (auto& v : hashed) f(v);
+        }
+
+        std::size_t memory() const {
+            // A hashed element is a node also holding a link and its hash
+            std::size_t n = heapMemory(sorted) + hashed.bucket_count()*sizeof(void*) +
+                hashed.size()*(sizeof(T) + 2*sizeof(void*));
+            each([&n](const T& v) { n += owned(v); });
+            return n;
+        }
+    };
+
+    Lookup<int64_t> exacts;
+    Lookup<double> inexacts;
+    // The exact elements promoted for comparison with inexact values
+    Lookup<double> promotedExacts;
+    Lookup<std::string> strings;
+    // Bit hash%64 set for each string, to reject most hashed strings not in the list
+    uint64_t stringHashes;
+    unsigned bools;     // Bit 0 set for FALSE, bit 1 for TRUE
+    unsigned types;     // Bit set for each Value::type in the list
+    bool unknowns;
+    std::size_t count;
+
+    bool contains(const Value&) const;
+    bool incompatible(const Value&) const;
+
+    ValueSet();
+
+public:
+    // Elements may be unknown
+    explicit ValueSet(const std::vector<Value>& elements);
+
+    BoolOrNone in(const Value&) const;
+    BoolOrNone notIn(const Value&) const;
+
+    // Number of elements in the original list
+    std::size_t size() const {
+        return count;
+    }
+
+    // Heap memory held, see memory_usage()
+    std::size_t memory() const {
+        return exacts.memory() + inexacts.memory() + promotedExacts.memory() + strings.memory();
+    }
+
+    // The set as built, for a saved Program
+    void save(Encoder&) const;
+    static ValueSet load(Decoder&);
+};
+
+}
+
+#endif